@@ -5,7 +5,14 @@
 #ifndef _H_MSE_PLATFORM_BITMAP
 #define _H_MSE_PLATFORM_BITMAP
 
+#include <string.h>
+#include <endian.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #define BYTE_SHIFT 3
+#define WORD_SHIFT 6
 
 static inline int
 mu_bitmap_size(int num_blocks)
@@ -13,6 +20,19 @@ mu_bitmap_size(int num_blocks)
 	return((num_blocks + 8 - 1) >> BYTE_SHIFT);
 }
 
+/**
+ * mu_bitmap_alloc_size()
+ *
+ * Bytes to allocate for a bitmap of @num_blocks bits that is used with the word
+ * routines below (which read and write whole 64-bit words), plus one more word
+ * since mu_bitmap_foreach() accesses 1 bit past the end
+ */
+static inline u64
+mu_bitmap_alloc_size(u64 num_blocks)
+{
+	return (((num_blocks + 63) >> WORD_SHIFT) + 1) * sizeof(u64);
+}
+
 #define mu_bitmap_foreach(bitmap, max_blk, index, value)	\
 	for (index = 0, value = mu_bitmap_test(bitmap, index);	\
 	     index < max_blk;					\
@@ -98,6 +118,173 @@ mu_bitmap_test_and_clear(u8 *bitmap, s64 index)
 	return 1;
 }
 
+/*
+ * Word-at-a-time routines for 64-bit offsets
+ *
+ * Bit i of the bitmap is bit (i % 8) of byte (i / 8), so 64-bit word w (loaded
+ * little-endian) holds bits 64w through 64w + 63 in order.
+ */
+
+static inline u64
+mu_bitmap_word(const u8 *bitmap, u64 w)
+{
+	u64 word;
+
+	memcpy(&word, &bitmap[w << BYTE_SHIFT], sizeof(word));
+	return le64toh(word);
+}
+
+static inline void
+mu_bitmap_put_word(u8 *bitmap, u64 w, u64 word)
+{
+	word = htole64(word);
+	memcpy(&bitmap[w << BYTE_SHIFT], &word, sizeof(word));
+}
+
+/* Mask of the bits in the word of bit @index, from @index up to (not including) @end */
+static inline u64
+mu_bitmap_mask(u64 index, u64 end)
+{
+	u64 first = index & 63;
+	u64 n = end - index;
+
+	if (n >= 64 - first)
+		return ~0ULL << first;
+	return ((1ULL << n) - 1) << first;
+}
+
+/* Number of bits set in [@index, @index + @n) */
+static inline u64
+mu_bitmap_count_range(const u8 *bitmap, u64 index, u64 n)
+{
+	u64 end = index + n;
+	u64 count = 0;
+	u64 mask;
+
+	for (; index < end; index = (index | 63) + 1) {
+		mask = mu_bitmap_mask(index, end);
+		count += __builtin_popcountll(mu_bitmap_word(bitmap, index >> WORD_SHIFT) & mask);
+	}
+	return count;
+}
+
+/* Set bits [@index, @index + @n) */
+static inline void
+mu_bitmap_set_range(u8 *bitmap, u64 index, u64 n)
+{
+	u64 end = index + n;
+	u64 w;
+
+	for (; index < end; index = (index | 63) + 1) {
+		w = index >> WORD_SHIFT;
+		mu_bitmap_put_word(bitmap, w,
+				   mu_bitmap_word(bitmap, w) | mu_bitmap_mask(index, end));
+	}
+}
+
+/* Clear bits [@index, @index + @n) */
+static inline void
+mu_bitmap_clear_range(u8 *bitmap, u64 index, u64 n)
+{
+	u64 end = index + n;
+	u64 w;
+
+	for (; index < end; index = (index | 63) + 1) {
+		w = index >> WORD_SHIFT;
+		mu_bitmap_put_word(bitmap, w,
+				   mu_bitmap_word(bitmap, w) & ~mu_bitmap_mask(index, end));
+	}
+}
+
+#if defined(__x86_64__)
+/*
+ * Skip words that are all ones, 256 bits at a time. Returns the first word at or
+ * after @w that is in a 32-byte block that is not all ones (or the last, partial block)
+ */
+__attribute__((target("avx2")))
+static inline u64
+mu_bitmap_skip_full_avx2(const u8 *bitmap, u64 w, u64 nwords)
+{
+	const __m256i ones = _mm256_set1_epi64x(-1);
+
+	for (; w + 4 <= nwords; w += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&bitmap[w << BYTE_SHIFT]);
+
+		if (!_mm256_testc_si256(v, ones))
+			break;
+	}
+	return w;
+}
+#endif
+
+/* Skip words that are all ones, if that can be done faster than one word at a time */
+static inline u64
+mu_bitmap_skip_full(const u8 *bitmap, u64 w, u64 nwords)
+{
+#if defined(__x86_64__)
+	if (nwords - w >= 8 && __builtin_cpu_supports("avx2"))
+		return mu_bitmap_skip_full_avx2(bitmap, w, nwords);
+#endif
+	(void)bitmap;
+	(void)nwords;
+	return w;
+}
+
+/**
+ * mu_bitmap_find_zero()
+ *
+ * Return value: the first clear bit in [@index, @nbits), or @nbits if there is none
+ */
+static inline u64
+mu_bitmap_find_zero(const u8 *bitmap, u64 index, u64 nbits)
+{
+	u64 nwords = (nbits + 63) >> WORD_SHIFT;
+	u64 w = index >> WORD_SHIFT;
+	u64 word;
+
+	if (index >= nbits)
+		return nbits;
+
+	word = ~mu_bitmap_word(bitmap, w) & (~0ULL << (index & 63));
+	if (!word) {
+		/* Allocated space tends to be in long runs */
+		for (w = mu_bitmap_skip_full(bitmap, w + 1, nwords); w < nwords; w++) {
+			word = ~mu_bitmap_word(bitmap, w);
+			if (word)
+				break;
+		}
+		if (w >= nwords)
+			return nbits;
+	}
+	index = (w << WORD_SHIFT) + __builtin_ctzll(word);
+	return (index < nbits) ? index : nbits;
+}
+
+/**
+ * mu_bitmap_find_one()
+ *
+ * Return value: the first set bit in [@index, @end), or @end if there is none
+ */
+static inline u64
+mu_bitmap_find_one(const u8 *bitmap, u64 index, u64 end)
+{
+	u64 nwords = (end + 63) >> WORD_SHIFT;
+	u64 w = index >> WORD_SHIFT;
+	u64 word;
+
+	if (index >= end)
+		return end;
+
+	word = mu_bitmap_word(bitmap, w) & (~0ULL << (index & 63));
+	while (!word) {
+		if (++w >= nwords)
+			return end;
+		word = mu_bitmap_word(bitmap, w);
+	}
+	index = (w << WORD_SHIFT) + __builtin_ctzll(word);
+	return (index < end) ? index : end;
+}
+
 /*
  * Inline routines for 32-bit offsets
  */
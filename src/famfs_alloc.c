@@ -0,0 +1,557 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2023-2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+/*
+ * famfs free space index
+ *
+ * The allocation bitmap is the record of what is allocated (it is what fsck checks),
+ * but searching it for a free run is linear in the size of the device. The free
+ * index is built from the bitmap once per locked log and kept in step with it, and
+ * answers "where does an extent of this size go" in O(log n) of the number of free
+ * extents, under any of the allocation policies.
+ *
+ * Both orders are treaps (randomized binary search trees) that share their nodes and
+ * priorities; they are manipulated with split and merge, which keeps the code short.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/types.h>
+#include <linux/uuid.h>
+
+#include "famfs_meta.h"
+#include "famfs_alloc.h"
+#include "bitmap.h"
+
+enum {
+	BY_OFFSET = 0,
+	BY_LEN,
+};
+
+struct famfs_free_ext {
+	u64                    start;
+	u64                    len;
+	u64                    max_len;     /* Largest extent in the BY_OFFSET subtree */
+	u32                    prio;
+	struct famfs_free_ext *child[2][2]; /* [tree][0: left, 1: right] */
+};
+
+static u32
+famfs_free_prio(struct famfs_free_index *fi)
+{
+	/* xorshift32 */
+	fi->seed ^= fi->seed << 13;
+	fi->seed ^= fi->seed >> 17;
+	fi->seed ^= fi->seed << 5;
+	return fi->seed;
+}
+
+/* Is @e ordered before the key (@len, @start) in tree @t? */
+static inline int
+famfs_free_before(int t, const struct famfs_free_ext *e, u64 len, u64 start)
+{
+	if (t == BY_LEN && e->len != len)
+		return e->len < len;
+	return e->start < start;
+}
+
+static inline void
+famfs_free_update(int t, struct famfs_free_ext *e)
+{
+	struct famfs_free_ext *l = e->child[t][0];
+	struct famfs_free_ext *r = e->child[t][1];
+
+	if (t != BY_OFFSET)
+		return;
+	e->max_len = e->len;
+	if (l && l->max_len > e->max_len)
+		e->max_len = l->max_len;
+	if (r && r->max_len > e->max_len)
+		e->max_len = r->max_len;
+}
+
+/* Split @e into the nodes before the key (@l_out) and the rest (@r_out) */
+static void
+famfs_free_split(
+	int                     t,
+	struct famfs_free_ext  *e,
+	u64                     len,
+	u64                     start,
+	struct famfs_free_ext **l_out,
+	struct famfs_free_ext **r_out)
+{
+	if (!e) {
+		*l_out = *r_out = NULL;
+		return;
+	}
+	if (famfs_free_before(t, e, len, start)) {
+		famfs_free_split(t, e->child[t][1], len, start, &e->child[t][1], r_out);
+		*l_out = e;
+	} else {
+		famfs_free_split(t, e->child[t][0], len, start, l_out, &e->child[t][0]);
+		*r_out = e;
+	}
+	famfs_free_update(t, e);
+}
+
+/* Merge two treaps; every node of @a is ordered before every node of @b */
+static struct famfs_free_ext *
+famfs_free_merge(int t, struct famfs_free_ext *a, struct famfs_free_ext *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio) {
+		a->child[t][1] = famfs_free_merge(t, a->child[t][1], b);
+		famfs_free_update(t, a);
+		return a;
+	}
+	b->child[t][0] = famfs_free_merge(t, a, b->child[t][0]);
+	famfs_free_update(t, b);
+	return b;
+}
+
+static struct famfs_free_ext **
+famfs_free_root(struct famfs_free_index *fi, int t)
+{
+	return (t == BY_OFFSET) ? &fi->by_offset : &fi->by_len;
+}
+
+static void
+famfs_free_link(struct famfs_free_index *fi, struct famfs_free_ext *e)
+{
+	struct famfs_free_ext *l, *r;
+	int t;
+
+	for (t = BY_OFFSET; t <= BY_LEN; t++) {
+		e->child[t][0] = e->child[t][1] = NULL;
+		famfs_free_update(t, e);
+		famfs_free_split(t, *famfs_free_root(fi, t), e->len, e->start, &l, &r);
+		*famfs_free_root(fi, t) = famfs_free_merge(t, famfs_free_merge(t, l, e), r);
+	}
+	fi->nexts++;
+	fi->free_units += e->len;
+}
+
+static void
+famfs_free_unlink(struct famfs_free_index *fi, struct famfs_free_ext *e)
+{
+	struct famfs_free_ext *l, *m, *r;
+	int t;
+
+	for (t = BY_OFFSET; t <= BY_LEN; t++) {
+		famfs_free_split(t, *famfs_free_root(fi, t), e->len, e->start, &l, &r);
+		famfs_free_split(t, r, e->len, e->start + 1, &m, &r);
+		assert(m == e);
+		*famfs_free_root(fi, t) = famfs_free_merge(t, l, r);
+	}
+	fi->nexts--;
+	fi->free_units -= e->len;
+}
+
+/* The free extent with the highest start that is <= @start, or NULL */
+static struct famfs_free_ext *
+famfs_free_floor(const struct famfs_free_index *fi, u64 start)
+{
+	struct famfs_free_ext *e = fi->by_offset;
+	struct famfs_free_ext *found = NULL;
+
+	while (e) {
+		if (e->start <= start) {
+			found = e;
+			e = e->child[BY_OFFSET][1];
+		} else {
+			e = e->child[BY_OFFSET][0];
+		}
+	}
+	return found;
+}
+
+/* The free extent with the lowest start that is > @start, or NULL */
+static struct famfs_free_ext *
+famfs_free_above(const struct famfs_free_index *fi, u64 start)
+{
+	struct famfs_free_ext *e = fi->by_offset;
+	struct famfs_free_ext *found = NULL;
+
+	while (e) {
+		if (e->start > start) {
+			found = e;
+			e = e->child[BY_OFFSET][0];
+		} else {
+			e = e->child[BY_OFFSET][1];
+		}
+	}
+	return found;
+}
+
+/* Where an extent of @len would go in @e if it must be aligned to @align, or -1 */
+static inline s64
+famfs_free_fit(const struct famfs_free_ext *e, u64 len, u64 align)
+{
+	u64 start = (e->start + align - 1) & ~(align - 1);
+
+	if (start + len > e->start + e->len)
+		return -1;
+	return start;
+}
+
+/*
+ * The lowest extent that starts at or after @min_start and has room for @len at
+ * @align. Subtrees whose largest extent is too small are not visited.
+ */
+static struct famfs_free_ext *
+famfs_free_first_fit(struct famfs_free_ext *e, u64 min_start, u64 len, u64 align)
+{
+	struct famfs_free_ext *found;
+
+	if (!e || e->max_len < len)
+		return NULL;
+	if (e->start < min_start)
+		return famfs_free_first_fit(e->child[BY_OFFSET][1], min_start, len, align);
+
+	found = famfs_free_first_fit(e->child[BY_OFFSET][0], min_start, len, align);
+	if (found)
+		return found;
+	if (famfs_free_fit(e, len, align) >= 0)
+		return e;
+	return famfs_free_first_fit(e->child[BY_OFFSET][1], min_start, len, align);
+}
+
+/* The smallest extent with at least @len, lowest offset first */
+static struct famfs_free_ext *
+famfs_free_best_fit(const struct famfs_free_index *fi, u64 len)
+{
+	struct famfs_free_ext *e = fi->by_len;
+	struct famfs_free_ext *found = NULL;
+
+	while (e) {
+		if (e->len >= len) {
+			found = e;
+			e = e->child[BY_LEN][0];
+		} else {
+			e = e->child[BY_LEN][1];
+		}
+	}
+	return found;
+}
+
+/* Take [@start, @start + @len) out of free extent @e */
+static int
+famfs_free_carve(struct famfs_free_index *fi, struct famfs_free_ext *e, u64 start, u64 len)
+{
+	u64 end = e->start + e->len;
+	struct famfs_free_ext *tail;
+
+	famfs_free_unlink(fi, e);
+	if (start + len < end) {
+		if (start == e->start) {
+			tail = e;
+			e = NULL;
+		} else {
+			tail = calloc(1, sizeof(*tail));
+			if (!tail) {
+				famfs_free_link(fi, e);
+				return -ENOMEM;
+			}
+			tail->prio = famfs_free_prio(fi);
+		}
+		tail->start = start + len;
+		tail->len   = end - tail->start;
+		famfs_free_link(fi, tail);
+	}
+	if (e && start > e->start) {
+		e->len = start - e->start;
+		famfs_free_link(fi, e);
+	} else if (e) {
+		free(e);
+	}
+	return 0;
+}
+
+/**
+ * famfs_free_index_insert()
+ *
+ * Add a free range, merging it with the free extents on either side
+ *
+ * Returns 0 on success, -EINVAL if any of the range is already free, -ENOMEM
+ */
+int
+famfs_free_index_insert(struct famfs_free_index *fi, u64 start, u64 len)
+{
+	struct famfs_free_ext *prev, *next, *e = NULL;
+
+	if (!len)
+		return 0;
+	prev = famfs_free_floor(fi, start);
+	next = famfs_free_above(fi, start);
+	if ((prev && prev->start + prev->len > start) || (next && next->start < start + len))
+		return -EINVAL;
+
+	if (prev && prev->start + prev->len == start) {
+		famfs_free_unlink(fi, prev);
+		len += prev->len;
+		start = prev->start;
+		e = prev;
+	}
+	if (next && next->start == start + len) {
+		famfs_free_unlink(fi, next);
+		len += next->len;
+		if (e) {
+			free(next);
+		} else {
+			e = next;
+		}
+	}
+	if (!e) {
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+		e->prio = famfs_free_prio(fi);
+	}
+	e->start = start;
+	e->len   = len;
+	famfs_free_link(fi, e);
+	return 0;
+}
+
+/**
+ * famfs_free_index_reserve()
+ *
+ * Take a specific range out of the free space
+ *
+ * Returns 0 on success, -EINVAL if any of the range is not free, -ENOMEM
+ */
+int
+famfs_free_index_reserve(struct famfs_free_index *fi, u64 start, u64 len)
+{
+	struct famfs_free_ext *e = famfs_free_floor(fi, start);
+
+	if (!len)
+		return 0;
+	if (!e || e->start + e->len < start + len)
+		return -EINVAL;
+	return famfs_free_carve(fi, e, start, len);
+}
+
+/**
+ * famfs_free_index_alloc()
+ *
+ * Allocate @len units
+ *
+ * @fi
+ * @len    - units to allocate
+ * @policy - where to put them:
+ *           FAMFS_ALLOC_FIRST_FIT:   the lowest offset with room
+ *           FAMFS_ALLOC_NEXT_FIT:    the lowest offset with room at or after @cursor,
+ *                                    wrapping around to the start
+ *           FAMFS_ALLOC_BEST_FIT:    the start of the smallest free extent with room
+ *           FAMFS_ALLOC_ALIGNED_FIT: the lowest offset that is a multiple of the
+ *                                    largest power of 2 <= @len (up to
+ *                                    @fi->align_max); best fit if there
+ *                                    is none
+ *           FAMFS_ALLOC_GROUP_FIT:   next fit (regions are reserved per group by the
+ *                                    caller, which falls back to this)
+ * @cursor - for next fit: usually the end of the previous allocation
+ *
+ * Returns the offset of the allocation, or -1 if there is no room
+ */
+s64
+famfs_free_index_alloc(
+	struct famfs_free_index *fi,
+	u64                      len,
+	enum famfs_alloc_policy  policy,
+	u64                      cursor)
+{
+	struct famfs_free_ext *e = NULL;
+	u64 align = 1;
+	s64 start;
+
+	if (!len)
+		return -1;
+
+	switch (policy) {
+	case FAMFS_ALLOC_NEXT_FIT:
+	case FAMFS_ALLOC_GROUP_FIT:
+		/* The rest of the extent the cursor is in, then the ones after it */
+		e = famfs_free_floor(fi, cursor);
+		if (e && e->start + e->len >= cursor + len) {
+			start = cursor;
+			break;
+		}
+		e = famfs_free_first_fit(fi->by_offset, cursor, len, 1);
+		if (!e)
+			e = famfs_free_first_fit(fi->by_offset, 0, len, 1);
+		start = (e) ? (s64)e->start : -1;
+		break;
+	case FAMFS_ALLOC_BEST_FIT:
+		e = famfs_free_best_fit(fi, len);
+		start = (e) ? (s64)e->start : -1;
+		break;
+	case FAMFS_ALLOC_ALIGNED_FIT:
+		while (align * 2 <= len && align * 2 <= fi->align_max)
+			align *= 2;
+		e = famfs_free_first_fit(fi->by_offset, 0, len, align);
+		if (e) {
+			start = famfs_free_fit(e, len, align);
+			break;
+		}
+		e = famfs_free_best_fit(fi, len);
+		start = (e) ? (s64)e->start : -1;
+		break;
+	case FAMFS_ALLOC_FIRST_FIT:
+	default:
+		e = famfs_free_first_fit(fi->by_offset, 0, len, 1);
+		start = (e) ? (s64)e->start : -1;
+		break;
+	}
+	if (!e || start < 0)
+		return -1;
+	if (famfs_free_carve(fi, e, start, len))
+		return -1;
+	return start;
+}
+
+/**
+ * famfs_free_index_build()
+ *
+ * Index the runs of clear bits in @bitmap
+ *
+ * Returns 0 on success, -ENOMEM
+ */
+int
+famfs_free_index_build(struct famfs_free_index *fi, const u8 *bitmap, u64 nbits)
+{
+	u64 i, j;
+	int rc;
+
+	memset(fi, 0, sizeof(*fi));
+	fi->seed = 0x9e3779b9;
+	fi->align_max = FAMFS_ALLOC_ALIGN_MAX_UNITS;
+	for (i = mu_bitmap_find_zero(bitmap, 0, nbits); i < nbits;
+	     i = mu_bitmap_find_zero(bitmap, j, nbits)) {
+		j = mu_bitmap_find_one(bitmap, i, nbits);
+		rc = famfs_free_index_insert(fi, i, j - i);
+		if (rc) {
+			famfs_free_index_destroy(fi);
+			return rc;
+		}
+	}
+	return 0;
+}
+
+static void
+famfs_free_destroy(struct famfs_free_ext *e)
+{
+	if (!e)
+		return;
+	famfs_free_destroy(e->child[BY_OFFSET][0]);
+	famfs_free_destroy(e->child[BY_OFFSET][1]);
+	free(e);
+}
+
+void
+famfs_free_index_destroy(struct famfs_free_index *fi)
+{
+	famfs_free_destroy(fi->by_offset);
+	memset(fi, 0, sizeof(*fi));
+}
+
+/* Length of the largest free extent */
+u64
+famfs_free_index_largest(const struct famfs_free_index *fi)
+{
+	return (fi->by_offset) ? fi->by_offset->max_len : 0;
+}
+
+static int
+famfs_free_check_subtree(
+	const struct famfs_free_ext  *e,
+	const u8                     *bitmap,
+	u64                           nbits,
+	u64                          *next_start,
+	u64                          *nexts)
+{
+	u64 max_len = e->len;
+	int t;
+
+	if (e->child[BY_OFFSET][0]) {
+		if (famfs_free_check_subtree(e->child[BY_OFFSET][0], bitmap, nbits,
+					     next_start, nexts))
+			return -1;
+	}
+	/* Maximal run of clear bits, after the previous one */
+	if (e->start < *next_start || e->start + e->len > nbits || !e->len
+	    || mu_bitmap_count_range(bitmap, e->start, e->len)
+	    || (e->start > 0 && !mu_bitmap_test((u8 *)bitmap, e->start - 1))
+	    || (e->start + e->len < nbits && !mu_bitmap_test((u8 *)bitmap, e->start + e->len)))
+		return -1;
+	*next_start = e->start + e->len + 1;
+	(*nexts)++;
+
+	if (e->child[BY_OFFSET][1]) {
+		if (famfs_free_check_subtree(e->child[BY_OFFSET][1], bitmap, nbits,
+					     next_start, nexts))
+			return -1;
+	}
+	for (t = 0; t < 2; t++) {
+		if (e->child[BY_OFFSET][t] && e->child[BY_OFFSET][t]->max_len > max_len)
+			max_len = e->child[BY_OFFSET][t]->max_len;
+	}
+	return (e->max_len == max_len) ? 0 : -1;
+}
+
+/**
+ * famfs_free_index_check()
+ *
+ * Check that the index holds exactly the runs of clear bits in @bitmap (for tests
+ * and debugging)
+ *
+ * Returns 0 if it does, -1 if not
+ */
+int
+famfs_free_index_check(const struct famfs_free_index *fi, const u8 *bitmap, u64 nbits)
+{
+	u64 next_start = 0;
+	u64 nexts = 0;
+	u64 free_bits = nbits - mu_bitmap_count_range(bitmap, 0, nbits);
+
+	if (fi->by_offset && famfs_free_check_subtree(fi->by_offset, bitmap, nbits,
+						      &next_start, &nexts))
+		return -1;
+	if (nexts != fi->nexts || fi->free_units != free_bits)
+		return -1;
+	return 0;
+}
+
+static const char *famfs_alloc_policy_names[FAMFS_ALLOC_NPOLICIES] = {
+	[FAMFS_ALLOC_FIRST_FIT]   = "first",
+	[FAMFS_ALLOC_NEXT_FIT]    = "next",
+	[FAMFS_ALLOC_BEST_FIT]    = "best",
+	[FAMFS_ALLOC_ALIGNED_FIT] = "aligned",
+	[FAMFS_ALLOC_GROUP_FIT]   = "group",
+};
+
+const char *
+famfs_alloc_policy_name(enum famfs_alloc_policy policy)
+{
+	return (policy < FAMFS_ALLOC_NPOLICIES) ? famfs_alloc_policy_names[policy] : "unknown";
+}
+
+/* Returns the policy called @name ("first", "next", "best", "aligned" or "group"), or -1 */
+int
+famfs_alloc_policy_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < FAMFS_ALLOC_NPOLICIES; i++) {
+		if (!strcmp(name, famfs_alloc_policy_names[i]))
+			return i;
+	}
+	return -1;
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (C) 2023-2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+#ifndef _H_FAMFS_ALLOC
+#define _H_FAMFS_ALLOC
+
+#include "famfs_meta.h"
+
+struct famfs_free_ext;
+
+/**
+ * struct famfs_free_index - index of the free extents of an allocation bitmap
+ *
+ * Each free extent (a maximal run of clear bits) is in two treaps: one ordered by
+ * offset, which is augmented with the largest extent in each subtree so the lowest
+ * extent that fits can be found without visiting the ones that don't, and one
+ * ordered by (length, offset) for best fit. Offsets and lengths are in bits
+ * (allocation units).
+ *
+ * @by_offset  - root of the offset treap
+ * @by_len     - root of the length treap
+ * @nexts      - number of free extents
+ * @free_units - sum of their lengths
+ * @seed       - treap priority generator state
+ * @align_max  - aligned fit aligns to at most this many units (a power of 2;
+ *               famfs_free_index_build() sets it to FAMFS_ALLOC_ALIGN_MAX_UNITS)
+ */
+struct famfs_free_index {
+	struct famfs_free_ext *by_offset;
+	struct famfs_free_ext *by_len;
+	u64                    nexts;
+	u64                    free_units;
+	u32                    seed;
+	u64                    align_max;
+};
+
+#define FAMFS_ALLOC_ALIGN_MAX       0x40000000 /* Aligned fit: up to 1GiB (PUD) */
+#define FAMFS_ALLOC_ALIGN_MAX_UNITS (FAMFS_ALLOC_ALIGN_MAX / FAMFS_ALLOC_UNIT)
+
+int famfs_free_index_build(struct famfs_free_index *fi, const u8 *bitmap, u64 nbits);
+void famfs_free_index_destroy(struct famfs_free_index *fi);
+s64 famfs_free_index_alloc(struct famfs_free_index *fi, u64 len,
+			   enum famfs_alloc_policy policy, u64 cursor);
+int famfs_free_index_insert(struct famfs_free_index *fi, u64 start, u64 len);
+int famfs_free_index_reserve(struct famfs_free_index *fi, u64 start, u64 len);
+u64 famfs_free_index_largest(const struct famfs_free_index *fi);
+int famfs_free_index_check(const struct famfs_free_index *fi, const u8 *bitmap, u64 nbits);
+const char *famfs_alloc_policy_name(enum famfs_alloc_policy policy);
+int famfs_alloc_policy_parse(const char *name);
+
+#endif /* _H_FAMFS_ALLOC */
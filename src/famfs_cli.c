@@ -22,6 +22,7 @@
 #include <sys/param.h> /* MIN()/MAX() */
 #include <libgen.h>
 #include <sys/mount.h>
+#include <signal.h>
 
 #include <linux/types.h>
 #include <linux/ioctl.h>
@@ -72,11 +73,28 @@ famfs_logplay_usage(int   argc,
 	       "    -m|--mmap   - Get the log via mmap\n"
 	       "    -c|--client - force \"client mode\" (all files read-only)\n"
 	       "    -n|--dryrun - Process the log but don't instantiate the files & directories\n"
+	       "    -f|--full   - Play the whole log, ignoring the checkpoint from the last logplay\n"
+	       "    -F|--follow - Keep running, and apply new log entries as they are appended\n"
+	       "    -p|--poll-min <msec> - Follow mode: poll interval when the log is active (default 1)\n"
+	       "    -P|--poll-max <msec> - Follow mode: poll interval when the log is idle (default 1000)\n"
+	       "    -t|--threads <n>     - Create directories first, and then files with <n> threads\n"
 	       "\n"
+	       "Logplay records how far it got in a checkpoint under /opt/famfs/logplay, and\n"
+	       "subsequent logplays on the same mount only apply new log entries.\n"
 	       "\n",
 	       progname);
 }
 
+static struct famfs_follow_args *follow_args;
+
+static void
+famfs_logplay_follow_stop(int sig)
+{
+	(void)sig;
+	if (follow_args)
+		follow_args->stop_now = 1;
+}
+
 int
 do_famfs_cli_logplay(int argc, char *argv[])
 {
@@ -87,6 +105,11 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	int use_mmap = 0;
 	int use_read = 0;
 	int client_mode = 0;
+	int full_replay = 0;
+	int follow = 0;
+	u64 poll_min_ms = 1;
+	u64 poll_max_ms = 1000;
+	int nthreads = 1;
 	int verbose = 0;
 
 	/* XXX can't use any of the same strings as the global args! */
@@ -96,6 +119,11 @@ do_famfs_cli_logplay(int argc, char *argv[])
 		{"mmap",      no_argument,             0,  'm'},
 		{"read",      no_argument,             0,  'r'},
 		{"client",    no_argument,             0,  'c'},
+		{"full",      no_argument,             0,  'f'},
+		{"follow",    no_argument,             0,  'F'},
+		{"poll-min",  required_argument,       0,  'p'},
+		{"poll-max",  required_argument,       0,  'P'},
+		{"threads",   required_argument,       0,  't'},
 		{"verbose",    no_argument,            0,  'v'},
 		{0, 0, 0, 0}
 	};
@@ -104,7 +132,7 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+vrcmnh?",
+	while ((c = getopt_long(argc, argv, "+vrcmnfFp:P:t:h?",
 				logplay_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -129,12 +157,32 @@ do_famfs_cli_logplay(int argc, char *argv[])
 		case 'c':
 			client_mode++;
 			break;
+		case 'f':
+			full_replay++;
+			break;
+		case 'F':
+			follow++;
+			break;
+		case 'p':
+			poll_min_ms = strtoull(optarg, 0, 0);
+			break;
+		case 'P':
+			poll_max_ms = strtoull(optarg, 0, 0);
+			break;
+		case 't':
+			nthreads = strtoul(optarg, 0, 0);
+			break;
 		case 'v':
 			verbose++;
 			break;
 		}
 	}
 
+	if (nthreads < 1) {
+		fprintf(stderr, "Error: invalid thread count\n\n");
+		famfs_logplay_usage(argc, argv);
+		return -1;
+	}
 	if (use_mmap && use_read) {
 		fprintf(stderr,
 			"Error: The --mmap and --read arguments are mutually exclusive\n\n");
@@ -152,7 +200,398 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	}
 	fspath = argv[optind++];
 
-	return famfs_logplay(fspath, use_mmap, dry_run, client_mode, verbose);
+	if (follow) {
+		struct famfs_follow_args fa = { 0 };
+
+		if (dry_run || use_read || nthreads > 1) {
+			fprintf(stderr,
+				"Error: --follow is not compatible with --dryrun, --read or --threads\n\n");
+			famfs_logplay_usage(argc, argv);
+			return -1;
+		}
+		if (poll_min_ms == 0 || poll_max_ms < poll_min_ms) {
+			fprintf(stderr, "Error: invalid poll interval(s)\n\n");
+			famfs_logplay_usage(argc, argv);
+			return -1;
+		}
+		fa.client_mode = client_mode;
+		fa.full_replay = full_replay;
+		fa.poll_min_us = poll_min_ms * 1000;
+		fa.poll_max_us = poll_max_ms * 1000;
+		fa.verbose     = verbose;
+
+		follow_args = &fa;
+		signal(SIGINT, famfs_logplay_follow_stop);
+		signal(SIGTERM, famfs_logplay_follow_stop);
+		return famfs_logplay_follow(fspath, &fa);
+	}
+
+	return famfs_logplay(fspath, use_mmap, dry_run, client_mode, full_replay, nthreads,
+			     verbose);
+}
+
+/********************************************************************/
+
+void
+famfs_compact_usage(int   argc,
+	    char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs compact: Compact the log of a famfs file system\n"
+	       "\n"
+	       "Writes a snapshot of all logged files and directories into the snapshot region\n"
+	       "of the log, and empties the log. Clients load the snapshot and then play only\n"
+	       "the log entries that were appended after it. This can only be done on the\n"
+	       "master node.\n"
+	       "\n"
+	       "    %s compact [args] <mount_point>\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?           - Print this message\n"
+	       "    -v|--verbose - Print verbose output\n"
+	       "\n",
+	       progname);
+}
+
+int
+do_famfs_cli_compact(int argc, char *argv[])
+{
+	int c;
+	int arg_ct = 0;
+	int verbose = 0;
+	char *fspath;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option compact_options[] = {
+		/* These options set a */
+		{"verbose",    no_argument,            0,  'v'},
+		{0, 0, 0, 0}
+	};
+
+	/* Note: the "+" at the beginning of the arg string tells getopt_long
+	 * to return -1 when it sees something that is not recognized option
+	 * (e.g. the command that will mux us off to the command handlers
+	 */
+	while ((c = getopt_long(argc, argv, "+vh?",
+				compact_options, &optind)) != EOF) {
+
+		arg_ct++;
+		switch (c) {
+		case 'h':
+		case '?':
+			famfs_compact_usage(argc, argv);
+			return 0;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "Must specify mount_point "
+			"(actually any path within a famfs file system will work)\n");
+		famfs_compact_usage(argc, argv);
+		return -1;
+	}
+	fspath = argv[optind++];
+
+	return famfs_compact(fspath, verbose);
+}
+
+/********************************************************************/
+
+void
+famfs_rm_usage(int   argc,
+	    char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs rm: Remove files (and empty directories) from a famfs file system\n"
+	       "\n"
+	       "The removal is logged and the space of removed files is reused by later\n"
+	       "allocations. Clients remove the files at their next logplay. Removed files\n"
+	       "must not be open or mmapped on any node. This can only be done on the\n"
+	       "master node.\n"
+	       "\n"
+	       "    %s rm [args] <path> [<path> ...]\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?           - Print this message\n"
+	       "    -d|--dir     - Remove empty directories too\n"
+	       "    -v|--verbose - Print verbose output\n"
+	       "\n",
+	       progname);
+}
+
+int
+do_famfs_cli_rm(int argc, char *argv[])
+{
+	int c;
+	int rc = 0;
+	int dirs_ok = 0;
+	int verbose = 0;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option rm_options[] = {
+		/* These options set a */
+		{"dir",        no_argument,            0,  'd'},
+		{"verbose",    no_argument,            0,  'v'},
+		{0, 0, 0, 0}
+	};
+
+	/* Note: the "+" at the beginning of the arg string tells getopt_long
+	 * to return -1 when it sees something that is not recognized option
+	 * (e.g. the command that will mux us off to the command handlers
+	 */
+	while ((c = getopt_long(argc, argv, "+dvh?",
+				rm_options, &optind)) != EOF) {
+
+		switch (c) {
+		case 'h':
+		case '?':
+			famfs_rm_usage(argc, argv);
+			return 0;
+		case 'd':
+			dirs_ok = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "Must specify at least one path\n");
+		famfs_rm_usage(argc, argv);
+		return -1;
+	}
+	for (; optind < argc; optind++) {
+		if (famfs_rm(argv[optind], dirs_ok, verbose)) {
+			fprintf(stderr, "famfs rm: failed to remove %s\n", argv[optind]);
+			rc = -1;
+		}
+	}
+	return rc;
+}
+
+/********************************************************************/
+
+void
+famfs_defrag_usage(int   argc,
+	    char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs defrag: Defragment the free space of a famfs file system\n"
+	       "\n"
+	       "Moves files down into the lowest free extent that holds all of the file (files\n"
+	       "in several extents are made contiguous), so the free space ends up in fewer,\n"
+	       "larger extents. Each move copies the data, logs the new extent map of the file\n"
+	       "and frees the old extents. Files must not be open or mmapped on any node while\n"
+	       "they are moved. This can only be done on the master node.\n"
+	       "\n"
+	       "    %s defrag [args] <mount_point>\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?           - Print this message\n"
+	       "    -n|--dryrun  - Report what would be moved, and the largest free extent\n"
+	       "                   before and after, without moving anything\n"
+	       "    -v|--verbose - Print verbose output\n"
+	       "\n",
+	       progname);
+}
+
+int
+do_famfs_cli_defrag(int argc, char *argv[])
+{
+	int c;
+	int dry_run = 0;
+	int verbose = 0;
+	char *fspath;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option defrag_options[] = {
+		/* These options set a */
+		{"dryrun",     no_argument,            0,  'n'},
+		{"verbose",    no_argument,            0,  'v'},
+		{0, 0, 0, 0}
+	};
+
+	/* Note: the "+" at the beginning of the arg string tells getopt_long
+	 * to return -1 when it sees something that is not recognized option
+	 * (e.g. the command that will mux us off to the command handlers
+	 */
+	while ((c = getopt_long(argc, argv, "+nvh?",
+				defrag_options, &optind)) != EOF) {
+
+		switch (c) {
+		case 'h':
+		case '?':
+			famfs_defrag_usage(argc, argv);
+			return 0;
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "Must specify mount_point "
+			"(actually any path within a famfs file system will work)\n");
+		famfs_defrag_usage(argc, argv);
+		return -1;
+	}
+	fspath = argv[optind++];
+
+	return famfs_defrag(fspath, dry_run, verbose);
+}
+
+/********************************************************************/
+
+void
+famfs_logconvert_usage(int   argc,
+	    char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs logconvert: Convert the log of a famfs file system to log format v2\n"
+	       "\n"
+	       "Rewrites the log entries as packed, variable-length records, which take a\n"
+	       "fraction of the space of the original fixed-size entries. Sequence numbers and\n"
+	       "the snapshot are preserved; clients do a full replay at their next logplay.\n"
+	       "This can only be done on the master node.\n"
+	       "\n"
+	       "    %s logconvert [args] <mount_point>\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?           - Print this message\n"
+	       "    -v|--verbose - Print verbose output\n"
+	       "\n",
+	       progname);
+}
+
+int
+do_famfs_cli_logconvert(int argc, char *argv[])
+{
+	int c;
+	int arg_ct = 0;
+	int verbose = 0;
+	char *fspath;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option logconvert_options[] = {
+		/* These options set a */
+		{"verbose",    no_argument,            0,  'v'},
+		{0, 0, 0, 0}
+	};
+
+	/* Note: the "+" at the beginning of the arg string tells getopt_long
+	 * to return -1 when it sees something that is not recognized option
+	 * (e.g. the command that will mux us off to the command handlers
+	 */
+	while ((c = getopt_long(argc, argv, "+vh?",
+				logconvert_options, &optind)) != EOF) {
+
+		arg_ct++;
+		switch (c) {
+		case 'h':
+		case '?':
+			famfs_logconvert_usage(argc, argv);
+			return 0;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "Must specify mount_point "
+			"(actually any path within a famfs file system will work)\n");
+		famfs_logconvert_usage(argc, argv);
+		return -1;
+	}
+	fspath = argv[optind++];
+
+	return famfs_logconvert(fspath, verbose);
+}
+
+/********************************************************************/
+
+void
+famfs_upgrade_usage(int   argc,
+	    char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs upgrade: Upgrade a version 46 famfs file system to the current version\n"
+	       "\n"
+	       "Version 46 file systems (made before log snapshots) are rejected until they are\n"
+	       "upgraded. This moves the log entries after the current (bigger) log header and\n"
+	       "updates the superblock version, in place. Files and their data do not move.\n"
+	       "Run it on the master with the file system unmounted on every node, and back up\n"
+	       "the log first: the log is unusable if the upgrade is interrupted. Clients do a\n"
+	       "full replay at their next logplay.\n"
+	       "\n"
+	       "    %s upgrade [args] <daxdev>\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?           - Print this message\n"
+	       "    -v|--verbose - Print verbose output\n"
+	       "\n",
+	       progname);
+}
+
+int
+do_famfs_cli_upgrade(int argc, char *argv[])
+{
+	int c;
+	int arg_ct = 0;
+	int verbose = 0;
+	char *daxdev;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option upgrade_options[] = {
+		/* These options set a */
+		{"verbose",    no_argument,            0,  'v'},
+		{0, 0, 0, 0}
+	};
+
+	/* Note: the "+" at the beginning of the arg string tells getopt_long
+	 * to return -1 when it sees something that is not recognized option
+	 * (e.g. the command that will mux us off to the command handlers
+	 */
+	while ((c = getopt_long(argc, argv, "+vh?",
+				upgrade_options, &optind)) != EOF) {
+
+		arg_ct++;
+		switch (c) {
+		case 'h':
+		case '?':
+			famfs_upgrade_usage(argc, argv);
+			return 0;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "Must specify the dax device\n");
+		famfs_upgrade_usage(argc, argv);
+		return -1;
+	}
+	daxdev = argv[optind++];
+
+	return famfs_upgrade(daxdev, verbose);
 }
 
 /********************************************************************/
@@ -289,7 +728,8 @@ do_famfs_cli_mount(int argc, char *argv[])
 		goto err_out;
 	}
 
-	rc = famfs_logplay(realmpt, use_mmap, 0, 0, verbose);
+	/* A fresh mount has nothing in it yet, so always play the whole log */
+	rc = famfs_logplay(realmpt, use_mmap, 0, 0, 1 /* full replay */, 1, verbose);
 
 err_out:
 	free(realdaxdev);
@@ -476,6 +916,78 @@ do_famfs_cli_fsck(int argc, char *argv[])
 	return famfs_fsck(daxdev, use_mmap, human, verbose);
 }
 
+/********************************************************************/
+
+void
+famfs_df_usage(int   argc,
+	    char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs df: Show the size, used and available space of a famfs file system\n"
+	       "\n"
+	       "The numbers come from counters that the master keeps in the log header, so\n"
+	       "this is cheap enough to poll, and works on any node. Used space includes the\n"
+	       "superblock, log and other metadata.\n"
+	       "\n"
+	       "    %s df [args] <mount_point>\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?           - Print this message\n"
+	       "    -h|--human   - Print sizes in GiB\n"
+	       "    -v|--verbose - Also print the log seqnum the counters reflect\n"
+	       "\n",
+	       progname);
+}
+
+int
+do_famfs_cli_df(int argc, char *argv[])
+{
+	int c;
+	int human = 0;
+	int verbose = 0;
+	char *fspath;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option df_options[] = {
+		/* These options set a */
+		{"human",      no_argument,            0,  'h'},
+		{"verbose",    no_argument,            0,  'v'},
+		{0, 0, 0, 0}
+	};
+
+	/* Note: the "+" at the beginning of the arg string tells getopt_long
+	 * to return -1 when it sees something that is not recognized option
+	 * (e.g. the command that will mux us off to the command handlers
+	 */
+	while ((c = getopt_long(argc, argv, "+hv?",
+				df_options, &optind)) != EOF) {
+
+		switch (c) {
+		case '?':
+			famfs_df_usage(argc, argv);
+			return 0;
+		case 'h':
+			human = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "Must specify mount_point "
+			"(actually any path within a famfs file system will work)\n");
+		famfs_df_usage(argc, argv);
+		return -1;
+	}
+	fspath = argv[optind++];
+
+	return famfs_df(fspath, human, verbose);
+}
+
 
 /********************************************************************/
 
@@ -1613,6 +2125,7 @@ famfs_cli_cmd famfs_cli_cmds[] = {
 
 	{"mount",   do_famfs_cli_mount,   famfs_mount_usage},
 	{"fsck",    do_famfs_cli_fsck,    famfs_fsck_usage},
+	{"df",      do_famfs_cli_df,      famfs_df_usage},
 	{"check",   do_famfs_cli_check,   famfs_check_usage},
 	{"mkdir",   do_famfs_cli_mkdir,   famfs_mkdir_usage},
 	{"cp",      do_famfs_cli_cp,      famfs_cp_usage},
@@ -1621,6 +2134,11 @@ famfs_cli_cmd famfs_cli_cmds[] = {
 	{"verify",  do_famfs_cli_verify,  famfs_verify_usage},
 	{"mkmeta",  do_famfs_cli_mkmeta,  famfs_mkmeta_usage},
 	{"logplay", do_famfs_cli_logplay, famfs_logplay_usage},
+	{"compact", do_famfs_cli_compact, famfs_compact_usage},
+	{"rm",      do_famfs_cli_rm,      famfs_rm_usage},
+	{"defrag",  do_famfs_cli_defrag,  famfs_defrag_usage},
+	{"logconvert", do_famfs_cli_logconvert, famfs_logconvert_usage},
+	{"upgrade", do_famfs_cli_upgrade, famfs_upgrade_usage},
 	{"getmap",  do_famfs_cli_getmap,  famfs_getmap_usage},
 	{"clone",   do_famfs_cli_clone,   famfs_clone_usage},
 	{"chkread", do_famfs_cli_chkread, famfs_chkread_usage},
@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2023-2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+/*
+ * famfs checksums
+ *
+ * crc32c is dispatched at runtime: on x86_64 cpus with SSE4.2 it uses the crc32
+ * instruction, running three independent streams over large buffers (the instruction
+ * has a latency of 3 cycles but a throughput of 1 per cycle) and combining them with
+ * precomputed "append zeros" tables. Otherwise it uses a portable slicing-by-8
+ * table implementation. zlib crc32 is kept for images written before checksums were
+ * versioned (see FAMFS_CSUM_ALG()).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <linux/types.h>
+#include <linux/uuid.h>
+
+#include "famfs_csum.h"
+
+#define CRC32C_POLY 0x82f63b78 /* Castagnoli, reflected */
+
+static pthread_once_t famfs_crc32c_once = PTHREAD_ONCE_INIT;
+static u32 (*famfs_crc32c_fn)(u32 crc, const u8 *buf, size_t len);
+static u32 crc32c_table[8][256];
+
+/*
+ * Portable slicing-by-8
+ */
+
+static u32
+famfs_crc32c_slice8(u32 crc, const u8 *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		u64 w;
+
+		memcpy(&w, p, sizeof(w));
+		w ^= crc;
+		crc = crc32c_table[7][w & 0xff]
+			^ crc32c_table[6][(w >> 8) & 0xff]
+			^ crc32c_table[5][(w >> 16) & 0xff]
+			^ crc32c_table[4][(w >> 24) & 0xff]
+			^ crc32c_table[3][(w >> 32) & 0xff]
+			^ crc32c_table[2][(w >> 40) & 0xff]
+			^ crc32c_table[1][(w >> 48) & 0xff]
+			^ crc32c_table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void
+famfs_crc32c_sw_init(void)
+{
+	u32 n, k, crc;
+
+	for (n = 0; n < 256; n++) {
+		crc = n;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][n] = crc;
+	}
+	for (n = 0; n < 256; n++) {
+		crc = crc32c_table[0][n];
+		for (k = 1; k < 8; k++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[k][n] = crc;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+/*
+ * SSE4.2
+ *
+ * Buffers of at least 3 * CRC32C_LONG (then 3 * CRC32C_SHORT) bytes are processed as
+ * three interleaved streams. The crc of the first stream is then shifted past the
+ * second (as if CRC32C_LONG zeros had been appended) and xor'ed with the crc of the
+ * second, and so on.
+ */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+static u32 crc32c_long[4][256];
+static u32 crc32c_short[4][256];
+
+/* Multiply a 32x32 GF(2) matrix by a vector */
+static u32
+gf2_matrix_times(const u32 *mat, u32 vec)
+{
+	u32 sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void
+gf2_matrix_square(u32 *square, const u32 *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Build the operator that appends @len (a power of 2) zero bytes to a crc */
+static void
+crc32c_zeros_op(u32 *even, size_t len)
+{
+	u32 odd[32];
+	u32 row = 1;
+	int n;
+
+	odd[0] = CRC32C_POLY; /* One zero bit */
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd); /* Two zero bits */
+	gf2_matrix_square(odd, even); /* Four zero bits */
+
+	/* The first square makes one zero byte, in even; keep squaring until len is 0 */
+	do {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+	} while (len);
+
+	for (n = 0; n < 32; n++)
+		even[n] = odd[n];
+}
+
+static void
+crc32c_zeros(u32 zeros[][256], size_t len)
+{
+	u32 op[32];
+	u32 n;
+
+	crc32c_zeros_op(op, len);
+	for (n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static inline u32
+crc32c_shift(u32 zeros[][256], u32 crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff]
+		^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static u32
+famfs_crc32c_sse42(u32 crc, const u8 *p, size_t len)
+{
+	u64 crc0 = crc, crc1, crc2;
+	const u8 *end;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc0 = _mm_crc32_u8(crc0, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LONG) {
+		crc1 = 0;
+		crc2 = 0;
+		end = p + CRC32C_LONG;
+		do {
+			crc0 = _mm_crc32_u64(crc0, *(const u64 *)p);
+			crc1 = _mm_crc32_u64(crc1, *(const u64 *)(p + CRC32C_LONG));
+			crc2 = _mm_crc32_u64(crc2, *(const u64 *)(p + 2 * CRC32C_LONG));
+			p += 8;
+		} while (p < end);
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+		p += 2 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	while (len >= 3 * CRC32C_SHORT) {
+		crc1 = 0;
+		crc2 = 0;
+		end = p + CRC32C_SHORT;
+		do {
+			crc0 = _mm_crc32_u64(crc0, *(const u64 *)p);
+			crc1 = _mm_crc32_u64(crc1, *(const u64 *)(p + CRC32C_SHORT));
+			crc2 = _mm_crc32_u64(crc2, *(const u64 *)(p + 2 * CRC32C_SHORT));
+			p += 8;
+		} while (p < end);
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+		p += 2 * CRC32C_SHORT;
+		len -= 3 * CRC32C_SHORT;
+	}
+	while (len >= 8) {
+		crc0 = _mm_crc32_u64(crc0, *(const u64 *)p);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc0 = _mm_crc32_u8(crc0, *p++);
+	return (u32)crc0;
+}
+#endif
+
+static void
+famfs_crc32c_init(void)
+{
+	famfs_crc32c_sw_init();
+	famfs_crc32c_fn = famfs_crc32c_slice8;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_zeros(crc32c_long, CRC32C_LONG);
+		crc32c_zeros(crc32c_short, CRC32C_SHORT);
+		famfs_crc32c_fn = famfs_crc32c_sse42;
+	}
+#endif
+}
+
+/**
+ * famfs_crc32c()
+ *
+ * @crc - 0, or the crc of the preceding data
+ * @buf
+ * @len
+ */
+u32
+famfs_crc32c(u32 crc, const void *buf, size_t len)
+{
+	pthread_once(&famfs_crc32c_once, famfs_crc32c_init);
+	return ~famfs_crc32c_fn(~crc, buf, len);
+}
+
+/* The portable implementation, regardless of what the cpu supports */
+u32
+famfs_crc32c_sw(u32 crc, const void *buf, size_t len)
+{
+	pthread_once(&famfs_crc32c_once, famfs_crc32c_init);
+	return ~famfs_crc32c_slice8(~crc, buf, len);
+}
+
+/* Returns 1 if famfs_crc32c() uses the hardware */
+int
+famfs_crc32c_hw(void)
+{
+	pthread_once(&famfs_crc32c_once, famfs_crc32c_init);
+	return (famfs_crc32c_fn != famfs_crc32c_slice8);
+}
+
+/**
+ * famfs_csum()
+ *
+ * @alg - a valid enum famfs_csum_alg (see famfs_csum_alg_valid())
+ * @crc - 0, or the checksum of the preceding data
+ * @buf
+ * @len
+ */
+u32
+famfs_csum(enum famfs_csum_alg alg, u32 crc, const void *buf, size_t len)
+{
+	switch (alg) {
+	case FAMFS_CSUM_CRC32C:
+		return famfs_crc32c(crc, buf, len);
+	case FAMFS_CSUM_CRC32:
+	default:
+		/* zlib takes uInt lengths */
+		while (len > UINT32_MAX) {
+			crc = crc32(crc, buf, UINT32_MAX);
+			buf = (const u8 *)buf + UINT32_MAX;
+			len -= UINT32_MAX;
+		}
+		return crc32(crc, buf, len);
+	}
+}
+
+const char *
+famfs_csum_name(u32 alg)
+{
+	switch (alg) {
+	case FAMFS_CSUM_CRC32:
+		return "crc32";
+	case FAMFS_CSUM_CRC32C:
+		return "crc32c";
+	default:
+		return "unknown";
+	}
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (C) 2023-2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+#ifndef _H_FAMFS_CSUM
+#define _H_FAMFS_CSUM
+
+#include <stddef.h>
+
+#include "famfs_meta.h"
+
+/*
+ * All of these are incremental in the style of zlib crc32(): start with crc 0 and
+ * pass the previous return value to continue over more data.
+ */
+u32 famfs_csum(enum famfs_csum_alg alg, u32 crc, const void *buf, size_t len);
+u32 famfs_crc32c(u32 crc, const void *buf, size_t len);
+
+/* Only exported for unit tests and benchmarks */
+u32 famfs_crc32c_sw(u32 crc, const void *buf, size_t len);
+int famfs_crc32c_hw(void);
+
+static inline int
+famfs_csum_alg_valid(u32 alg)
+{
+	return (alg < FAMFS_CSUM_NALGS);
+}
+
+const char *famfs_csum_name(u32 alg);
+
+#endif /* _H_FAMFS_CSUM */
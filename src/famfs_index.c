@@ -0,0 +1,514 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2023-2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+/*
+ * famfs namespace index
+ *
+ * An in-memory index of the files and directories in the log, so "does relpath X
+ * exist, and what are its extents" can be answered without walking the mounted
+ * tree or rescanning the log. It is built in one pass over the snapshot and the log,
+ * and is cheap enough for every client to build its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+#include <linux/uuid.h>
+#include <linux/limits.h>
+
+#include "famfs_meta.h"
+#include "famfs_lib.h"
+#include "famfs_lib_internal.h"
+#include "famfs_index.h"
+
+#define FAMFS_INDEX_MIN_SLOTS 256
+
+/**
+ * famfs_index_key()
+ *
+ * Normalize a relpath into a lookup key: leading and trailing slashes are dropped,
+ * so "a/b", "/a/b" and "a/b/" are the same key and the root is "".
+ *
+ * @relpath - the path (need not be NUL-terminated within FAMFS_MAX_PATHLEN)
+ * @key     - receives the key (FAMFS_MAX_PATHLEN)
+ *
+ * Returns the key length, or -1 if the path is too long
+ */
+static int
+famfs_index_key(const char *relpath, char *key)
+{
+	size_t len;
+
+	while (*relpath == '/')
+		relpath++;
+	len = strnlen(relpath, FAMFS_MAX_PATHLEN);
+	if (len == FAMFS_MAX_PATHLEN)
+		return -1;
+	while (len > 0 && relpath[len - 1] == '/')
+		len--;
+	memcpy(key, relpath, len);
+	key[len] = '\0';
+	return len;
+}
+
+/* FNV-1a; cheap, and good enough for paths */
+static u32
+famfs_index_hash(const char *key, size_t len)
+{
+	u32 h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (u8)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * famfs_index_find()
+ *
+ * Returns the node index for @key, or FAMFS_INDEX_NONE. If @slot_out is not NULL it
+ * receives the slot where @key is (or would be inserted).
+ */
+static u32
+famfs_index_find(
+	const struct famfs_index *idx,
+	const char               *key,
+	u32                       hash,
+	u32                      *slot_out)
+{
+	u32 mask = idx->nslots - 1;
+	u32 s;
+
+	for (s = hash & mask; idx->slots[s]; s = (s + 1) & mask) {
+		const struct famfs_index_node *n = &idx->nodes[idx->slots[s] - 1];
+
+		if (n->hash == hash && strcmp(n->relpath, key) == 0) {
+			if (slot_out)
+				*slot_out = s;
+			return idx->slots[s] - 1;
+		}
+	}
+	if (slot_out)
+		*slot_out = s;
+	return FAMFS_INDEX_NONE;
+}
+
+static inline int
+famfs_index_live(const struct famfs_index_node *n)
+{
+	return (n->type == FAMFS_LOG_FILE || n->type == FAMFS_LOG_MKDIR);
+}
+
+/* Double the hash table; the nodes carry their hashes, so nothing is rehashed */
+static int
+famfs_index_grow_slots(struct famfs_index *idx)
+{
+	u32 nslots = (idx->nslots) ? idx->nslots * 2 : FAMFS_INDEX_MIN_SLOTS;
+	u32 *slots;
+	u32 mask = nslots - 1;
+	u32 i, s;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots)
+		return -1;
+	for (i = 0; i < idx->nnodes; i++) {
+		if (!famfs_index_live(&idx->nodes[i]))
+			continue;
+		for (s = idx->nodes[i].hash & mask; slots[s]; s = (s + 1) & mask)
+			;
+		slots[s] = i + 1;
+	}
+	free(idx->slots);
+	idx->slots = slots;
+	idx->nslots = nslots;
+	return 0;
+}
+
+/**
+ * famfs_index_insert()
+ *
+ * Add a node for @key, unless it is already present. The new node is linked onto
+ * the end of its parent's children.
+ *
+ * Returns the new node, or NULL if @key was already present or on allocation
+ * failure (*err is -ENOMEM)
+ */
+static struct famfs_index_node *
+famfs_index_insert(
+	struct famfs_index *idx,
+	const char         *key,
+	size_t              keylen,
+	int                *err)
+{
+	struct famfs_index_node *n;
+	u32 hash = famfs_index_hash(key, keylen);
+	char pkey[FAMFS_MAX_PATHLEN];
+	const char *slash;
+	u32 slot, i;
+
+	*err = 0;
+	if ((idx->nnodes + 1) * 2 > idx->nslots && famfs_index_grow_slots(idx))
+		goto nomem;
+	if (famfs_index_find(idx, key, hash, &slot) != FAMFS_INDEX_NONE)
+		return NULL;
+
+	if (idx->nnodes == idx->maxnodes) {
+		u32 max = (idx->maxnodes) ? idx->maxnodes * 2 : FAMFS_INDEX_MIN_SLOTS / 2;
+		struct famfs_index_node *nodes = realloc(idx->nodes, max * sizeof(*nodes));
+
+		if (!nodes)
+			goto nomem;
+		idx->nodes = nodes;
+		idx->maxnodes = max;
+	}
+
+	i = idx->nnodes++;
+	n = &idx->nodes[i];
+	memset(n, 0, sizeof(*n));
+	memcpy(n->relpath, key, keylen + 1);
+	n->hash         = hash;
+	n->seqnum       = FAMFS_INDEX_NO_SEQNUM;
+	n->parent       = FAMFS_INDEX_NONE;
+	n->first_child  = FAMFS_INDEX_NONE;
+	n->last_child   = FAMFS_INDEX_NONE;
+	n->next_sibling = FAMFS_INDEX_NONE;
+	idx->slots[slot] = i + 1;
+
+	if (i == 0) /* The root is its own directory, with no parent */
+		return n;
+
+	slash = strrchr(key, '/');
+	if (slash) {
+		memcpy(pkey, key, slash - key);
+		pkey[slash - key] = '\0';
+	} else {
+		pkey[0] = '\0';
+	}
+	n->parent = famfs_index_find(idx, pkey, famfs_index_hash(pkey, strlen(pkey)), NULL);
+	if (n->parent == FAMFS_INDEX_NONE
+	    || idx->nodes[n->parent].type != FAMFS_LOG_MKDIR) {
+		n->parent = FAMFS_INDEX_NONE;
+		idx->norphans++;
+		return n;
+	}
+	if (idx->nodes[n->parent].last_child == FAMFS_INDEX_NONE)
+		idx->nodes[n->parent].first_child = i;
+	else
+		idx->nodes[idx->nodes[n->parent].last_child].next_sibling = i;
+	idx->nodes[n->parent].last_child = i;
+	return n;
+
+nomem:
+	*err = -ENOMEM;
+	return NULL;
+}
+
+/**
+ * famfs_index_remove()
+ *
+ * Remove the node for @key, which must be of type @type (and, for a directory, empty):
+ * take it out of the hash table (shifting back the entries that probed past it) and
+ * unlink it from its parent's children. The node itself stays in the array, marked
+ * with the removal type.
+ */
+static void
+famfs_index_remove(
+	struct famfs_index *idx,
+	const char         *key,
+	size_t              keylen,
+	u32                 type)
+{
+	u32 mask = idx->nslots - 1;
+	struct famfs_index_node *n;
+	u32 i, s, j, home, *pp;
+
+	i = famfs_index_find(idx, key, famfs_index_hash(key, keylen), &s);
+	if (i == FAMFS_INDEX_NONE || i == 0) {
+		idx->nmissing++;
+		return;
+	}
+	n = &idx->nodes[i];
+	if ((type == FAMFS_LOG_UNLINK && n->type != FAMFS_LOG_FILE)
+	    || (type == FAMFS_LOG_RMDIR
+		&& (n->type != FAMFS_LOG_MKDIR || n->first_child != FAMFS_INDEX_NONE))) {
+		idx->nmissing++;
+		return;
+	}
+
+	/* Backward shift deletion, so probes for the remaining keys still find them */
+	for (j = s; ; ) {
+		idx->slots[s] = 0;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (!idx->slots[j])
+				goto unhashed;
+			home = idx->nodes[idx->slots[j] - 1].hash & mask;
+			/* Move it unless its home is cyclically in (s, j] */
+			if ((s < j) ? (home <= s || home > j) : (home <= s && home > j))
+				break;
+		}
+		idx->slots[s] = idx->slots[j];
+		s = j;
+	}
+unhashed:
+	if (n->parent != FAMFS_INDEX_NONE) {
+		struct famfs_index_node *p = &idx->nodes[n->parent];
+		u32 prev = FAMFS_INDEX_NONE;
+
+		for (pp = &p->first_child; *pp != i; pp = &idx->nodes[*pp].next_sibling)
+			prev = *pp;
+		*pp = n->next_sibling;
+		if (p->last_child == i)
+			p->last_child = prev;
+	}
+	n->type = type;
+	n->parent = FAMFS_INDEX_NONE;
+	n->next_sibling = FAMFS_INDEX_NONE;
+}
+
+/* famfs_log_scan() callback */
+static int
+famfs_index_add(
+	const struct famfs_log_entry *le,
+	u64                           seqnum,
+	void                         *arg)
+{
+	struct famfs_index *idx = arg;
+	struct famfs_index_node *n;
+	char key[FAMFS_MAX_PATHLEN];
+	int keylen, err;
+	u32 i;
+
+	switch (le->famfs_log_entry_type) {
+	case FAMFS_LOG_FILE: {
+		const struct famfs_file_creation *fc = &le->famfs_fc;
+
+		keylen = famfs_index_key((const char *)fc->famfs_relpath, key);
+		if (keylen <= 0)
+			break;
+		if (idx->next_ext + fc->famfs_nextents > idx->max_ext) {
+			u64 max = (idx->max_ext) ? idx->max_ext * 2 : FAMFS_INDEX_MIN_SLOTS;
+			struct famfs_simple_extent *ext;
+
+			while (idx->next_ext + fc->famfs_nextents > max)
+				max *= 2;
+			ext = realloc(idx->ext, max * sizeof(*ext));
+			if (!ext)
+				return -ENOMEM;
+			idx->ext = ext;
+			idx->max_ext = max;
+		}
+		n = famfs_index_insert(idx, key, keylen, &err);
+		if (!n) {
+			if (err)
+				return err;
+			if (seqnum != FAMFS_SCAN_SNAP_SEQNUM)
+				idx->ndups++;
+			break;
+		}
+		n->seqnum   = seqnum;
+		n->type     = FAMFS_LOG_FILE;
+		n->size     = fc->famfs_fc_size;
+		n->uid      = fc->fc_uid;
+		n->gid      = fc->fc_gid;
+		n->mode     = fc->fc_mode;
+		n->nextents = fc->famfs_nextents;
+		n->ext_idx  = idx->next_ext;
+		for (i = 0; i < fc->famfs_nextents; i++)
+			idx->ext[idx->next_ext++] = fc->famfs_ext_list[i].se;
+		break;
+	}
+	case FAMFS_LOG_MKDIR: {
+		const struct famfs_mkdir *md = &le->famfs_md;
+
+		keylen = famfs_index_key((const char *)md->famfs_relpath, key);
+		if (keylen <= 0)
+			break;
+		n = famfs_index_insert(idx, key, keylen, &err);
+		if (!n) {
+			if (err)
+				return err;
+			if (seqnum != FAMFS_SCAN_SNAP_SEQNUM)
+				idx->ndups++;
+			break;
+		}
+		n->seqnum = seqnum;
+		n->type   = FAMFS_LOG_MKDIR;
+		n->uid    = md->fc_uid;
+		n->gid    = md->fc_gid;
+		n->mode   = md->fc_mode;
+		break;
+	}
+	case FAMFS_LOG_UNLINK:
+		keylen = famfs_index_key((const char *)le->famfs_fc.famfs_relpath, key);
+		if (keylen > 0)
+			famfs_index_remove(idx, key, keylen, FAMFS_LOG_UNLINK);
+		break;
+	case FAMFS_LOG_RMDIR:
+		keylen = famfs_index_key((const char *)le->famfs_md.famfs_relpath, key);
+		if (keylen > 0)
+			famfs_index_remove(idx, key, keylen, FAMFS_LOG_RMDIR);
+		break;
+	default:
+		/* Access entries etc. don't change the namespace */
+		break;
+	}
+	return 0;
+}
+
+/**
+ * famfs_index_update()
+ *
+ * Add the entries that have been published since the index was built or last
+ * updated. If the log has been compacted past the index, the snapshot is rescanned
+ * (the records already in the index are skipped).
+ *
+ * @idx  - the index
+ * @logp - the log the index was built from
+ *
+ * Returns the number of log entries scanned, or -1 on error (the index holds the
+ * entries before the error, and may be updated again)
+ */
+int
+famfs_index_update(
+	struct famfs_index     *idx,
+	const struct famfs_log *logp)
+{
+	u64 start = idx->next_seqnum;
+	int rc;
+
+	rc = famfs_log_scan(logp, start, famfs_index_add, idx, &idx->next_seqnum);
+	if (rc) {
+		fprintf(stderr, "%s: scan failed at seqnum %lld (%d)\n",
+			__func__, idx->next_seqnum, rc);
+		return -1;
+	}
+	return (int)(idx->next_seqnum - start);
+}
+
+/**
+ * famfs_index_build()
+ *
+ * Build the namespace index from the snapshot and the log.
+ *
+ * @logp    - the log
+ * @verbose
+ *
+ * Returns the index (free with famfs_index_free()), or NULL on error
+ */
+struct famfs_index *
+famfs_index_build(
+	const struct famfs_log *logp,
+	int                     verbose)
+{
+	struct famfs_index *idx;
+	struct famfs_index_node *root;
+	int err;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		return NULL;
+
+	root = famfs_index_insert(idx, "", 0, &err);
+	if (!root)
+		goto err_out;
+	root->type = FAMFS_LOG_MKDIR;
+	root->mode = S_IFDIR | 0755;
+
+	if (famfs_index_update(idx, logp) < 0)
+		goto err_out;
+
+	if (verbose)
+		printf("%s: %d nodes, %lld extents, next seqnum %lld "
+		       "(%lld dups, %lld orphans, %lld missing)\n",
+		       __func__, idx->nnodes, idx->next_ext, idx->next_seqnum,
+		       idx->ndups, idx->norphans, idx->nmissing);
+	return idx;
+
+err_out:
+	famfs_index_free(idx);
+	return NULL;
+}
+
+void
+famfs_index_free(struct famfs_index *idx)
+{
+	if (!idx)
+		return;
+	free(idx->nodes);
+	free(idx->slots);
+	free(idx->ext);
+	free(idx);
+}
+
+/**
+ * famfs_index_lookup()
+ *
+ * @idx     - the index
+ * @relpath - path relative to the mount point ("" or "/" is the root)
+ *
+ * Returns the node, or NULL if @relpath is not in the index
+ */
+const struct famfs_index_node *
+famfs_index_lookup(
+	const struct famfs_index *idx,
+	const char               *relpath)
+{
+	char key[FAMFS_MAX_PATHLEN];
+	int keylen;
+	u32 i;
+
+	keylen = famfs_index_key(relpath, key);
+	if (keylen < 0)
+		return NULL;
+	i = famfs_index_find(idx, key, famfs_index_hash(key, keylen), NULL);
+	return (i == FAMFS_INDEX_NONE) ? NULL : &idx->nodes[i];
+}
+
+/**
+ * famfs_index_readdir()
+ *
+ * Iterate over the children of a directory, in log order.
+ *
+ * @idx  - the index
+ * @dir  - the directory (from famfs_index_lookup())
+ * @prev - the previous child, or NULL to get the first one
+ *
+ * Returns the next child, or NULL at the end (or if @dir is not a directory)
+ */
+const struct famfs_index_node *
+famfs_index_readdir(
+	const struct famfs_index      *idx,
+	const struct famfs_index_node *dir,
+	const struct famfs_index_node *prev)
+{
+	u32 i;
+
+	if (!dir || dir->type != FAMFS_LOG_MKDIR)
+		return NULL;
+	i = (prev) ? prev->next_sibling : dir->first_child;
+	return (i == FAMFS_INDEX_NONE) ? NULL : &idx->nodes[i];
+}
+
+/**
+ * famfs_index_extents()
+ *
+ * Returns the extents of a file node (node->nextents of them), or NULL
+ */
+const struct famfs_simple_extent *
+famfs_index_extents(
+	const struct famfs_index      *idx,
+	const struct famfs_index_node *node)
+{
+	if (node->type != FAMFS_LOG_FILE || !node->nextents)
+		return NULL;
+	return &idx->ext[node->ext_idx];
+}
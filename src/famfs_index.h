@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (C) 2023-2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+#ifndef _H_FAMFS_INDEX
+#define _H_FAMFS_INDEX
+
+#include <sys/types.h>
+
+#include "famfs_meta.h"
+
+#define FAMFS_INDEX_NONE      ((u32)-1) /* Null node index */
+#define FAMFS_INDEX_NO_SEQNUM ((u64)-1) /* Root, and nodes loaded from the snapshot */
+
+/**
+ * struct famfs_index_node - one file or directory in the namespace index
+ *
+ * @relpath      - path relative to the mount point ("" for the root)
+ * @seqnum       - seqnum of the log entry that created this node, or
+ *                 FAMFS_INDEX_NO_SEQNUM
+ * @type         - FAMFS_LOG_FILE or FAMFS_LOG_MKDIR (FAMFS_LOG_UNLINK or FAMFS_LOG_RMDIR
+ *                 once it has been removed; removed nodes are not in the hash table)
+ * @nextents     - number of extents (files)
+ * @ext_idx      - index of the first extent in the index extent pool (files)
+ * @size         - file size (files)
+ * @uid, @gid, @mode
+ * @hash         - hash of @relpath
+ * @parent       - node index of the parent directory, or FAMFS_INDEX_NONE if the
+ *                 parent is not in the log
+ * @first_child  - directories: first child in log order, or FAMFS_INDEX_NONE
+ * @last_child   - directories: last child in log order, or FAMFS_INDEX_NONE
+ * @next_sibling - next child of @parent, or FAMFS_INDEX_NONE
+ */
+struct famfs_index_node {
+	char    relpath[FAMFS_MAX_PATHLEN];
+	u64     seqnum;
+	u32     type;
+	u32     nextents;
+	u64     ext_idx;
+	u64     size;
+	uid_t   uid;
+	gid_t   gid;
+	mode_t  mode;
+	u32     hash;
+	u32     parent;
+	u32     first_child;
+	u32     last_child;
+	u32     next_sibling;
+};
+
+/**
+ * struct famfs_index - in-memory namespace index built from the log
+ *
+ * Open-addressing (linear probe) hash table of relpath -> node, with the children of
+ * each directory linked in log order. Node 0 is the root directory. Built in one pass
+ * over the snapshot and the log, and updated incrementally by famfs_index_update().
+ * Removal entries unhash the node and unlink it from its parent.
+ *
+ * @nodes       - node array; pointers into it are invalidated by famfs_index_update()
+ * @nnodes      - nodes in use
+ * @maxnodes    - nodes allocated
+ * @slots       - hash slots; 0 is empty, otherwise node index + 1
+ * @nslots      - number of slots (power of 2, at most half full)
+ * @ext         - extent pool
+ * @next_ext    - extents in use
+ * @max_ext     - extents allocated
+ * @next_seqnum - seqnum of the first log entry that is not in the index
+ * @ndups       - log entries whose relpath was already in the index (first one wins)
+ * @norphans    - entries whose parent directory is not in the index
+ * @nmissing    - removal entries for a path that was not in the index (or was not a
+ *                file, or a directory, or was not empty), which are ignored
+ */
+struct famfs_index {
+	struct famfs_index_node    *nodes;
+	u32                         nnodes;
+	u32                         maxnodes;
+	u32                        *slots;
+	u32                         nslots;
+	struct famfs_simple_extent *ext;
+	u64                         next_ext;
+	u64                         max_ext;
+	u64                         next_seqnum;
+	u64                         ndups;
+	u64                         norphans;
+	u64                         nmissing;
+};
+
+struct famfs_index *famfs_index_build(const struct famfs_log *logp, int verbose);
+int famfs_index_update(struct famfs_index *idx, const struct famfs_log *logp);
+void famfs_index_free(struct famfs_index *idx);
+const struct famfs_index_node *famfs_index_lookup(const struct famfs_index *idx,
+						  const char *relpath);
+const struct famfs_index_node *famfs_index_readdir(const struct famfs_index *idx,
+						   const struct famfs_index_node *dir,
+						   const struct famfs_index_node *prev);
+const struct famfs_simple_extent *famfs_index_extents(const struct famfs_index *idx,
+						      const struct famfs_index_node *node);
+
+#endif /* _H_FAMFS_INDEX */
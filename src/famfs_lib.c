@@ -26,14 +26,19 @@
 #include <libgen.h>
 #include <assert.h>
 #include <sys/param.h> /* MIN()/MAX() */
-#include <zlib.h>
 #include <sys/file.h>
 #include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <linux/famfs_ioctl.h>
 
 #include "famfs_meta.h"
 #include "famfs_lib.h"
 #include "famfs_lib_internal.h"
+#include "famfs_csum.h"
+#include "famfs_alloc.h"
+#include "famfs_index.h"
 #include "bitmap.h"
 #include "mu_mem.h"
 
@@ -54,17 +59,29 @@ struct famfs_log_stats {
 	u64 d_existed;
 	u64 d_created;
 	u64 d_errs;
+	u64 f_unlinked; /* FAMFS_LOG_UNLINK entries */
+	u64 f_removed;  /* ...that removed a file */
+	u64 d_rmdirs;   /* FAMFS_LOG_RMDIR entries */
+	u64 d_removed;  /* ...that removed a directory */
+	u64 n_snap;   /* records loaded from the snapshot */
+	u64 n_segs;   /* log segments */
+	u64 seg_bytes;
+	u64 last_alloc_end; /* End of the last extent allocated in the log */
+	u64 next_seqnum;    /* Seqnum after the last entry */
 };
 
 static u8 *
 famfs_build_bitmap(const struct famfs_log   *logp,
 		   u64                       dev_size_in,
+		   u64                       alloc_unit,
 		   u64                      *bitmap_nbits_out,
 		   u64                      *alloc_errors_out,
 		   u64                      *size_total_out,
 		   u64                      *alloc_total_out,
 		   struct famfs_log_stats   *log_stats_out,
 		   int                       verbose);
+static int famfs_bmap_ckpt_check(const struct famfs_log *logp, const u8 *bitmap,
+				 u64 alloc_unit, u64 nbits, int verbose);
 static int
 famfs_dir_create(
 	const char *mpt,
@@ -83,6 +100,10 @@ static int famfs_mmap_superblock_and_log_raw(const char *devname,
 					     struct famfs_log **logp,
 					     u64 log_len,
 					     int read_only);
+static int famfs_log_txn_stage(struct famfs_locked_log *lp, struct famfs_log_entry *e);
+static void famfs_free_extent(struct famfs_locked_log *lp, u64 offset, u64 len);
+static s64 famfs_alloc_contiguous(struct famfs_locked_log *lp, u64 size, int verbose);
+static int famfs_locked_log_index(struct famfs_locked_log *lp, int verbose);
 
 s64 get_multiplier(const char *endptr)
 {
@@ -139,10 +160,14 @@ void famfs_dump_log(struct famfs_log *logp)
 		fprintf(stderr, "Error invalid log header\n");
 
 	printf("famfs log: (%p)\n", logp);
-	printf("\tmagic:      %llx\n", logp->famfs_log_magic);
+	printf("\tmagic:      %llx (log format v%d)\n", logp->famfs_log_magic,
+	       (logp->famfs_log_magic == FAMFS_LOG_MAGIC_V2) ? 2 : 1);
 	printf("\tlen:        %lld\n", logp->famfs_log_len);
 	printf("\tlast index: %lld\n", logp->famfs_log_last_index);
 	printf("\tnext index: %lld\n", logp->famfs_log_next_index);
+	printf("\tsnapshot:   seqnum %lld slot %lld (offset %lld len %lld)\n",
+	       logp->famfs_log_snap_seqnum, logp->famfs_log_snap_slot,
+	       logp->famfs_log_snap_offset, logp->famfs_log_snap_len);
 }
 
 /**
@@ -217,6 +242,40 @@ file_has_map(int fd)
 	return 1;
 }
 
+/**
+ * famfs_file_map_matches()
+ *
+ * Check whether an open file is the one a log entry created (same size and extents),
+ * rather than a file that was created later at the same path.
+ *
+ * Returns 1 if it matches, 0 if not
+ */
+static int
+famfs_file_map_matches(int fd, const struct famfs_file_creation *fc)
+{
+	struct famfs_extent ext_list[FAMFS_MAX_EXTENTS];
+	struct famfs_ioc_map filemap = {0};
+	u32 i;
+
+	if (mock_kmod)
+		return 1;
+
+	if (ioctl(fd, FAMFSIOC_MAP_GET, &filemap))
+		return 0;
+	if (filemap.file_size != fc->famfs_fc_size
+	    || filemap.ext_list_count != fc->famfs_nextents
+	    || filemap.ext_list_count > FAMFS_MAX_EXTENTS)
+		return 0;
+	if (ioctl(fd, FAMFSIOC_MAP_GETEXT, ext_list))
+		return 0;
+	for (i = 0; i < filemap.ext_list_count; i++) {
+		if (ext_list[i].offset != fc->famfs_ext_list[i].se.famfs_extent_offset
+		    || ext_list[i].len != fc->famfs_ext_list[i].se.famfs_extent_len)
+			return 0;
+	}
+	return 1;
+}
+
 static void
 mu_print_bitmap(u8 *bitmap, int num_bits)
 {
@@ -269,6 +328,7 @@ famfs_print_uuid(const uuid_le *uuid)
 }
 
 #define SYS_UUID_DIR "/opt/famfs"
+#define FAMFS_LOGPLAY_STATE_DIR SYS_UUID_DIR "/logplay"
 /*
  * Check if uuid file exists, if not, create it
  * and update it with a new uuid.
@@ -513,46 +573,156 @@ famfs_get_device_size(const char       *fname,
  * famfs_gen_superblock_crc()
  *
  * This function must be updated if any fields changes before teh crc in the superblock!
+ *
+ * @sb  - the superblock
+ * @alg - checksum algorithm (FAMFS_CSUM_ALG(sb->ts_crc) to validate an existing one)
+ *
+ * Returns the versioned checksum (see FAMFS_CSUM_VAL())
  */
 unsigned long
-famfs_gen_superblock_crc(const struct famfs_superblock *sb)
+famfs_gen_superblock_crc(const struct famfs_superblock *sb, enum famfs_csum_alg alg)
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
+	u32 crc = 0;
 
 	assert(sb);
-	crc = crc32(crc, (const unsigned char *)&sb->ts_magic,       sizeof(sb->ts_magic));
-	crc = crc32(crc, (const unsigned char *)&sb->ts_version,     sizeof(sb->ts_version));
-	crc = crc32(crc, (const unsigned char *)&sb->ts_log_offset,  sizeof(sb->ts_log_offset));
-	crc = crc32(crc, (const unsigned char *)&sb->ts_log_len,     sizeof(sb->ts_log_len));
-	crc = crc32(crc, (const unsigned char *)&sb->ts_uuid,        sizeof(sb->ts_uuid));
-	crc = crc32(crc, (const unsigned char *)&sb->ts_system_uuid, sizeof(sb->ts_system_uuid));
-	return crc;
+	crc = famfs_csum(alg, crc, &sb->ts_magic,       sizeof(sb->ts_magic));
+	crc = famfs_csum(alg, crc, &sb->ts_version,     sizeof(sb->ts_version));
+	crc = famfs_csum(alg, crc, &sb->ts_log_offset,  sizeof(sb->ts_log_offset));
+	crc = famfs_csum(alg, crc, &sb->ts_log_len,     sizeof(sb->ts_log_len));
+	crc = famfs_csum(alg, crc, &sb->ts_uuid,        sizeof(sb->ts_uuid));
+	crc = famfs_csum(alg, crc, &sb->ts_system_uuid, sizeof(sb->ts_system_uuid));
+	return FAMFS_CSUM_VAL(alg, crc);
 }
 
+/**
+ * famfs_gen_log_header_crc()
+ *
+ * @logp - the log
+ * @alg  - checksum algorithm; this becomes the algorithm of the log (see
+ *         famfs_log_csum_alg())
+ *
+ * Returns the versioned checksum (see FAMFS_CSUM_VAL())
+ */
 unsigned long
-famfs_gen_log_header_crc(const struct famfs_log *logp)
+famfs_gen_log_header_crc(const struct famfs_log *logp, enum famfs_csum_alg alg)
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
+	u32 crc = 0;
 
 	assert(logp);
-	crc = crc32(crc, (const unsigned char *)
-		    &logp->famfs_log_magic, sizeof(logp->famfs_log_magic));
-	crc = crc32(crc, (const unsigned char *)
-		    &logp->famfs_log_len, sizeof(logp->famfs_log_len));
-	crc = crc32(crc, (const unsigned char *)
-		    &logp->famfs_log_last_index, sizeof(logp->famfs_log_last_index));
-	return crc;
+	crc = famfs_csum(alg, crc, &logp->famfs_log_magic, sizeof(logp->famfs_log_magic));
+	crc = famfs_csum(alg, crc, &logp->famfs_log_len, sizeof(logp->famfs_log_len));
+	crc = famfs_csum(alg, crc, &logp->famfs_log_last_index,
+			 sizeof(logp->famfs_log_last_index));
+	crc = famfs_csum(alg, crc, &logp->famfs_log_snap_offset,
+			 sizeof(logp->famfs_log_snap_offset));
+	crc = famfs_csum(alg, crc, &logp->famfs_log_snap_len, sizeof(logp->famfs_log_snap_len));
+	return FAMFS_CSUM_VAL(alg, crc);
 }
 
 static unsigned long
-famfs_gen_log_entry_crc(const struct famfs_log_entry *le)
+famfs_gen_log_entry_crc(const struct famfs_log_entry *le, enum famfs_csum_alg alg)
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
 	size_t le_size = sizeof(*le);
 	size_t le_crc_size = le_size - sizeof(le->famfs_log_entry_crc);
 
-	crc = crc32(crc, (const unsigned char *)le, le_crc_size);
-	return crc;
+	return FAMFS_CSUM_VAL(alg, famfs_csum(alg, 0, le, le_crc_size));
+}
+
+/**
+ * famfs_alloc_group_affinity()
+ *
+ * Count the files that are in the region of their group (see famfs_alloc_group()).
+ * Reservations are not logged, so a file is considered in its group's region if all
+ * of its extents are in @region aligned blocks that hold no file of another group.
+ * Groups are top-level directories; files in the root directory have none.
+ *
+ * @logp
+ * @region   - block size in bytes (FAMFS_ALLOC_GROUP_LEN)
+ * @ngrouped - files that have a group
+ * @nin      - ...and are in its region
+ *
+ * Returns 0, or a negative errno
+ */
+int
+famfs_alloc_group_affinity(
+	const struct famfs_log *logp,
+	u64                     region,
+	u64                    *ngrouped,
+	u64                    *nin)
+{
+	const struct famfs_simple_extent *ext;
+	const struct famfs_index_node *n;
+	struct famfs_index *idx;
+	u64 b, nblocks = 0;
+	u32 *owner = NULL;
+	u32 *group = NULL;
+	u32 i, j, g;
+	int rc = 0;
+
+	*ngrouped = 0;
+	*nin = 0;
+	idx = famfs_index_build(logp, 0);
+	if (!idx)
+		return -ENOMEM;
+
+	/* The group of each file: the ancestor whose parent is the root */
+	group = calloc(idx->nnodes, sizeof(*group));
+	if (!group) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 1; i < idx->nnodes; i++) {
+		n = &idx->nodes[i];
+		if (n->type != FAMFS_LOG_FILE)
+			continue;
+		for (g = i; idx->nodes[g].parent != 0 && idx->nodes[g].parent != FAMFS_INDEX_NONE;)
+			g = idx->nodes[g].parent;
+		if (g == i || idx->nodes[g].parent != 0)
+			continue;
+		group[i] = g;
+		ext = famfs_index_extents(idx, n);
+		for (j = 0; j < n->nextents; j++)
+			nblocks = MAX(nblocks, (ext[j].famfs_extent_offset
+						+ ext[j].famfs_extent_len + region - 1) / region);
+	}
+
+	/* The group that owns each block, or FAMFS_INDEX_NONE if there is more than one */
+	owner = calloc(nblocks + 1, sizeof(*owner));
+	if (!owner) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 1; i < idx->nnodes; i++) {
+		if (!group[i])
+			continue;
+		ext = famfs_index_extents(idx, &idx->nodes[i]);
+		for (j = 0; j < idx->nodes[i].nextents; j++) {
+			for (b = ext[j].famfs_extent_offset / region;
+			     b * region < ext[j].famfs_extent_offset + ext[j].famfs_extent_len; b++)
+				owner[b] = (!owner[b] || owner[b] == group[i])
+					? group[i] : FAMFS_INDEX_NONE;
+		}
+	}
+
+	for (i = 1; i < idx->nnodes; i++) {
+		u32 in = 1;
+
+		if (!group[i])
+			continue;
+		ext = famfs_index_extents(idx, &idx->nodes[i]);
+		for (j = 0; j < idx->nodes[i].nextents; j++) {
+			for (b = ext[j].famfs_extent_offset / region;
+			     b * region < ext[j].famfs_extent_offset + ext[j].famfs_extent_len; b++)
+				in &= (owner[b] == group[i]);
+		}
+		(*ngrouped)++;
+		*nin += in;
+	}
+out:
+	free(owner);
+	free(group);
+	famfs_index_free(idx);
+	return rc;
 }
 
 /**
@@ -572,8 +742,10 @@ famfs_fsck_scan(
 	size_t effective_log_size;
 	struct famfs_log_stats ls;
 	u64 alloc_sum, fsize_sum;
+	u64 ngrouped, nin;
 	size_t total_log_size;
 	u64 dev_capacity;
+	u64 alloc_unit;
 	u64 errors = 0;
 	u8 *bitmap;
 	u64 nbits;
@@ -584,8 +756,13 @@ famfs_fsck_scan(
 	assert(logp);
 
 	dev_capacity = sb->ts_devlist[0].dd_size;
+	alloc_unit = famfs_sb_alloc_unit(sb->ts_sb_flags);
+	if (!alloc_unit) {
+		fprintf(stderr, "%s: invalid allocation unit in superblock\n", __func__);
+		return -1;
+	}
 	effective_log_size = sizeof(*logp) +
-		(logp->famfs_log_next_index * sizeof(struct famfs_log_entry));
+		famfs_log_pos_bytes(logp, 0, logp->famfs_log_next_index);
 
 	/*
 	 * Print superblock info
@@ -600,6 +777,11 @@ famfs_fsck_scan(
 	famfs_print_role_string(role);
 
 	printf("  sizeof superblock: %ld\n", sizeof(struct famfs_superblock));
+	printf("  checksum:          %s\n", famfs_csum_name(FAMFS_CSUM_ALG(sb->ts_crc)));
+	printf("  allocation policy: %s%s\n",
+	       famfs_alloc_policy_name(famfs_sb_alloc_policy(sb->ts_sb_flags)),
+	       (sb->ts_sb_flags & FAMFS_SB_ALLOC_CONTIG) ? " (contiguous)" : "");
+	printf("  allocation unit:   %lld\n", alloc_unit);
 	printf("  num_daxdevs:       %d\n", sb->ts_num_daxdevs);
 	for (i = 0; i < sb->ts_num_daxdevs; i++) {
 		if (i == 0)
@@ -615,19 +797,28 @@ famfs_fsck_scan(
 	 * print log info
 	 */
 	printf("\nLog stats:\n");
-	printf("  # of log entries in use: %lld of %lld\n",
-	       logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
+	if (famfs_log_is_v2(logp))
+		printf("  log format v2; bytes of records in use: %lld of %lld\n",
+		       logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
+	else
+		printf("  # of log entries in use: %lld of %lld\n",
+		       logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
 	printf("  Log size in use:          %ld\n", effective_log_size);
+	printf("  Log checksum:             %s\n", famfs_csum_name(famfs_log_csum_alg(logp)));
 
 	/*
 	 * Build the log bitmap to scan for errors
 	 */
-	bitmap = famfs_build_bitmap(logp,  dev_capacity, &nbits, &errors,
+	bitmap = famfs_build_bitmap(logp,  dev_capacity, alloc_unit, &nbits, &errors,
 				    &fsize_sum, &alloc_sum, &ls, verbose);
+	if (!bitmap) {
+		fprintf(stderr, "ERROR: unable to build the allocation bitmap\n");
+		return -1;
+	}
 	if (errors)
 		printf("ERROR: %lld ALLOCATION COLLISIONS FOUND\n", errors);
 	else {
-		u64 bitmap_capacity = nbits * FAMFS_ALLOC_UNIT;
+		u64 bitmap_capacity = nbits * alloc_unit;
 		float space_amp = (float)alloc_sum / (float)fsize_sum;
 		float percent_used = 100.0 * (float)alloc_sum /  (float)bitmap_capacity;
 		float agig = 1024 * 1024 * 1024;
@@ -654,9 +845,50 @@ famfs_fsck_scan(
 
 	/* Log stats */
 	printf("Famfs log:\n");
-	printf("  %lld of %lld entries used\n", ls.n_entries, logp->famfs_log_last_index + 1);
+	if (famfs_log_is_v2(logp))
+		printf("  %lld entries (%lld of %lld bytes used)\n", ls.n_entries,
+		       logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
+	else
+		printf("  %lld of %lld entries used\n", ls.n_entries,
+		       logp->famfs_log_last_index + 1);
+	if (ls.n_segs)
+		printf("  %lld segments (%lld bytes)\n", ls.n_segs, ls.seg_bytes);
+	if (logp->famfs_log_snap_seqnum)
+		printf("  %lld snapshot records (seqnum %lld, slot %lld)\n", ls.n_snap,
+		       logp->famfs_log_snap_seqnum, logp->famfs_log_snap_slot);
 	printf("  %lld files\n", ls.f_logged);
-	printf("  %lld directories\n\n", ls.d_logged);
+	printf("  %lld directories\n", ls.d_logged);
+	if (ls.f_unlinked || ls.d_rmdirs)
+		printf("  %lld files and %lld directories removed\n",
+		       ls.f_unlinked, ls.d_rmdirs);
+	if (!famfs_alloc_group_affinity(logp, FAMFS_ALLOC_GROUP_LEN, &ngrouped, &nin)
+	    && ngrouped)
+		printf("  %lld of %lld files in directories are in the region of their "
+		       "top-level directory\n", nin, ngrouped);
+	errors += famfs_bmap_ckpt_check(logp, bitmap, alloc_unit, nbits, verbose);
+	if (logp->famfs_log_alloc_bytes) {
+		u64 nfiles = ls.f_logged - ls.f_unlinked;
+		u64 ndirs  = ls.d_logged - ls.d_rmdirs;
+
+		if (logp->famfs_log_cnt_unit != alloc_unit) {
+			printf("  capacity counters were computed with %lld byte units; "
+			       "the master will recompute them\n", logp->famfs_log_cnt_unit);
+		} else if (logp->famfs_log_cnt_seqnum != ls.next_seqnum) {
+			printf("  capacity counters lag the log (seqnum %lld of %lld); "
+			       "the master will catch them up\n",
+			       logp->famfs_log_cnt_seqnum, ls.next_seqnum);
+		} else if (logp->famfs_log_alloc_bytes != alloc_sum
+			   || logp->famfs_log_nfiles != nfiles || logp->famfs_log_ndirs != ndirs) {
+			printf("ERROR: CAPACITY COUNTERS (%lld bytes, %lld files, %lld dirs) "
+			       "DO NOT MATCH THE LOG (%lld, %lld, %lld)\n",
+			       logp->famfs_log_alloc_bytes, logp->famfs_log_nfiles,
+			       logp->famfs_log_ndirs, alloc_sum, nfiles, ndirs);
+			errors++;
+		} else {
+			printf("  capacity counters match the log\n");
+		}
+	}
+	printf("\n");
 
 	free(bitmap);
 
@@ -670,7 +902,7 @@ famfs_fsck_scan(
 
 		printf("  last_log_index:    %lld\n", logp->famfs_log_last_index);
 		total_log_size = sizeof(struct famfs_log)
-			+ (sizeof(struct famfs_log_entry) * logp->famfs_log_last_index);
+			+ famfs_log_pos_bytes(logp, 0, logp->famfs_log_last_index);
 		printf("  usable log size:   %ld\n", total_log_size);
 		printf("  sizeof(struct famfs_file_creation): %ld\n",
 		       sizeof(struct famfs_file_creation));
@@ -806,6 +1038,12 @@ famfs_check_super(const struct famfs_superblock *sb)
 	if (sb->ts_magic != FAMFS_SUPER_MAGIC)
 		return -1;
 
+	if (sb->ts_version == FAMFS_VERSION_V46) {
+		fprintf(stderr, "%s: superblock version=%lld. Run 'famfs upgrade <daxdev>' on "
+			"the master to upgrade it to version %lld\n",
+			__func__, sb->ts_version, (u64)FAMFS_CURRENT_VERSION);
+		return -1;
+	}
 	if (sb->ts_version != FAMFS_CURRENT_VERSION) {
 		fprintf(stderr, "%s: superblock version=%lld (expected %lld).\n"
 			"\tThis famfs_lib is not compatible with your famfs instance\n",
@@ -813,12 +1051,31 @@ famfs_check_super(const struct famfs_superblock *sb)
 		return -1;
 	}
 
-	sbcrc = famfs_gen_superblock_crc(sb);
+	if (!famfs_csum_alg_valid(FAMFS_CSUM_ALG(sb->ts_crc))) {
+		fprintf(stderr, "%s ERROR: unknown checksum algorithm %d in superblock\n",
+			__func__, FAMFS_CSUM_ALG(sb->ts_crc));
+		return -1;
+	}
+	sbcrc = famfs_gen_superblock_crc(sb, FAMFS_CSUM_ALG(sb->ts_crc));
 	if (sb->ts_crc != sbcrc) {
 		fprintf(stderr, "%s ERROR: crc mismatch in superblock!\n", __func__);
 		return -1;
 	}
 
+	/* The device list is not covered by the crc. Extents (and the kernel's file
+	 * maps) have no device index, so everything is on the first device
+	 */
+	if (sb->ts_num_daxdevs < 1 || sb->ts_num_daxdevs > FAMFS_SUPERBLOCK_MAX_DAXDEVS) {
+		fprintf(stderr, "%s ERROR: superblock has %d devices (max %d)\n",
+			__func__, sb->ts_num_daxdevs, FAMFS_SUPERBLOCK_MAX_DAXDEVS);
+		return -1;
+	}
+	if (!famfs_sb_alloc_unit(sb->ts_sb_flags)) {
+		fprintf(stderr, "%s ERROR: invalid allocation unit in superblock flags (0x%x)\n",
+			__func__, sb->ts_sb_flags);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1017,7 +1274,12 @@ famfs_file_map_create(
 	filemap.extent_type    = SIMPLE_DAX_EXTENT;
 	filemap.ext_list_count = nextents;
 
-	/* TODO: check for overflow (nextents > max_extents) */
+	if (nextents < 1 || nextents > FAMFS_MAX_EXTENTS) {
+		fprintf(stderr, "%s: file %s has %d extents (max %d)\n",
+			__func__, path, nextents, FAMFS_MAX_EXTENTS);
+		errno = EINVAL;
+		return -1;
+	}
 	for (i = 0; i < nextents; i++) {
 		filemap.ext_list[i].offset = ext_list[i].famfs_extent_offset;
 		filemap.ext_list[i].len    = ext_list[i].famfs_extent_len;
@@ -1237,6 +1499,334 @@ famfs_mmap_whole_file(
 }
 
 
+/********************************************************************************
+ *
+ * Log commit protocol
+ *
+ * The master appends log entries as follows:
+ *   1. Write the entry (including its seqnum and crc) at famfs_log_next_index
+ *   2. Flush the cache lines of the entry, and fence
+ *   3. Publish the entry by advancing famfs_log_next_seqnum and famfs_log_next_index,
+ *      and flush the log header cache line that holds them
+ *
+ * This way an entry is always in memory before the header that makes it visible.
+ * Step 3 (and publishing a snapshot) is bracketed by increments of famfs_log_gen,
+ * which is odd while the published fields are being updated. The capacity counters
+ * (allocated bytes, files and directories) are updated in the same bracket: they are
+ * in famfs_log_gen's cache line, which the closing increment flushes.
+ *
+ * Readers take a consistent copy of the published fields with a seqlock-style read of
+ * famfs_log_gen (see famfs_log_read_header()), and only then invalidate the entries
+ * below famfs_log_next_index that they are about to read (see famfs_log_acquire()).
+ * An entry that is torn or stale anyway (e.g. because the master crashed during an
+ * append, or a reader that read the log without following the protocol) fails its
+ * seqnum or crc check; cursors re-read the header and retry such an entry a few
+ * times before giving up (see famfs_log_cursor_retry()).
+ *
+ * Log positions (famfs_log_next_index, famfs_log_last_index and the positions passed
+ * around by the log code) are entry indices in a v1 log, and byte offsets into the
+ * record area in a v2 log (see famfs_log_pos_addr() and famfs_log_put_entry()).
+ */
+
+/**
+ * famfs_log_flush_entries()
+ *
+ * Commit protocol step 2: make the entries at positions [@from, @to) visible in memory
+ * before they are published.
+ */
+static inline void
+famfs_log_flush_entries(
+	const struct famfs_log *logp,
+	u64                     from,
+	u64                     to)
+{
+	flush_processor_cache(famfs_log_pos_addr(logp, from),
+			      famfs_log_pos_bytes(logp, from, to));
+	__sync_synchronize(); /* The entries must be flushed before the header is updated */
+}
+
+/* Size of the header cache line that holds the published fields */
+#define FAMFS_LOG_PUBLISHED_BYTES (offsetof(struct famfs_log, famfs_log_snap_offset) \
+				   - offsetof(struct famfs_log, famfs_log_next_seqnum))
+
+/* Bump famfs_log_gen (making it odd) before updating the published fields */
+static inline void
+famfs_log_write_begin(struct famfs_log *logp)
+{
+	logp->famfs_log_gen++;
+	flush_processor_cache(&logp->famfs_log_gen, sizeof(logp->famfs_log_gen));
+	__sync_synchronize(); /* Readers must see the odd generation first */
+}
+
+/* Bump famfs_log_gen (making it even) after the published fields were flushed */
+static inline void
+famfs_log_write_end(struct famfs_log *logp)
+{
+	__sync_synchronize(); /* The published fields must be flushed first */
+	logp->famfs_log_gen++;
+	flush_processor_cache(&logp->famfs_log_gen, sizeof(logp->famfs_log_gen));
+}
+
+/* Apply the change that @le makes to the capacity counters @c */
+static void
+famfs_log_count_entry(
+	struct famfs_log_counters    *c,
+	const struct famfs_log_entry *le,
+	u64                           alloc_unit)
+{
+	const struct famfs_file_creation *fc = &le->famfs_fc;
+	u64 bytes = 0;
+	u32 j;
+
+	switch (le->famfs_log_entry_type) {
+	case FAMFS_LOG_FILE:
+	case FAMFS_LOG_UNLINK:
+		for (j = 0; j < fc->famfs_nextents; j++)
+			bytes += famfs_alloc_units(fc->famfs_ext_list[j].se.famfs_extent_len,
+						   alloc_unit) * alloc_unit;
+		if (le->famfs_log_entry_type == FAMFS_LOG_FILE) {
+			c->nfiles++;
+			c->alloc_bytes += bytes;
+		} else {
+			c->nfiles--;
+			c->alloc_bytes -= bytes;
+		}
+		break;
+	case FAMFS_LOG_MKDIR:
+		c->ndirs++;
+		break;
+	case FAMFS_LOG_RMDIR:
+		c->ndirs--;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Add the pending counter changes of @lp to the log header; call inside a write bracket */
+static inline void
+famfs_log_put_counters(struct famfs_locked_log *lp, u64 next_seqnum)
+{
+	struct famfs_log *logp = lp->logp;
+
+	if (logp->famfs_log_alloc_bytes) { /* 0: not maintained (famfs_log_counters_sync()) */
+		logp->famfs_log_alloc_bytes += lp->cnt.alloc_bytes;
+		logp->famfs_log_nfiles      += lp->cnt.nfiles;
+		logp->famfs_log_ndirs       += lp->cnt.ndirs;
+		logp->famfs_log_cnt_seqnum   = next_seqnum;
+	}
+	memset(&lp->cnt, 0, sizeof(lp->cnt));
+}
+
+/**
+ * famfs_log_publish()
+ *
+ * Commit protocol step 3: publish all entries before position @next_index of @logp
+ * (the log, or the segment being appended to), along with their counter changes.
+ * The counters are in the log file header, so publishing in a segment takes a second
+ * bracket there.
+ */
+static inline void
+famfs_log_publish(
+	struct famfs_locked_log *lp,
+	struct famfs_log        *logp,
+	u64                      next_index,
+	u64                      next_seqnum)
+{
+	famfs_log_write_begin(logp);
+	logp->famfs_log_next_seqnum = next_seqnum;
+	logp->famfs_log_next_index  = next_index;
+	flush_processor_cache(&logp->famfs_log_next_seqnum,
+			      sizeof(logp->famfs_log_next_seqnum)
+			      + sizeof(logp->famfs_log_next_index));
+	if (logp == lp->logp)
+		famfs_log_put_counters(lp, next_seqnum);
+	famfs_log_write_end(logp);
+
+	if (logp != lp->logp) {
+		famfs_log_write_begin(lp->logp);
+		famfs_log_put_counters(lp, next_seqnum);
+		famfs_log_write_end(lp->logp);
+	}
+}
+
+/*
+ * Count space allocated without a log entry (a log segment or the bitmap checkpoint),
+ * in whole allocation units like famfs_log_count_entry()
+ */
+static void
+famfs_log_count_space(struct famfs_locked_log *lp, u64 len)
+{
+	struct famfs_log *logp = lp->logp;
+
+	if (!logp->famfs_log_alloc_bytes)
+		return;
+	famfs_log_write_begin(logp);
+	logp->famfs_log_alloc_bytes += famfs_alloc_units(len, lp->alloc_unit) * lp->alloc_unit;
+	famfs_log_write_end(logp);
+}
+
+/**
+ * famfs_log_read_header()
+ *
+ * Reader side of the commit protocol: take a consistent copy of the published fields
+ * of the log header. famfs_log_gen is read before and after the fields; if it was
+ * odd (the master was publishing) or changed, the fields are read again.
+ *
+ * If the master does not finish publishing within FAMFS_LOG_GEN_WAIT_US (e.g. it
+ * crashed in the middle of it), the fields are returned anyway; they are no worse
+ * than what a reader got before there was a generation counter, and the entry
+ * checks still apply.
+ *
+ * @logp - the log
+ * @v    - receives the published fields
+ *
+ * Returns 0 if @v is consistent, -EAGAIN if the master did not finish publishing
+ */
+int
+famfs_log_read_header(
+	const struct famfs_log *logp,
+	struct famfs_log_view  *v)
+{
+	u64 waited_us = 0;
+	u32 spins = 0;
+	u64 gen;
+
+	for (;;) {
+		invalidate_processor_cache(&logp->famfs_log_gen, sizeof(logp->famfs_log_gen));
+		gen = __atomic_load_n(&logp->famfs_log_gen, __ATOMIC_ACQUIRE);
+
+		invalidate_processor_cache(&logp->famfs_log_next_seqnum,
+					   FAMFS_LOG_PUBLISHED_BYTES);
+		v->next_seqnum = logp->famfs_log_next_seqnum;
+		v->next_index  = logp->famfs_log_next_index;
+		v->snap_seqnum = logp->famfs_log_snap_seqnum;
+		v->snap_slot   = logp->famfs_log_snap_slot;
+		v->gen         = gen;
+
+		__sync_synchronize(); /* The fields must be read before the generation */
+		invalidate_processor_cache(&logp->famfs_log_gen, sizeof(logp->famfs_log_gen));
+		if (!(gen & 1) && __atomic_load_n(&logp->famfs_log_gen, __ATOMIC_ACQUIRE) == gen)
+			return 0;
+
+		/* The master is publishing; it only takes a few cache line flushes */
+		if (++spins < FAMFS_LOG_GEN_SPINS) {
+			sched_yield();
+			continue;
+		}
+		if (waited_us >= FAMFS_LOG_GEN_WAIT_US) {
+			fprintf(stderr, "%s: log generation %lld is not settling\n",
+				__func__, gen);
+			return -EAGAIN;
+		}
+		usleep(100);
+		waited_us += 100;
+	}
+}
+
+/**
+ * famfs_log_read_counters()
+ *
+ * Reader side: take a consistent copy of the capacity counters. They share a cache
+ * line with famfs_log_gen, so one invalidate fetches both; the generation is checked
+ * as in famfs_log_read_header().
+ *
+ * @logp - the log (not a segment)
+ * @c    - receives the counters
+ *
+ * Returns 0, -EAGAIN if the master did not finish publishing, or -ENODATA if the
+ * counters are not maintained yet
+ */
+int
+famfs_log_read_counters(
+	const struct famfs_log    *logp,
+	struct famfs_log_counters *c)
+{
+	u64 waited_us = 0;
+	u32 spins = 0;
+	u64 gen;
+
+	for (;;) {
+		invalidate_processor_cache(&logp->famfs_log_gen, 64);
+		gen = __atomic_load_n(&logp->famfs_log_gen, __ATOMIC_ACQUIRE);
+		c->seqnum      = logp->famfs_log_cnt_seqnum;
+		c->alloc_bytes = logp->famfs_log_alloc_bytes;
+		c->nfiles      = logp->famfs_log_nfiles;
+		c->ndirs       = logp->famfs_log_ndirs;
+
+		__sync_synchronize(); /* The counters must be read before the generation */
+		invalidate_processor_cache(&logp->famfs_log_gen, sizeof(logp->famfs_log_gen));
+		if (!(gen & 1) && __atomic_load_n(&logp->famfs_log_gen, __ATOMIC_ACQUIRE) == gen)
+			return (c->alloc_bytes) ? 0 : -ENODATA;
+
+		if (++spins < FAMFS_LOG_GEN_SPINS) {
+			sched_yield();
+			continue;
+		}
+		if (waited_us >= FAMFS_LOG_GEN_WAIT_US) {
+			fprintf(stderr, "%s: log generation %lld is not settling\n",
+				__func__, gen);
+			return -EAGAIN;
+		}
+		usleep(100);
+		waited_us += 100;
+	}
+}
+
+/**
+ * famfs_log_acquire_header()
+ *
+ * Reader side of the commit protocol: read the published fields of the log header
+ * (next_seqnum, next_index and the snapshot seqnum and slot) consistently
+ * (see famfs_log_read_header()).
+ *
+ * Returns: famfs_log_next_index
+ */
+static inline u64
+famfs_log_acquire_header(const struct famfs_log *logp)
+{
+	struct famfs_log_view v;
+
+	famfs_log_read_header(logp, &v);
+	return v.next_index;
+}
+
+/* Invalidate the processor cache for the entries at positions [@from, @to) */
+static void
+famfs_log_invalidate_entries(
+	const struct famfs_log *logp,
+	u64                     from,
+	u64                     to)
+{
+	if (to > from && to <= logp->famfs_log_last_index + 1)
+		invalidate_processor_cache(famfs_log_pos_addr(logp, from),
+					   famfs_log_pos_bytes(logp, from, to));
+}
+
+/**
+ * famfs_log_acquire()
+ *
+ * Reader side of the commit protocol: get the current famfs_log_next_index, and
+ * invalidate the processor cache for the entries from @from up to it, so they will
+ * be read from memory.
+ *
+ * @logp - the log
+ * @from - position of the first entry the caller is going to read
+ *
+ * Returns: famfs_log_next_index
+ */
+static u64
+famfs_log_acquire(
+	const struct famfs_log *logp,
+	u64                     from)
+{
+	u64 next_index;
+
+	next_index = famfs_log_acquire_header(logp);
+	famfs_log_invalidate_entries(logp, from, next_index);
+	return next_index;
+}
+
 /********************************************************************************
  *
  * Log play stuff
@@ -1247,6 +1837,8 @@ famfs_print_log_stats(const char *msg,
 		      const struct famfs_log_stats *ls,
 		      int verbose)
 {
+	if (ls->n_snap)
+		printf("%s: loaded %llu snapshot records\n", msg, ls->n_snap);
 	printf("%s: processed %llu log entries; %llu new files; %llu new directories\n",
 	       msg, ls->n_entries, ls->f_created, ls->d_created);
 	if (verbose) {
@@ -1263,6 +1855,9 @@ famfs_print_log_stats(const char *msg,
 static inline int
 famfs_log_full(const struct famfs_log *logp)
 {
+	if (famfs_log_is_v2(logp))
+		return (logp->famfs_log_next_index + famfs_log_rec_size(0, 0)
+			> logp->famfs_log_last_index + 1);
 	return (logp->famfs_log_next_index > logp->famfs_log_last_index);
 }
 
@@ -1283,21 +1878,36 @@ famfs_log_entry_md_path_is_relative(const struct famfs_mkdir *md)
 int
 famfs_validate_log_header(const struct famfs_log *logp)
 {
-	unsigned long crc = famfs_gen_log_header_crc(logp);
-
-	if (logp->famfs_log_magic != FAMFS_LOG_MAGIC) {
+	if (logp->famfs_log_magic != FAMFS_LOG_MAGIC
+	    && logp->famfs_log_magic != FAMFS_LOG_MAGIC_V2) {
 		fprintf(stderr, "%s: bad magic number in log header\n", __func__);
 		return -1;
 	}
-	if (logp->famfs_log_crc != crc) {
+	if (!famfs_csum_alg_valid(famfs_log_csum_alg(logp))) {
+		fprintf(stderr, "%s: unknown checksum algorithm %d in log header\n", __func__,
+			famfs_log_csum_alg(logp));
+		return -1;
+	}
+	if (logp->famfs_log_crc != famfs_gen_log_header_crc(logp, famfs_log_csum_alg(logp))) {
 		fprintf(stderr, "%s: invalid crc in log header\n", __func__);
 		return -1;
 	}
+	if (logp->famfs_log_snap_slot > 1) {
+		fprintf(stderr, "%s: invalid snapshot slot %lld\n", __func__,
+			logp->famfs_log_snap_slot);
+		return -1;
+	}
 	return 0;
 }
 
+/**
+ * famfs_validate_log_entry()
+ *
+ * @le     - the entry
+ * @seqnum - the seqnum the entry should have
+ */
 int
-famfs_validate_log_entry(const struct famfs_log_entry *le, u64 index)
+famfs_validate_log_entry(const struct famfs_log_entry *le, u64 seqnum)
 {
 	unsigned long crc;
 	int errors = 0;
@@ -1305,383 +1915,3626 @@ famfs_validate_log_entry(const struct famfs_log_entry *le, u64 index)
 	if (mock_failure == MOCK_FAIL_GENERIC)
 		return 0;
 
-	if (le->famfs_log_entry_seqnum != index) {
+	if (le->famfs_log_entry_seqnum != seqnum) {
 		fprintf(stderr, "%s: bad seqnum; expect %lld found %lld\n",
-			__func__, index, le->famfs_log_entry_seqnum);
+			__func__, seqnum, le->famfs_log_entry_seqnum);
 		errors++;
 	}
-	crc = famfs_gen_log_entry_crc(le);
+	if (!famfs_csum_alg_valid(FAMFS_CSUM_ALG(le->famfs_log_entry_crc))) {
+		fprintf(stderr, "%s: unknown checksum algorithm at log seqnum %lld\n",
+			__func__, seqnum);
+		return ++errors;
+	}
+	crc = famfs_gen_log_entry_crc(le, FAMFS_CSUM_ALG(le->famfs_log_entry_crc));
 	if (le->famfs_log_entry_crc != crc) {
-		fprintf(stderr, "%s: bad crc at log index %lld\n", __func__, index);
+		fprintf(stderr, "%s: bad crc at log seqnum %lld\n", __func__, seqnum);
 		errors++;
 	}
 	return errors;
 }
 
+/********************************************************************************
+ *
+ * Log snapshots
+ *
+ * famfs_log_compact() (master only) writes everything that has been logged into a
+ * snapshot in the slot that is not current, and then publishes it by switching
+ * famfs_log_snap_slot and famfs_log_snap_seqnum and resetting famfs_log_next_index
+ * to 0, all in the published cache line of the log header. Sequence numbers keep
+ * counting up across compactions, so the first entry in the log (at position 0) has
+ * seqnum famfs_log_snap_seqnum.
+ *
+ * Readers that need anything older than famfs_log_snap_seqnum load the snapshot and
+ * then play the log from index 0. A snapshot is only used if its magic, seqnum and
+ * crc check out, so a reader that races with a compaction fails cleanly and retries.
+ */
+
+static inline struct famfs_snap *
+famfs_log_snap_slot(const struct famfs_log *logp, u64 slot)
+{
+	return (struct famfs_snap *)((u8 *)logp + logp->famfs_log_snap_offset
+				     + slot * logp->famfs_log_snap_len);
+}
+
+static unsigned long
+famfs_gen_snap_crc(const struct famfs_snap *snap, enum famfs_csum_alg alg)
+{
+	u32 crc = 0;
+
+	crc = famfs_csum(alg, crc, snap, offsetof(struct famfs_snap, fs_crc));
+	crc = famfs_csum(alg, crc, snap->fs_records, snap->fs_len);
+	return FAMFS_CSUM_VAL(alg, crc);
+}
+
 /**
- * __famfs_logplay()
+ * famfs_log_get_snapshot()
  *
- * Inner function to play the log for a famfs file system
+ * Get the current snapshot (after famfs_log_acquire_header()). The processor cache is
+ * invalidated for the snapshot before it is validated.
  *
- * @logp        - pointer to a read-only copy or mmap of the log
- * @mpt         - mount point path
- * @dry_run     - process the log but don't create the files & directories
- * @client_mode - for testing; play the log as if this is a client node, even on master
+ * @logp     - the log
+ * @snap_out - receives the snapshot, or NULL if the log has never been compacted
  *
- * Returns value: Number of errors detected (0=complete success)
+ * Returns 0 on success, -1 if the snapshot is not valid
  */
 int
-__famfs_logplay(
-	const struct famfs_log *logp,
-	const char             *mpt,
-	int                     dry_run,
-	int                     client_mode,
-	int                     verbose)
+famfs_log_get_snapshot(
+	const struct famfs_log   *logp,
+	const struct famfs_snap **snap_out)
 {
-	struct famfs_log_stats ls = { 0 };
-	enum famfs_system_role role;
-	struct famfs_superblock *sb;
-	u64 i, j;
-	int rc;
+	const struct famfs_snap *snap;
 
-	sb = famfs_map_superblock_by_path(mpt, 1 /* read-only */);
-	if (!sb)
-		return -1;
+	*snap_out = NULL;
+	if (logp->famfs_log_snap_seqnum == 0 || logp->famfs_log_seg_num)
+		return 0; /* No snapshot, or a log segment (which never has one) */
 
-	if (famfs_check_super(sb)) {
-		fprintf(stderr, "%s: no valid superblock for mpt %s\n", __func__, mpt);
+	if (!logp->famfs_log_snap_offset) {
+		fprintf(stderr, "%s: log has no snapshot region\n", __func__);
 		return -1;
 	}
-
-	role = (client_mode) ? FAMFS_CLIENT : famfs_get_role(sb);
-
-	if (famfs_validate_log_header(logp)) {
-		fprintf(stderr, "%s: invalid log header\n", __func__);
+	snap = famfs_log_snap_slot(logp, logp->famfs_log_snap_slot);
+	invalidate_processor_cache(snap, sizeof(*snap));
+	if (snap->fs_magic != FAMFS_SNAP_MAGIC
+	    || snap->fs_seqnum != logp->famfs_log_snap_seqnum
+	    || snap->fs_len > logp->famfs_log_snap_len - sizeof(*snap)) {
+		fprintf(stderr, "%s: invalid snapshot header (slot %lld)\n", __func__,
+			logp->famfs_log_snap_slot);
 		return -1;
 	}
+	invalidate_processor_cache(snap->fs_records, snap->fs_len);
+	if (!famfs_csum_alg_valid(FAMFS_CSUM_ALG(snap->fs_crc))
+	    || snap->fs_crc != famfs_gen_snap_crc(snap, FAMFS_CSUM_ALG(snap->fs_crc))) {
+		fprintf(stderr, "%s: bad snapshot crc (slot %lld)\n", __func__,
+			logp->famfs_log_snap_slot);
+		return -1;
+	}
+	*snap_out = snap;
+	return 0;
+}
 
-	if (verbose)
-		printf("famfs logplay: log contains %lld entries\n", logp->famfs_log_next_index);
-
-	for (i = 0; i < logp->famfs_log_next_index; i++) {
-		struct famfs_log_entry le = logp->entries[i];
-
-		if (famfs_validate_log_entry(&le, i)) {
-			fprintf(stderr, "%s: invalid log entry at index %lld\n", __func__, i);
-			return -1;
-		}
-		ls.n_entries++;
+/**
+ * famfs_snap_next()
+ *
+ * Iterate over the records in a (validated) snapshot.
+ *
+ * @snap - the snapshot
+ * @rec  - the previous record, or NULL to get the first one
+ *
+ * Returns the next record, or NULL at the end
+ */
+static const struct famfs_snap_rec *
+famfs_snap_next(
+	const struct famfs_snap     *snap,
+	const struct famfs_snap_rec *rec)
+{
+	const u8 *end = snap->fs_records + snap->fs_len;
+	const u8 *p;
+
+	if (rec)
+		p = (const u8 *)rec + famfs_snap_rec_size(rec->sr_nextents, rec->sr_namelen);
+	else
+		p = snap->fs_records;
+
+	if (p + sizeof(*rec) > end)
+		return NULL;
+	rec = (const struct famfs_snap_rec *)p;
+	if (p + famfs_snap_rec_size(rec->sr_nextents, rec->sr_namelen) > end)
+		return NULL;
+	return rec;
+}
+
+/**
+ * famfs_snap_rec_to_log_entry()
+ *
+ * Expand a snapshot record into the log entry it was made from (less the seqnum and
+ * crc), so snapshot records can be applied and scanned by the log entry code.
+ */
+static void
+famfs_snap_rec_to_log_entry(
+	const struct famfs_snap_rec *rec,
+	struct famfs_log_entry      *le)
+{
+	const char *name = (const char *)&rec->sr_ext[rec->sr_nextents];
+	u32 i;
+
+	memset(le, 0, sizeof(*le));
+	le->famfs_log_entry_type = rec->sr_type;
+
+	switch (rec->sr_type) {
+	case FAMFS_LOG_FILE:
+	case FAMFS_LOG_UNLINK: {
+		struct famfs_file_creation *fc = &le->famfs_fc;
+
+		fc->famfs_fc_size  = rec->sr_size;
+		fc->famfs_nextents = MIN(rec->sr_nextents, FAMFS_FC_MAX_EXTENTS);
+		fc->famfs_fc_flags = rec->sr_flags;
+		fc->fc_uid  = rec->sr_uid;
+		fc->fc_gid  = rec->sr_gid;
+		fc->fc_mode = rec->sr_mode;
+		strncpy((char *)fc->famfs_relpath, name,
+			MIN(rec->sr_namelen, FAMFS_MAX_PATHLEN - 1));
+		for (i = 0; i < fc->famfs_nextents; i++) {
+			fc->famfs_ext_list[i].famfs_extent_type = FAMFS_EXT_SIMPLE;
+			fc->famfs_ext_list[i].se = rec->sr_ext[i];
+		}
+		break;
+	}
+	case FAMFS_LOG_MKDIR:
+	case FAMFS_LOG_RMDIR: {
+		struct famfs_mkdir *md = &le->famfs_md;
+
+		md->fc_uid  = rec->sr_uid;
+		md->fc_gid  = rec->sr_gid;
+		md->fc_mode = rec->sr_mode;
+		strncpy((char *)md->famfs_relpath, name,
+			MIN(rec->sr_namelen, FAMFS_MAX_PATHLEN - 1));
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/**
+ * famfs_rec_encode()
+ *
+ * Encode a log entry as a packed record: the format of snapshot records, and of the
+ * body of log v2 records. Entries other than files and directories (and their removal)
+ * keep only their type.
+ *
+ * @le   - log entry
+ * @rec  - where to put the record
+ * @room - bytes available at @rec
+ *
+ * Returns the size of the record, or -ENOSPC if it does not fit in @room
+ */
+static ssize_t
+famfs_rec_encode(
+	const struct famfs_log_entry *le,
+	struct famfs_snap_rec        *rec,
+	size_t                        room)
+{
+	const char *name = "";
+	u32 nextents = 0;
+	size_t reclen;
+	u16 namelen;
+	u32 i;
+
+	if (famfs_log_type_is_file(le->famfs_log_entry_type)) {
+		name = (const char *)le->famfs_fc.famfs_relpath;
+		nextents = MIN(le->famfs_fc.famfs_nextents, FAMFS_FC_MAX_EXTENTS);
+	} else if (famfs_log_type_is_dir(le->famfs_log_entry_type)) {
+		name = (const char *)le->famfs_md.famfs_relpath;
+	}
+
+	namelen = strnlen(name, FAMFS_MAX_PATHLEN - 1) + 1;
+	reclen = famfs_snap_rec_size(nextents, namelen);
+	if (reclen > room)
+		return -ENOSPC;
+
+	memset(rec, 0, reclen);
+	rec->sr_type     = le->famfs_log_entry_type;
+	rec->sr_namelen  = namelen;
+	rec->sr_nextents = nextents;
+	if (famfs_log_type_is_file(le->famfs_log_entry_type)) {
+		const struct famfs_file_creation *fc = &le->famfs_fc;
+
+		rec->sr_flags = fc->famfs_fc_flags;
+		rec->sr_uid   = fc->fc_uid;
+		rec->sr_gid   = fc->fc_gid;
+		rec->sr_mode  = fc->fc_mode;
+		rec->sr_size  = fc->famfs_fc_size;
+		for (i = 0; i < nextents; i++)
+			rec->sr_ext[i] = fc->famfs_ext_list[i].se;
+	} else if (famfs_log_type_is_dir(le->famfs_log_entry_type)) {
+		rec->sr_uid  = le->famfs_md.fc_uid;
+		rec->sr_gid  = le->famfs_md.fc_gid;
+		rec->sr_mode = le->famfs_md.fc_mode;
+	}
+	memcpy(&rec->sr_ext[nextents], name, namelen - 1);
+	return reclen;
+}
+
+/**
+ * famfs_snap_append()
+ *
+ * Append the record for a log entry to a snapshot that is being written. Entries
+ * other than files and directories take no space in the snapshot.
+ *
+ * @snap     - snapshot being written
+ * @slot_len - size of the snapshot slot
+ * @le       - log entry
+ *
+ * Returns 0 on success, -ENOSPC if the slot is full
+ */
+static int
+famfs_snap_append(
+	struct famfs_snap            *snap,
+	u64                           slot_len,
+	const struct famfs_log_entry *le)
+{
+	ssize_t reclen;
+
+	if (le->famfs_log_entry_type != FAMFS_LOG_FILE
+	    && le->famfs_log_entry_type != FAMFS_LOG_MKDIR)
+		return 0;
+
+	reclen = famfs_rec_encode(le, (struct famfs_snap_rec *)(snap->fs_records + snap->fs_len),
+				  slot_len - sizeof(*snap) - snap->fs_len);
+	if (reclen < 0)
+		return reclen;
+
+	if (le->famfs_log_entry_type == FAMFS_LOG_FILE)
+		snap->fs_nfiles++;
+	else
+		snap->fs_ndirs++;
+	snap->fs_len += reclen;
+	snap->fs_nrecords++;
+	return 0;
+}
+
+/********************************************************************************
+ *
+ * Log records
+ *
+ * famfs_log_put_entry() and famfs_log_get_entry() write and read the entry at a log
+ * position in whichever format the log is in. A v1 log is an array of fixed-size
+ * struct famfs_log_entry, each sized for the largest entry type (a file with
+ * FAMFS_FC_MAX_EXTENTS extents and a FAMFS_MAX_PATHLEN name). A v2 log holds packed,
+ * length-prefixed records (struct famfs_log_rec) with inline extents sized to the
+ * extent count and variable-length names, each with its own crc; a typical file or
+ * directory takes a quarter of the space or less.
+ */
+
+static u32
+famfs_gen_log_rec_crc(const struct famfs_log_rec *rec, enum famfs_csum_alg alg)
+{
+	return famfs_csum(alg, 0, &rec->lr_seqnum,
+			  rec->lr_len - offsetof(struct famfs_log_rec, lr_seqnum));
+}
+
+/* Sanity check the length of the v2 record at @pos, before anything else is read */
+static inline int
+famfs_log_rec_len_valid(const struct famfs_log_rec *rec, u64 pos, u64 end)
+{
+	return (pos + sizeof(*rec) <= end
+		&& rec->lr_len >= famfs_log_rec_size(0, 0)
+		&& !(rec->lr_len & 7)
+		&& rec->lr_len <= end - pos);
+}
+
+/**
+ * famfs_log_put_entry()
+ *
+ * Write an entry at log position @pos, without publishing it
+ *
+ * @logp     - the log
+ * @pos      - position to write at
+ * @le       - the entry; its seqnum and crc are set (in a v2 log the crc is the
+ *             record crc)
+ * @seqnum   - seqnum of the entry
+ * @next_pos - receives the position after the entry
+ *
+ * Returns 0 on success, -ENOMEM if the entry does not fit in the log
+ */
+static int
+famfs_log_put_entry(
+	struct famfs_log       *logp,
+	u64                     pos,
+	struct famfs_log_entry *le,
+	u64                     seqnum,
+	u64                    *next_pos)
+{
+	u64 end = logp->famfs_log_last_index + 1;
+	struct famfs_log_rec *rec;
+	ssize_t bodylen;
+
+	le->famfs_log_entry_seqnum = seqnum;
+	if (!famfs_log_is_v2(logp)) {
+		if (pos >= end)
+			return -ENOMEM;
+		le->famfs_log_entry_crc = famfs_gen_log_entry_crc(le, famfs_log_csum_alg(logp));
+		memcpy(&logp->entries[pos], le, sizeof(*le));
+		*next_pos = pos + 1;
+		return 0;
+	}
+
+	if (pos + sizeof(*rec) > end)
+		return -ENOMEM;
+	rec = famfs_log_pos_addr(logp, pos);
+	bodylen = famfs_rec_encode(le, (struct famfs_snap_rec *)rec->lr_body,
+				   end - pos - sizeof(*rec));
+	if (bodylen < 0)
+		return -ENOMEM;
+	rec->lr_len    = sizeof(*rec) + bodylen;
+	rec->lr_seqnum = seqnum;
+	rec->lr_crc    = famfs_gen_log_rec_crc(rec, famfs_log_csum_alg(logp));
+	le->famfs_log_entry_crc = rec->lr_crc;
+	*next_pos = pos + rec->lr_len;
+	return 0;
+}
+
+/**
+ * famfs_log_check_entry()
+ *
+ * Validate the entry at log position @pos in place, without copying or expanding it.
+ * The caller is responsible for invalidating the processor cache (see
+ * famfs_log_acquire()).
+ *
+ * @logp     - the log
+ * @pos      - position of the entry
+ * @end      - position after the last entry that may be read
+ * @seqnum   - the seqnum the entry should have
+ * @next_pos - receives the position of the next entry
+ *
+ * Returns 0 on success, -1 if the entry is not valid
+ */
+static int
+famfs_log_check_entry(
+	const struct famfs_log *logp,
+	u64                     pos,
+	u64                     end,
+	u64                     seqnum,
+	u64                    *next_pos)
+{
+	const struct famfs_snap_rec *body;
+	const struct famfs_log_rec *rec;
+
+	if (!famfs_log_is_v2(logp)) {
+		if (pos >= end)
+			return -1;
+		*next_pos = pos + 1;
+		return (famfs_validate_log_entry(&logp->entries[pos], seqnum)) ? -1 : 0;
+	}
+
+	rec = famfs_log_pos_addr(logp, pos);
+	if (!famfs_log_rec_len_valid(rec, pos, end)) {
+		fprintf(stderr, "%s: bad record length at position %lld\n", __func__, pos);
+		return -1;
+	}
+	if (mock_failure != MOCK_FAIL_GENERIC) {
+		if (rec->lr_seqnum != seqnum) {
+			fprintf(stderr, "%s: bad seqnum; expect %lld found %lld\n",
+				__func__, seqnum, rec->lr_seqnum);
+			return -1;
+		}
+		if (rec->lr_crc != famfs_gen_log_rec_crc(rec, famfs_log_csum_alg(logp))) {
+			fprintf(stderr, "%s: bad crc at log seqnum %lld\n", __func__, seqnum);
+			return -1;
+		}
+	}
+	body = (const struct famfs_snap_rec *)rec->lr_body;
+	if (body->sr_nextents > FAMFS_FC_MAX_EXTENTS
+	    || famfs_log_rec_size(body->sr_nextents, body->sr_namelen) > rec->lr_len) {
+		fprintf(stderr, "%s: malformed record at position %lld\n", __func__, pos);
+		return -1;
+	}
+	*next_pos = pos + rec->lr_len;
+	return 0;
+}
+
+/* Expand the (already validated) v2 record at @pos into a struct famfs_log_entry */
+static void
+famfs_log_rec_to_log_entry(
+	const struct famfs_log *logp,
+	u64                     pos,
+	struct famfs_log_entry *le)
+{
+	const struct famfs_log_rec *rec = famfs_log_pos_addr(logp, pos);
+
+	famfs_snap_rec_to_log_entry((const struct famfs_snap_rec *)rec->lr_body, le);
+	le->famfs_log_entry_seqnum = rec->lr_seqnum;
+	le->famfs_log_entry_crc    = rec->lr_crc;
+}
+
+/**
+ * famfs_log_get_entry()
+ *
+ * Read and validate the entry at log position @pos. A v2 record is expanded into a
+ * struct famfs_log_entry whose crc is the record crc. The caller is responsible for
+ * invalidating the processor cache (see famfs_log_acquire()).
+ *
+ * @logp     - the log
+ * @pos      - position of the entry
+ * @end      - position after the last entry that may be read
+ * @seqnum   - the seqnum the entry should have
+ * @le       - receives the entry
+ * @next_pos - receives the position of the next entry
+ *
+ * Returns 0 on success, -1 if the entry is not valid
+ */
+static int
+famfs_log_get_entry(
+	const struct famfs_log *logp,
+	u64                     pos,
+	u64                     end,
+	u64                     seqnum,
+	struct famfs_log_entry *le,
+	u64                    *next_pos)
+{
+	if (famfs_log_check_entry(logp, pos, end, seqnum, next_pos))
+		return -1;
+	if (famfs_log_is_v2(logp))
+		famfs_log_rec_to_log_entry(logp, pos, le);
+	else
+		*le = logp->entries[pos];
+	return 0;
+}
+
+/**
+ * famfs_log_seqnum_pos()
+ *
+ * Find the position of the entry with seqnum @seqnum, which may be the seqnum after
+ * the last published entry. This is arithmetic in a v1 log; in a v2 log the record
+ * headers are walked from the start of the log.
+ *
+ * @logp        - the log or segment
+ * @snap_seqnum - seqnum of its first entry, and @end - its famfs_log_next_index
+ *                (from famfs_log_read_header())
+ * @seqnum      - the seqnum
+ * @pos_out     - receives the position
+ *
+ * Returns 0 on success, -1 if @seqnum is not in the log
+ */
+static int
+famfs_log_seqnum_pos(
+	const struct famfs_log *logp,
+	u64                     snap_seqnum,
+	u64                     end,
+	u64                     seqnum,
+	u64                    *pos_out)
+{
+	u64 s = snap_seqnum;
+	u64 pos = 0;
+
+	if (seqnum < s)
+		return -1;
+	if (!famfs_log_is_v2(logp)) {
+		if (seqnum - s > end)
+			return -1;
+		*pos_out = seqnum - s;
+		return 0;
+	}
+
+	for (; s < seqnum; s++) {
+		const struct famfs_log_rec *rec = famfs_log_pos_addr(logp, pos);
+
+		if (pos + sizeof(*rec) > end)
+			return -1;
+		invalidate_processor_cache(rec, sizeof(*rec));
+		if (!famfs_log_rec_len_valid(rec, pos, end) || rec->lr_seqnum != s)
+			return -1;
+		pos += rec->lr_len;
+	}
+	*pos_out = pos;
+	return 0;
+}
+
+/********************************************************************************
+ *
+ * Log segments (see struct famfs_log)
+ *
+ * Segments are mapped on demand. Whoever maps a log attaches it (famfs_log_attach()),
+ * which says how its segments can be mapped: as the files .meta/.log.<n> of a mounted
+ * file system (which are created with the segment's extent if they do not exist
+ * yet, the way logplay creates other files), or straight from the dax device. A log
+ * that was not attached has no segments as far as the cursor is concerned.
+ */
+
+struct famfs_log_chain {
+	struct famfs_log       *logs[FAMFS_LOG_MAX_SEGS + 1]; /* [0]: the log; [n]: segment n */
+	char                    path[PATH_MAX]; /* Mount point, or dax device if @raw */
+	int                     raw;
+	int                     writable;
+	int                     refcount;
+	struct famfs_log_chain *next;
+};
+
+static struct famfs_log_chain *famfs_log_chains;
+static pthread_mutex_t famfs_log_chains_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Find the chain of @logp (a log or one of its segments); call with the lock held */
+static struct famfs_log_chain *
+famfs_log_chain_find(const struct famfs_log *logp, u32 *seg_num_out)
+{
+	struct famfs_log_chain *chain;
+	u32 n;
+
+	for (chain = famfs_log_chains; chain; chain = chain->next) {
+		for (n = 0; n <= FAMFS_LOG_MAX_SEGS; n++) {
+			if (chain->logs[n] == logp) {
+				if (seg_num_out)
+					*seg_num_out = n;
+				return chain;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * famfs_log_attach()
+ *
+ * Tell the log code how to map the segments of a log that the caller has mapped (or
+ * read). Attaching a log that is already attached just takes another reference; the
+ * first attach decides how segments are mapped.
+ *
+ * @logp     - the log
+ * @path     - mount point, or dax device if @raw
+ * @raw      - map segments from the dax device
+ * @writable - map segments writable (master only)
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+famfs_log_attach(
+	const struct famfs_log *logp,
+	const char             *path,
+	int                     raw,
+	int                     writable)
+{
+	struct famfs_log_chain *chain;
+
+	pthread_mutex_lock(&famfs_log_chains_lock);
+	chain = famfs_log_chain_find(logp, NULL);
+	if (chain) {
+		assert(chain->logs[0] == logp);
+		chain->refcount++;
+		pthread_mutex_unlock(&famfs_log_chains_lock);
+		return 0;
+	}
+	chain = calloc(1, sizeof(*chain));
+	if (!chain) {
+		pthread_mutex_unlock(&famfs_log_chains_lock);
+		return -1;
+	}
+	chain->logs[0]  = (struct famfs_log *)logp;
+	chain->raw      = raw;
+	chain->writable = writable;
+	chain->refcount = 1;
+	strncpy(chain->path, path, PATH_MAX - 1);
+	chain->next = famfs_log_chains;
+	famfs_log_chains = chain;
+	pthread_mutex_unlock(&famfs_log_chains_lock);
+	return 0;
+}
+
+/**
+ * famfs_log_detach()
+ *
+ * Drop a reference taken by famfs_log_attach(); the last one unmaps the segments
+ */
+void
+famfs_log_detach(const struct famfs_log *logp)
+{
+	struct famfs_log_chain **prev, *chain;
+	u32 n;
+
+	pthread_mutex_lock(&famfs_log_chains_lock);
+	for (prev = &famfs_log_chains; (chain = *prev); prev = &chain->next) {
+		if (chain->logs[0] == logp)
+			break;
+	}
+	if (!chain || --chain->refcount) {
+		pthread_mutex_unlock(&famfs_log_chains_lock);
+		return;
+	}
+	*prev = chain->next;
+	pthread_mutex_unlock(&famfs_log_chains_lock);
+
+	for (n = 1; n <= FAMFS_LOG_MAX_SEGS; n++) {
+		if (chain->logs[n])
+			munmap(chain->logs[n], chain->logs[n]->famfs_log_len);
+	}
+	free(chain);
+}
+
+/* Create the meta file of a segment (or bitmap checkpoint), with its extent */
+static int
+famfs_log_seg_file_create(
+	const char *path,
+	u64         offset,
+	u64         len,
+	int         writable)
+{
+	struct famfs_simple_extent ext;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, (writable) ? 0644 : 0444);
+	if (fd < 0) {
+		fprintf(stderr, "%s: failed to create file %s\n", __func__, path);
+		return -1;
+	}
+	ext.famfs_extent_offset = offset;
+	ext.famfs_extent_len    = len;
+	if ((mock_kmod && ftruncate(fd, len))
+	    || (!mock_kmod && famfs_file_map_create(path, fd, len, 1, &ext, FAMFS_LOG))) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * famfs_log_chain_mmap()
+ *
+ * Map the extent at @offset on the device the way @chain maps its segments: from the
+ * dax device, or through the meta file @relpath (created if it does not exist yet)
+ *
+ * Returns the address, or NULL
+ */
+static void *
+famfs_log_chain_mmap(
+	const struct famfs_log_chain *chain,
+	const char                   *relpath,
+	u64                           offset,
+	u64                           len)
+{
+	int prot = (chain->writable) ? PROT_READ | PROT_WRITE : PROT_READ;
+	char path[PATH_MAX + 32]; /* mount point + relpath */
+	struct stat st;
+	void *addr;
+	int fd;
+
+	if (chain->raw) {
+		fd = open(chain->path, (chain->writable) ? O_RDWR : O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "%s: failed to open %s\n", __func__, chain->path);
+			return NULL;
+		}
+		addr = mmap(0, len, prot, MAP_SHARED, fd, offset);
+	} else {
+		snprintf(path, sizeof(path), "%s/%s", chain->path, relpath);
+		fd = open(path, (chain->writable) ? O_RDWR : O_RDONLY);
+		if (fd < 0 && errno == ENOENT)
+			fd = famfs_log_seg_file_create(path, offset, len, chain->writable);
+		if (fd < 0) {
+			fprintf(stderr, "%s: failed to open %s\n", __func__, path);
+			return NULL;
+		}
+		if (fstat(fd, &st) || st.st_size < 0 || (u64)st.st_size != len) {
+			fprintf(stderr, "%s: %s is not %lld bytes\n", __func__, path, len);
+			close(fd);
+			return NULL;
+		}
+		addr = mmap(0, len, prot, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: failed to mmap %s\n", __func__, relpath);
+		return NULL;
+	}
+	return addr;
+}
+
+/**
+ * famfs_log_seg_map()
+ *
+ * Map segment @seg_num of @chain, which is at @offset on the device. Call with the
+ * lock held.
+ */
+static struct famfs_log *
+famfs_log_seg_map(
+	const struct famfs_log_chain *chain,
+	u32                           seg_num,
+	u64                           offset,
+	u64                           len)
+{
+	char relpath[32];
+
+	snprintf(relpath, sizeof(relpath), "%s.%d", LOG_FILE_RELPATH, seg_num);
+	return famfs_log_chain_mmap(chain, relpath, offset, len);
+}
+
+/**
+ * famfs_bmap_ckpt_map()
+ *
+ * Map the allocation bitmap checkpoint that @logp links to. It is mapped writable
+ * only if the log was attached writable.
+ *
+ * @logp    - the log (not a segment)
+ * @len_out - receives the size of the mapping (munmap() it when done)
+ *
+ * Returns the checkpoint, or NULL if there is none or it cannot be mapped
+ */
+static struct famfs_bmap_ckpt *
+famfs_bmap_ckpt_map(const struct famfs_log *logp, u64 *len_out)
+{
+	struct famfs_log_chain *chain;
+	struct famfs_bmap_ckpt *ck = NULL;
+	u64 offset, len;
+
+	invalidate_processor_cache(&logp->famfs_log_bmap_offset,
+				   2 * sizeof(logp->famfs_log_bmap_offset));
+	offset = logp->famfs_log_bmap_offset;
+	len = logp->famfs_log_bmap_len;
+	if (!offset || len < sizeof(*ck))
+		return NULL;
+
+	pthread_mutex_lock(&famfs_log_chains_lock);
+	chain = famfs_log_chain_find(logp, NULL);
+	if (chain)
+		ck = famfs_log_chain_mmap(chain, BMAP_FILE_RELPATH, offset, len);
+	pthread_mutex_unlock(&famfs_log_chains_lock);
+	if (ck) {
+		invalidate_processor_cache(ck, len);
+		*len_out = len;
+	}
+	return ck;
+}
+
+/* Check that a newly mapped segment is segment @seg_num of @log0, and @len long */
+static int
+famfs_log_seg_check(
+	const struct famfs_log *seg,
+	const struct famfs_log *log0,
+	u32                     seg_num,
+	u64                     len)
+{
+	invalidate_processor_cache(seg, sizeof(*seg));
+	if (famfs_validate_log_header(seg))
+		return -1;
+	if (seg->famfs_log_magic != log0->famfs_log_magic || seg->famfs_log_seg_num != seg_num
+	    || seg->famfs_log_len != len || seg->famfs_log_snap_offset != len) {
+		fprintf(stderr, "%s: log segment %d does not belong to this log\n",
+			__func__, seg_num);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * famfs_log_linked_seg()
+ *
+ * Get the segment that @logp links to, mapping it the first time. The link never
+ * changes once it is set, so neither does the mapping.
+ *
+ * Returns the segment, or NULL if there is no link or the segment cannot be mapped
+ */
+static struct famfs_log *
+famfs_log_linked_seg(const struct famfs_log *logp)
+{
+	struct famfs_log_chain *chain;
+	struct famfs_log *seg = NULL;
+	u64 offset, len;
+	u32 n;
+
+	invalidate_processor_cache(&logp->famfs_log_next_seg_offset,
+				   2 * sizeof(logp->famfs_log_next_seg_offset));
+	offset = logp->famfs_log_next_seg_offset;
+	len = logp->famfs_log_next_seg_len;
+	if (!offset)
+		return NULL;
+
+	pthread_mutex_lock(&famfs_log_chains_lock);
+	chain = famfs_log_chain_find(logp, &n);
+	if (!chain) {
+		fprintf(stderr, "%s: log continues in a segment at %lld, but its segments "
+			"cannot be mapped\n", __func__, offset);
+		goto out;
+	}
+	if (n + 1 > FAMFS_LOG_MAX_SEGS) {
+		fprintf(stderr, "%s: log segment %d links to a segment\n", __func__, n);
+		goto out;
+	}
+	seg = chain->logs[n + 1];
+	if (!seg) {
+		seg = famfs_log_seg_map(chain, n + 1, offset, len);
+		if (seg && famfs_log_seg_check(seg, chain->logs[0], n + 1, len)) {
+			munmap(seg, len);
+			seg = NULL;
+		}
+		chain->logs[n + 1] = seg;
+	}
+out:
+	pthread_mutex_unlock(&famfs_log_chains_lock);
+	return seg;
+}
+
+/**
+ * famfs_log_next_seg()
+ *
+ * Get the segment that continues @logp, if any
+ *
+ * @logp        - log or segment
+ * @next_seqnum - famfs_log_next_seqnum of @logp
+ *
+ * Returns the segment, or NULL if @logp has not continued into a segment (yet)
+ */
+static struct famfs_log *
+famfs_log_next_seg(
+	const struct famfs_log *logp,
+	u64                     next_seqnum)
+{
+	struct famfs_log *seg = famfs_log_linked_seg(logp);
+	struct famfs_log_view v;
+
+	if (!seg)
+		return NULL;
+	famfs_log_read_header(seg, &v);
+	return (v.snap_seqnum == next_seqnum) ? seg : NULL;
+}
+
+/**
+ * famfs_log_seek()
+ *
+ * Find the entry with seqnum @seqnum, which may be the seqnum after the last published
+ * entry, in a log or the segments that continue it.
+ *
+ * @logp    - the log (after famfs_log_acquire_header())
+ * @seqnum  - the seqnum
+ * @log_out - receives the log or segment that holds the entry
+ * @pos_out - receives the position in *@log_out
+ * @v_out   - receives the header of *@log_out
+ *
+ * Returns 0 on success, -1 if @seqnum is not in the log
+ */
+static int
+famfs_log_seek(
+	const struct famfs_log  *logp,
+	u64                      seqnum,
+	const struct famfs_log **log_out,
+	u64                     *pos_out,
+	struct famfs_log_view   *v_out)
+{
+	const struct famfs_log *seg;
+
+	famfs_log_read_header(logp, v_out);
+	while (seqnum >= v_out->next_seqnum
+	       && (seg = famfs_log_next_seg(logp, v_out->next_seqnum))) {
+		logp = seg;
+		famfs_log_read_header(logp, v_out);
+	}
+	if (famfs_log_seqnum_pos(logp, v_out->snap_seqnum, v_out->next_index, seqnum,
+				   pos_out))
+		return -1;
+	*log_out = logp;
+	return 0;
+}
+
+/********************************************************************************
+ *
+ * Parallel log validation
+ *
+ * Checking the crc and seqnum of every entry of a large log on one core is slow, and
+ * it is independent per entry. famfs_log_validate() splits the range into one chunk
+ * per thread and validates the chunks concurrently; the result is the position of the
+ * first invalid entry. A v1 log is split arithmetically. A v2 log is split by walking
+ * the record headers (the length and seqnum of each record) first, which touches much
+ * less memory than checking the crcs.
+ */
+
+#define FAMFS_LOG_VALIDATE_MT_MIN      (16ULL << 20) /* Auto: thread logs this big */
+#define FAMFS_LOG_VALIDATE_MAX_THREADS 16
+
+struct famfs_log_validate_chunk {
+	pthread_t               thread;
+	const struct famfs_log *logp;
+	u64                     pos;     /* First entry of the chunk */
+	u64                     seqnum;  /* Its seqnum */
+	u64                     end;     /* Position after the chunk */
+	u64                     bad_pos; /* Output: first invalid entry, or @end */
+};
+
+static void *
+famfs_log_validate_worker(void *arg)
+{
+	struct famfs_log_validate_chunk *c = arg;
+	u64 seqnum = c->seqnum;
+	u64 pos = c->pos;
+	u64 next_pos;
+
+	while (pos < c->end) {
+		if (famfs_log_check_entry(c->logp, pos, c->end, seqnum, &next_pos))
+			break;
+		pos = next_pos;
+		seqnum++;
+	}
+	c->bad_pos = pos;
+	return NULL;
+}
+
+/* Number of validation threads to use for @nbytes of log, if the caller did not say */
+static u32
+famfs_log_validate_nthreads(u64 nbytes)
+{
+	long ncpus;
+
+	if (nbytes < FAMFS_LOG_VALIDATE_MT_MIN)
+		return 1;
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (ncpus > 1) ? MIN((u32)ncpus, FAMFS_LOG_VALIDATE_MAX_THREADS) : 1;
+}
+
+/**
+ * famfs_log_validate()
+ *
+ * Validate the entries at log positions [@pos, @end) on @nthreads threads. The caller
+ * is responsible for invalidating the processor cache (see famfs_log_acquire()).
+ *
+ * @logp        - the log
+ * @pos         - position of the first entry
+ * @seqnum      - seqnum of the first entry
+ * @end         - position after the last entry
+ * @nthreads    - number of threads (0: pick based on the size of the range)
+ * @bad_pos_out - receives the position of the first invalid entry, or @end
+ *
+ * Returns 0 if every entry is valid, 1 if an invalid entry was found, -1 on error
+ */
+int
+famfs_log_validate(
+	const struct famfs_log *logp,
+	u64                     pos,
+	u64                     seqnum,
+	u64                     end,
+	u32                     nthreads,
+	u64                    *bad_pos_out)
+{
+	struct famfs_log_validate_chunk *chunks;
+	u64 chunk_bytes, walk_end = end;
+	u32 nchunks = 0;
+	u32 i;
+
+	*bad_pos_out = pos;
+	if (pos >= end) {
+		*bad_pos_out = end;
+		return 0;
+	}
+	if (!nthreads)
+		nthreads = famfs_log_validate_nthreads(famfs_log_pos_bytes(logp, pos, end));
+	chunks = calloc(nthreads, sizeof(*chunks));
+	if (!chunks)
+		return -1;
+
+	if (!famfs_log_is_v2(logp)) {
+		u64 n = end - pos;
+
+		nthreads = MIN(nthreads, n);
+		for (i = 0; i < nthreads; i++) {
+			chunks[i].pos    = pos + (n * i) / nthreads;
+			chunks[i].end    = pos + (n * (i + 1)) / nthreads;
+			chunks[i].seqnum = seqnum + (chunks[i].pos - pos);
+		}
+		nchunks = nthreads;
+	} else {
+		/* Find record boundaries near the chunk boundaries */
+		chunk_bytes = (end - pos + nthreads - 1) / nthreads;
+		chunks[0].pos = pos;
+		chunks[0].seqnum = seqnum;
+		nchunks = 1;
+		while (pos < end) {
+			const struct famfs_log_rec *rec = famfs_log_pos_addr(logp, pos);
+
+			if (!famfs_log_rec_len_valid(rec, pos, end) || rec->lr_seqnum != seqnum) {
+				walk_end = pos; /* A chunk will stop at or before this */
+				break;
+			}
+			pos += rec->lr_len;
+			seqnum++;
+			if (pos < end && nchunks < nthreads
+			    && pos - chunks[0].pos >= nchunks * chunk_bytes) {
+				chunks[nchunks - 1].end = pos;
+				chunks[nchunks].pos = pos;
+				chunks[nchunks].seqnum = seqnum;
+				nchunks++;
+			}
+		}
+		chunks[nchunks - 1].end = (walk_end < end) ? walk_end : end;
+		if (walk_end < end && chunks[nchunks - 1].pos == walk_end)
+			chunks[nchunks - 1].end = walk_end + 1; /* Let it report the bad header */
+	}
+
+	for (i = 0; i < nchunks; i++) {
+		chunks[i].logp = logp;
+		if (i == 0 || pthread_create(&chunks[i].thread, NULL,
+					     famfs_log_validate_worker, &chunks[i])) {
+			chunks[i].thread = 0;
+			if (i)
+				fprintf(stderr, "%s: pthread_create failed; validating chunk %d "
+					"inline\n", __func__, i);
+		}
+	}
+	famfs_log_validate_worker(&chunks[0]);
+	for (i = 1; i < nchunks; i++) {
+		if (chunks[i].thread)
+			pthread_join(chunks[i].thread, NULL);
+		else
+			famfs_log_validate_worker(&chunks[i]);
+	}
+
+	/* The result is the first chunk that stopped short */
+	*bad_pos_out = end;
+	for (i = 0; i < nchunks; i++) {
+		if (chunks[i].bad_pos < chunks[i].end) {
+			*bad_pos_out = chunks[i].bad_pos;
+			break;
+		}
+	}
+	if (i == nchunks && walk_end < end)
+		*bad_pos_out = walk_end;
+	free(chunks);
+	return (*bad_pos_out < end) ? 1 : 0;
+}
+
+/********************************************************************************
+ *
+ * Log cursor
+ *
+ * The one scan path over the published entries of a log, shared by logplay,
+ * famfs_build_bitmap() (and therefore fsck and allocation), compaction and
+ * famfs_log_scan(). Entries are validated (seqnum and crc) before they are yielded.
+ * v1 entries are yielded in place in the log; v2 records are expanded into the
+ * cursor. The entries ahead of the cursor are prefetched.
+ */
+
+#define FAMFS_LOG_PREFETCH_BYTES 1024 /* How far ahead of the cursor to prefetch */
+
+static inline void
+famfs_log_cursor_prefetch(struct famfs_log_cursor *cur)
+{
+	u64 last = famfs_log_pos_bytes(cur->logp, 0, cur->end);
+	u64 ofs = famfs_log_pos_bytes(cur->logp, 0, cur->pos);
+	const char *base = (const char *)famfs_log_pos_addr(cur->logp, 0);
+	u64 stop = MIN(ofs + FAMFS_LOG_PREFETCH_BYTES, last);
+
+	/* Only the lines that the previous call did not already cover */
+	for (ofs = MAX(ofs, cur->prefetched); ofs < stop; ofs += CL_SIZE)
+		__builtin_prefetch(base + ofs, 0 /* read */, 0 /* streaming */);
+	cur->prefetched = MAX(cur->prefetched, stop);
+}
+
+/**
+ * famfs_log_cursor_at()
+ *
+ * Start a cursor at a known position, without validating the header or acquiring
+ * the log. For callers that already track positions (e.g. logplay --follow).
+ *
+ * @cur    - the cursor
+ * @logp   - the log
+ * @pos    - position of the first entry
+ * @seqnum - seqnum of the first entry
+ * @end    - position after the last entry to yield (from famfs_log_acquire())
+ */
+static void
+famfs_log_cursor_at(
+	struct famfs_log_cursor *cur,
+	const struct famfs_log  *logp,
+	u64                      pos,
+	u64                      seqnum,
+	u64                      end)
+{
+	memset(cur, 0, sizeof(*cur));
+	cur->logp   = logp;
+	cur->pos    = pos;
+	cur->seqnum = seqnum;
+	cur->end    = end;
+	cur->snap_seqnum = logp->famfs_log_snap_seqnum;
+	famfs_log_cursor_prefetch(cur);
+}
+
+/**
+ * famfs_log_cursor_init_mt()
+ *
+ * Validate the log header and start a cursor at @start_seqnum, which must not
+ * precede the snapshot (the caller handles the snapshot). The cursor yields the
+ * entries that were published when it was started, and then those in the segments
+ * that continue the log (see famfs_log_cursor_next_seg()).
+ *
+ * Unless @nthreads is 1, the entries are validated up front by famfs_log_validate();
+ * the cursor then only re-checks the entry at the first invalid position (if any),
+ * where it stops as usual. An invalid entry is re-read up to FAMFS_LOG_READ_RETRIES
+ * times before the cursor stops (see famfs_log_cursor_retry()).
+ *
+ * @cur          - the cursor
+ * @logp         - the log
+ * @start_seqnum - seqnum of the first entry to yield
+ * @nthreads     - validation threads (0: pick based on the size of the log, 1: none)
+ *
+ * Returns 0 on success, -1 if the header is invalid or @start_seqnum is not in the log
+ */
+int
+famfs_log_cursor_init_mt(
+	struct famfs_log_cursor *cur,
+	const struct famfs_log  *logp,
+	u64                      start_seqnum,
+	u32                      nthreads)
+{
+	struct famfs_log_view v;
+	u64 pos, end;
+
+	memset(cur, 0, sizeof(*cur));
+	if (famfs_validate_log_header(logp))
+		return -1;
+	if (famfs_log_seek(logp, start_seqnum, &logp, &pos, &v)) {
+		fprintf(stderr, "%s: start seqnum %lld is not in the log (%lld..%lld)\n",
+			__func__, start_seqnum, v.snap_seqnum, v.next_seqnum);
+		return -1;
+	}
+	end = v.next_index;
+	famfs_log_invalidate_entries(logp, pos, end);
+	famfs_log_cursor_at(cur, logp, pos, start_seqnum, end);
+	cur->snap_seqnum = v.snap_seqnum;
+	cur->retries = FAMFS_LOG_READ_RETRIES;
+
+	if (!nthreads)
+		nthreads = famfs_log_validate_nthreads(famfs_log_pos_bytes(logp, pos, end));
+	if (nthreads > 1 && famfs_log_validate(logp, pos, start_seqnum, end, nthreads,
+					       &cur->valid_end) < 0)
+		cur->valid_end = 0;
+	return 0;
+}
+
+/* Start a cursor, with parallel validation if the log is big enough */
+int
+famfs_log_cursor_init(
+	struct famfs_log_cursor *cur,
+	const struct famfs_log  *logp,
+	u64                      start_seqnum)
+{
+	return famfs_log_cursor_init_mt(cur, logp, start_seqnum, 0);
+}
+
+/**
+ * famfs_log_cursor_retry()
+ *
+ * The entry at the cursor failed its checks, although it is below the published end
+ * of the log. On a client it may have been read from a stale cache line, or while the
+ * master was still writing it back. Rather than failing the whole logplay, re-read
+ * the header and the entries from the cursor to its end, and check the entry again,
+ * backing off between attempts. The entries already yielded are not re-read.
+ *
+ * Returns 0 if the entry is valid now, -1 if it is still invalid or the log was
+ * compacted (which moves the entries) since the cursor was started
+ */
+static int
+famfs_log_cursor_retry(
+	struct famfs_log_cursor *cur,
+	u64                     *next_pos)
+{
+	const struct famfs_log *logp = cur->logp;
+	struct famfs_log_view v;
+	u32 delay_us = 1;
+	u32 i;
+
+	for (i = 0; i < cur->retries; i++) {
+		usleep(delay_us);
+		delay_us = MIN(delay_us * 4, FAMFS_LOG_RETRY_MAX_US);
+
+		famfs_log_read_header(logp, &v);
+		if (v.snap_seqnum != cur->snap_seqnum)
+			return -1;
+		famfs_log_invalidate_entries(logp, cur->pos, cur->end);
+		if (!famfs_log_check_entry(logp, cur->pos, cur->end, cur->seqnum, next_pos)) {
+			fprintf(stderr, "%s: log entry at seqnum %lld was valid on retry %d\n",
+				__func__, cur->seqnum, i + 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * famfs_log_cursor_next_seg()
+ *
+ * The cursor is at the end of its log (or segment). If that was closed at this point
+ * and continues in a segment, move the cursor to the start of the segment; it will
+ * yield the entries that are published in the segment now.
+ *
+ * Returns 0 if the cursor moved
+ */
+static int
+famfs_log_cursor_next_seg(struct famfs_log_cursor *cur)
+{
+	struct famfs_log_view v;
+	struct famfs_log *seg;
+	u32 nthreads;
+
+	famfs_log_read_header(cur->logp, &v);
+	if (v.next_seqnum != cur->seqnum || v.next_index != cur->pos)
+		return -1; /* Entries were published since the cursor started */
+	seg = famfs_log_next_seg(cur->logp, cur->seqnum);
+	if (!seg)
+		return -1;
+
+	famfs_log_read_header(seg, &v);
+	if (v.snap_seqnum != cur->seqnum)
+		return -1;
+	famfs_log_invalidate_entries(seg, 0, v.next_index);
+	cur->logp = seg;
+	cur->pos = 0;
+	cur->end = v.next_index;
+	cur->snap_seqnum = v.snap_seqnum;
+	cur->prefetched = 0;
+	cur->valid_end = 0;
+	famfs_log_cursor_prefetch(cur);
+
+	nthreads = famfs_log_validate_nthreads(famfs_log_pos_bytes(seg, 0, cur->end));
+	if (nthreads > 1 && famfs_log_validate(seg, 0, cur->seqnum, cur->end, nthreads,
+					       &cur->valid_end) < 0)
+		cur->valid_end = 0;
+	return 0;
+}
+
+/**
+ * famfs_log_cursor_next()
+ *
+ * Returns the next validated entry (valid until the next call), or NULL at the end.
+ * If the entry at the cursor is invalid, NULL is returned and @cur->invalid is set;
+ * the cursor does not advance past an invalid entry.
+ */
+const struct famfs_log_entry *
+famfs_log_cursor_next(struct famfs_log_cursor *cur)
+{
+	const struct famfs_log_entry *le;
+	const struct famfs_log *logp;
+	u64 next_pos;
+
+	if (cur->invalid)
+		return NULL;
+	if (cur->pos >= cur->end && (famfs_log_cursor_next_seg(cur) || cur->pos >= cur->end))
+		return NULL;
+	logp = cur->logp;
+
+	if (cur->pos >= cur->valid_end) {
+		if (famfs_log_check_entry(logp, cur->pos, cur->end, cur->seqnum, &next_pos)
+		    && famfs_log_cursor_retry(cur, &next_pos))
+			goto invalid;
+	} else if (famfs_log_is_v2(logp)) {
+		next_pos = cur->pos
+			+ ((const struct famfs_log_rec *)famfs_log_pos_addr(logp, cur->pos))->lr_len;
+	} else {
+		next_pos = cur->pos + 1;
+	}
+
+	if (famfs_log_is_v2(logp)) {
+		famfs_log_rec_to_log_entry(logp, cur->pos, &cur->le);
+		le = &cur->le;
+	} else {
+		le = &logp->entries[cur->pos];
+	}
+	cur->pos = next_pos;
+	cur->seqnum++;
+	famfs_log_cursor_prefetch(cur);
+	return le;
+
+invalid:
+	fprintf(stderr, "%s: invalid log entry at seqnum %lld (position %lld)\n",
+		__func__, cur->seqnum, cur->pos);
+	cur->invalid = 1;
+	return NULL;
+}
+
+/**
+ * famfs_log_scan()
+ *
+ * Visit the validated entries of the log, starting at @start_seqnum. If @start_seqnum
+ * precedes the snapshot, the snapshot records are visited first (with seqnum
+ * FAMFS_SCAN_SNAP_SEQNUM) and the scan continues with the first log entry. The scan
+ * stops at the first invalid entry. Nothing is applied; this is for building
+ * in-memory views of the log (e.g. the namespace index).
+ *
+ * @logp            - the log
+ * @start_seqnum    - seqnum of the first entry to visit
+ * @fn              - called for each entry; a nonzero return stops the scan
+ * @arg             - passed to @fn
+ * @next_seqnum_out - receives the seqnum after the last entry that was visited
+ *
+ * Returns 0 if the scan reached the end of the log, -1 if the snapshot or an entry
+ * was invalid, or the nonzero return of @fn
+ */
+int
+famfs_log_scan(
+	const struct famfs_log  *logp,
+	u64                      start_seqnum,
+	famfs_log_scan_fn        fn,
+	void                    *arg,
+	u64                     *next_seqnum_out)
+{
+	const struct famfs_snap_rec *rec = NULL;
+	const struct famfs_log_entry *le;
+	const struct famfs_snap *snap;
+	struct famfs_log_cursor cur;
+	struct famfs_log_entry sle;
+	int rc;
+
+	*next_seqnum_out = start_seqnum;
+	famfs_log_acquire_header(logp);
+	if (start_seqnum < logp->famfs_log_snap_seqnum) {
+		if (famfs_log_get_snapshot(logp, &snap))
+			return -1;
+		while (snap && (rec = famfs_snap_next(snap, rec))) {
+			famfs_snap_rec_to_log_entry(rec, &sle);
+			rc = fn(&sle, FAMFS_SCAN_SNAP_SEQNUM, arg);
+			if (rc)
+				return rc;
+		}
+		start_seqnum = logp->famfs_log_snap_seqnum;
+		*next_seqnum_out = start_seqnum;
+	}
+	if (famfs_log_cursor_init(&cur, logp, start_seqnum))
+		return -1;
+
+	while ((le = famfs_log_cursor_next(&cur))) {
+		rc = fn(le, cur.seqnum - 1, arg);
+		if (rc)
+			return rc;
+		*next_seqnum_out = cur.seqnum;
+	}
+	return (cur.invalid) ? -1 : 0;
+}
+
+/********************************************************************************
+ *
+ * Logplay checkpoints
+ *
+ * Each time logplay completes without errors, it records the seqnum of the next
+ * log entry that it has not yet applied, in a client-local file named by the uuid
+ * of the file system. The next logplay on the same mount only needs to apply the
+ * entries after that point.
+ *
+ * A checkpoint is only honored if the file system uuid, the log header crc, the
+ * identity of the mounted log file (which changes on every mount/mkmeta) and the
+ * crc of the last applied entry all still match. Otherwise we do a full replay.
+ */
+
+static unsigned long
+famfs_gen_logplay_ckpt_crc(const struct famfs_logplay_ckpt *ck, enum famfs_csum_alg alg)
+{
+	u32 crc = famfs_csum(alg, 0, ck, offsetof(struct famfs_logplay_ckpt, lc_crc));
+
+	return FAMFS_CSUM_VAL(alg, crc);
+}
+
+/**
+ * famfs_logplay_ckpt_path()
+ *
+ * @fs_uuid  - uuid of the file system (ts_uuid)
+ * @path_out - receives the path of the checkpoint file (PATH_MAX)
+ */
+void
+famfs_logplay_ckpt_path(const uuid_le *fs_uuid, char *path_out)
+{
+	char uuid_str[37];
+	uuid_t uuid;
+
+	memcpy(&uuid, fs_uuid, sizeof(uuid));
+	uuid_unparse(uuid, uuid_str);
+	snprintf(path_out, PATH_MAX - 1, "%s/%s", FAMFS_LOGPLAY_STATE_DIR, uuid_str);
+}
+
+/**
+ * famfs_logplay_ckpt_init()
+ *
+ * Fill in the identity fields of a checkpoint from the current state of a mounted
+ * file system. The resulting checkpoint is what a saved checkpoint must match.
+ *
+ * @ck   - checkpoint to fill in
+ * @sb   - superblock
+ * @logp - log
+ * @lfd  - open file descriptor of the mounted log file
+ */
+int
+famfs_logplay_ckpt_init(
+	struct famfs_logplay_ckpt     *ck,
+	const struct famfs_superblock *sb,
+	const struct famfs_log        *logp,
+	int                            lfd)
+{
+	struct stat st;
+
+	memset(ck, 0, sizeof(*ck));
+	if (fstat(lfd, &st)) {
+		fprintf(stderr, "%s: fstat failed on log file (errno %d)\n", __func__, errno);
+		return -errno;
+	}
+	ck->lc_magic        = FAMFS_LOGPLAY_CKPT_MAGIC;
+	ck->lc_fs_uuid      = sb->ts_uuid;
+	ck->lc_log_crc      = logp->famfs_log_crc;
+	ck->lc_log_dev      = st.st_dev;
+	ck->lc_log_ino      = st.st_ino;
+	ck->lc_log_ctime_ns = (u64)st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec;
+	return 0;
+}
+
+/**
+ * famfs_logplay_ckpt_start()
+ *
+ * Decide where logplay should start, given a saved checkpoint
+ *
+ * @ckpt_path - path of the saved checkpoint
+ * @cur       - checkpoint identity of the current mount (from famfs_logplay_ckpt_init())
+ * @logp      - the log (header already validated)
+ * @verbose
+ *
+ * Returns the seqnum of the first entry that must be applied; 0 means full replay
+ */
+u64
+famfs_logplay_ckpt_start(
+	const char                      *ckpt_path,
+	const struct famfs_logplay_ckpt *cur,
+	const struct famfs_log          *logp,
+	int                              verbose)
+{
+	struct famfs_logplay_ckpt ck;
+	const struct famfs_log *slog;
+	struct famfs_log_entry le;
+	struct famfs_log_view v;
+	u64 pos, next_pos;
+	ssize_t nread;
+	int fd;
+
+	fd = open(ckpt_path, O_RDONLY);
+	if (fd < 0) {
+		if (verbose)
+			printf("%s: no checkpoint; full replay\n", __func__);
+		return 0;
+	}
+	nread = read(fd, &ck, sizeof(ck));
+	close(fd);
+
+	if (nread != sizeof(ck) || ck.lc_magic != FAMFS_LOGPLAY_CKPT_MAGIC
+	    || !famfs_csum_alg_valid(FAMFS_CSUM_ALG(ck.lc_crc))
+	    || ck.lc_crc != famfs_gen_logplay_ckpt_crc(&ck, FAMFS_CSUM_ALG(ck.lc_crc))) {
+		fprintf(stderr, "%s: invalid checkpoint %s; full replay\n", __func__, ckpt_path);
+		return 0;
+	}
+	if (memcmp(&ck.lc_fs_uuid, &cur->lc_fs_uuid, sizeof(ck.lc_fs_uuid))
+	    || ck.lc_log_crc != cur->lc_log_crc) {
+		if (verbose)
+			printf("%s: file system changed; full replay\n", __func__);
+		return 0;
+	}
+	if (ck.lc_log_dev != cur->lc_log_dev || ck.lc_log_ino != cur->lc_log_ino
+	    || ck.lc_log_ctime_ns != cur->lc_log_ctime_ns) {
+		if (verbose)
+			printf("%s: file system was re-mounted; full replay\n", __func__);
+		return 0;
+	}
+	famfs_log_acquire_header(logp);
+	if (ck.lc_next_seqnum < logp->famfs_log_snap_seqnum) {
+		if (verbose)
+			printf("%s: log was compacted past the checkpoint; full replay\n",
+			       __func__);
+		return 0;
+	}
+	if (ck.lc_next_seqnum == 0 || famfs_log_seek(logp, ck.lc_next_seqnum, &slog, &pos, &v)) {
+		if (verbose)
+			printf("%s: checkpoint seqnum %lld out of range; full replay\n",
+			       __func__, ck.lc_next_seqnum);
+		return 0;
+	}
+
+	/* The last entry we applied must still be the same entry (unless it is now
+	 * in the snapshot)
+	 */
+	if (ck.lc_next_seqnum == logp->famfs_log_snap_seqnum) {
+		if (verbose)
+			printf("%s: resuming logplay at seqnum %lld\n", __func__,
+			       ck.lc_next_seqnum);
+		return ck.lc_next_seqnum;
+	}
+	if (famfs_log_seek(logp, ck.lc_next_seqnum - 1, &slog, &pos, &v)
+	    || famfs_log_get_entry(slog, pos, famfs_log_acquire(slog, pos),
+				   ck.lc_next_seqnum - 1, &le, &next_pos)
+	    || le.famfs_log_entry_crc != ck.lc_last_crc) {
+		fprintf(stderr, "%s: log does not match checkpoint; full replay\n", __func__);
+		return 0;
+	}
+
+	if (verbose)
+		printf("%s: resuming logplay at seqnum %lld\n", __func__, ck.lc_next_seqnum);
+	return ck.lc_next_seqnum;
+}
+
+/**
+ * famfs_logplay_ckpt_save()
+ *
+ * Record that all log entries prior to @next_seqnum have been applied. The checkpoint
+ * file is replaced atomically, so a crash can't leave a torn checkpoint behind.
+ *
+ * @ckpt_path   - path of the checkpoint file
+ * @cur         - checkpoint identity of the current mount (from famfs_logplay_ckpt_init())
+ * @logp        - the log
+ * @next_seqnum - seqnum of the first entry that has not been applied
+ */
+int
+famfs_logplay_ckpt_save(
+	const char                      *ckpt_path,
+	const struct famfs_logplay_ckpt *cur,
+	const struct famfs_log          *logp,
+	u64                              next_seqnum)
+{
+	struct famfs_logplay_ckpt ck = *cur;
+	const struct famfs_log *slog;
+	char tmp_path[PATH_MAX];
+	struct famfs_log_entry le;
+	struct famfs_log_view v;
+	u64 pos, next_pos;
+	ssize_t nwritten;
+	int fd;
+
+	if (next_seqnum == 0)
+		return 0; /* Nothing applied; nothing to record */
+
+	ck.lc_next_seqnum = next_seqnum;
+	if (next_seqnum > logp->famfs_log_snap_seqnum) {
+		if (famfs_log_seek(logp, next_seqnum - 1, &slog, &pos, &v)
+		    || famfs_log_get_entry(slog, pos, v.next_index,
+					   next_seqnum - 1, &le, &next_pos)) {
+			fprintf(stderr, "%s: seqnum %lld is not in the log\n", __func__,
+				next_seqnum - 1);
+			return -1;
+		}
+		ck.lc_last_crc = le.famfs_log_entry_crc;
+	}
+	ck.lc_crc = famfs_gen_logplay_ckpt_crc(&ck, FAMFS_CSUM_DEFAULT);
+
+	/* The state dir lives under SYS_UUID_DIR; create either if needed */
+	mkdir(SYS_UUID_DIR, 0755);
+	if (mkdir(FAMFS_LOGPLAY_STATE_DIR, 0755) && errno != EEXIST) {
+		fprintf(stderr, "%s: unable to create %s (errno %d)\n",
+			__func__, FAMFS_LOGPLAY_STATE_DIR, errno);
+		return -errno;
+	}
+
+	snprintf(tmp_path, PATH_MAX - 1, "%s.tmp", ckpt_path);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: failed to create %s (errno %d)\n",
+			__func__, tmp_path, errno);
+		return -errno;
+	}
+	nwritten = write(fd, &ck, sizeof(ck));
+	close(fd);
+	if (nwritten != sizeof(ck) || rename(tmp_path, ckpt_path)) {
+		fprintf(stderr, "%s: failed to write checkpoint %s\n", __func__, ckpt_path);
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * __famfs_logplay()
+ *
+ * Inner function to play the log for a famfs file system
+ *
+ * @logp        - pointer to a read-only copy or mmap of the log
+ * @mpt         - mount point path
+ * @dry_run     - process the log but don't create the files & directories
+ * @client_mode - for testing; play the log as if this is a client node, even on master
+ *
+ * Returns value: Number of errors detected (0=complete success)
+ */
+int
+__famfs_logplay(
+	const struct famfs_log *logp,
+	const char             *mpt,
+	int                     dry_run,
+	int                     client_mode,
+	int                     verbose)
+{
+	return __famfs_logplay_from(logp, mpt, 0, NULL, dry_run, client_mode, 1, verbose);
+}
+
+/*
+ * Directory fd cache for logplay
+ *
+ * Logplay creates files and directories relative to an open fd for their parent
+ * directory (openat()/mkdirat()/fstatat()), rather than resolving a full path for
+ * every entry. Parent fds are kept in a small LRU cache keyed by the relative path of
+ * the directory, so a run of entries in the same directory costs no path resolution
+ * at all, and a miss only opens the components that are not cached.
+ */
+#define FAMFS_DIRFD_CACHE_SIZE 64
+
+struct famfs_dirfd_cache {
+	const char *mpt;
+	u64         tick;
+	struct {
+		int  fd;
+		u64  last_used;
+		char relpath[FAMFS_MAX_PATHLEN];
+	} ent[FAMFS_DIRFD_CACHE_SIZE];
+};
+
+static void
+famfs_dirfd_cache_init(struct famfs_dirfd_cache *dc, const char *mpt)
+{
+	int i;
+
+	dc->mpt = mpt;
+	dc->tick = 0;
+	for (i = 0; i < FAMFS_DIRFD_CACHE_SIZE; i++)
+		dc->ent[i].fd = -1;
+}
+
+static void
+famfs_dirfd_cache_release(struct famfs_dirfd_cache *dc)
+{
+	int i;
+
+	for (i = 0; i < FAMFS_DIRFD_CACHE_SIZE; i++) {
+		if (dc->ent[i].fd >= 0)
+			close(dc->ent[i].fd);
+		dc->ent[i].fd = -1;
+	}
+}
+
+/**
+ * famfs_dirfd_get()
+ *
+ * Get an fd for a directory, by its path relative to the mount point
+ *
+ * @dc      - the cache
+ * @relpath - relative path; only the first @len bytes are used ("" is the mount point)
+ * @len     - length of the directory path
+ *
+ * Returns an fd that belongs to the cache (don't close it), or -1
+ */
+static int
+famfs_dirfd_get(struct famfs_dirfd_cache *dc, const char *relpath, size_t len)
+{
+	char name[FAMFS_MAX_PATHLEN];
+	const char *slash;
+	int victim = 0;
+	int pfd, fd;
+	int i;
+
+	if (len >= FAMFS_MAX_PATHLEN)
+		return -1;
+
+	for (i = 0; i < FAMFS_DIRFD_CACHE_SIZE; i++) {
+		if (dc->ent[i].fd >= 0 && !strncmp(dc->ent[i].relpath, relpath, len)
+		    && dc->ent[i].relpath[len] == 0) {
+			dc->ent[i].last_used = ++dc->tick;
+			return dc->ent[i].fd;
+		}
+	}
+
+	/* Miss: open it relative to its parent, which is looked up the same way */
+	if (len == 0) {
+		fd = open(dc->mpt, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		slash = memrchr(relpath, '/', len);
+		pfd = famfs_dirfd_get(dc, relpath, (slash) ? slash - relpath : 0);
+		if (pfd < 0)
+			return -1;
+
+		i = (slash) ? slash - relpath + 1 : 0;
+		memcpy(name, relpath + i, len - i);
+		name[len - i] = 0;
+		fd = openat(pfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (fd < 0)
+		return -1;
+
+	/* Insert, replacing an empty or the least recently used slot */
+	for (i = 0; i < FAMFS_DIRFD_CACHE_SIZE; i++) {
+		if (dc->ent[i].fd < 0) {
+			victim = i;
+			break;
+		}
+		if (dc->ent[i].last_used < dc->ent[victim].last_used)
+			victim = i;
+	}
+	if (dc->ent[victim].fd >= 0)
+		close(dc->ent[victim].fd);
+	dc->ent[victim].fd = fd;
+	dc->ent[victim].last_used = ++dc->tick;
+	memcpy(dc->ent[victim].relpath, relpath, len);
+	dc->ent[victim].relpath[len] = 0;
+	return fd;
+}
+
+/* Drop a directory that has been removed (and everything under it) from the cache */
+static void
+famfs_dirfd_cache_invalidate(struct famfs_dirfd_cache *dc, const char *relpath)
+{
+	size_t len = strlen(relpath);
+	int i;
+
+	for (i = 0; i < FAMFS_DIRFD_CACHE_SIZE; i++) {
+		if (dc->ent[i].fd >= 0 && !strncmp(dc->ent[i].relpath, relpath, len)
+		    && (dc->ent[i].relpath[len] == 0 || dc->ent[i].relpath[len] == '/')) {
+			close(dc->ent[i].fd);
+			dc->ent[i].fd = -1;
+		}
+	}
+}
+
+/*
+ * Split a relative path into the length of its directory part and its last component
+ */
+static const char *
+famfs_relpath_split(const char *relpath, size_t *dirlen)
+{
+	const char *slash = strrchr(relpath, '/');
+
+	*dirlen = (slash) ? slash - relpath : 0;
+	return (slash) ? slash + 1 : relpath;
+}
+
+/**
+ * famfs_logplay_entry()
+ *
+ * Apply one (already validated) log entry, or a snapshot record expanded into one.
+ * Errors are counted in @ls.
+ *
+ * @le      - the entry
+ * @index   - log index (for messages)
+ * @dc      - directory fd cache (for the mount point being played into)
+ * @dry_run - process the entry but don't create (or remove) the file or directory
+ * @role    - files are created read-only on clients
+ * @ls      - stats are accumulated here
+ */
+static void
+famfs_logplay_entry(
+	const struct famfs_log_entry *le,
+	u64                           index,
+	struct famfs_dirfd_cache     *dc,
+	int                           dry_run,
+	enum famfs_system_role        role,
+	struct famfs_log_stats       *ls,
+	int                           verbose)
+{
+	u64 j;
+	int rc;
+
+	switch (le->famfs_log_entry_type) {
+	case FAMFS_LOG_FILE: {
+		const struct famfs_file_creation *fc = &le->famfs_fc;
+		struct famfs_simple_extent el[FAMFS_FC_MAX_EXTENTS];
+		const char *relpath = (const char *)fc->famfs_relpath;
+		const char *name;
+		int skip_file = 0;
+		size_t dirlen;
+		mode_t mode;
+		int pfd;
+		int fd;
+
+		ls->f_logged++;
+		if (verbose > 1)
+			printf("%s: %lld file=%s size=%lld\n", __func__, index,
+			       fc->famfs_relpath, fc->famfs_fc_size);
+
+		if (!famfs_log_entry_fc_path_is_relative(fc) || mock_path) {
+			fprintf(stderr,
+				"%s: ignoring log entry; path is not relative\n",
+				__func__);
+			ls->f_errs++;
+			skip_file++;
+		}
+
+		/* The only file that should have an extent with offset 0
+		 * is the superblock, which is not in the log. Check for files with
+		 * null offset...
+		 */
+		for (j = 0; j < fc->famfs_nextents; j++) {
+			const struct famfs_simple_extent *se = &fc->famfs_ext_list[j].se;
+
+			if (se->famfs_extent_offset == 0 || mock_path) {
+				fprintf(stderr,
+					"%s: ERROR file %s has extent with 0 offset\n",
+					__func__, fc->famfs_relpath);
+				ls->f_errs++;
+				skip_file++;
+			}
+		}
+
+		if (skip_file || dry_run)
+			return;
+
+		name = famfs_relpath_split(relpath, &dirlen);
+		pfd = famfs_dirfd_get(dc, relpath, dirlen);
+		if (pfd < 0) {
+			fprintf(stderr, "%s: no parent directory for file %s\n",
+				__func__, relpath);
+			ls->f_errs++;
+			return;
+		}
+
+		mode = fc->fc_mode;
+		if (role == FAMFS_CLIENT)
+			mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+
+		/* O_EXCL: an existing file is not an error on replay, it's just skipped */
+		fd = openat(pfd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+		if (fd < 0 && errno == EEXIST) {
+			if (verbose > 1)
+				fprintf(stderr, "famfs logplay: File %s exists\n", relpath);
+			ls->f_existed++;
+			return;
+		}
+		if (verbose) {
+			printf("famfs logplay: creating file %s", fc->famfs_relpath);
+			if (verbose > 1)
+				printf(" mode %o", fc->fc_mode);
+
+			printf("\n");
+		}
+		if (fd < 0) {
+			fprintf(stderr,
+				"%s: unable to create destfile (%s)\n",
+				__func__, fc->famfs_relpath);
+			ls->f_errs++;
+			return;
+		}
+
+		if (fc->fc_uid && fc->fc_gid && fchown(fd, fc->fc_uid, fc->fc_gid))
+			fprintf(stderr, "%s: fchown returned errno %d\n", __func__, errno);
+
+		/* The log entry has a different kind of extent list */
+		for (j = 0; j < fc->famfs_nextents; j++)
+			el[j] = fc->famfs_ext_list[j].se;
+		famfs_file_map_create(relpath, fd, fc->famfs_fc_size,
+				      fc->famfs_nextents, el, FAMFS_REG);
+		close(fd);
+		ls->f_created++;
+		break;
+	}
+	case FAMFS_LOG_MKDIR: {
+		const struct famfs_mkdir *md = &le->famfs_md;
+		const char *relpath = (const char *)md->famfs_relpath;
+		const char *name;
+		int skip_dir = 0;
+		struct stat st;
+		size_t dirlen;
+		int pfd;
+
+		ls->d_logged++;
+
+		if (!famfs_log_entry_md_path_is_relative(md) || mock_path) {
+			fprintf(stderr,
+				"%s: ignoring log mkdir entry; path is not relative\n",
+				__func__);
+			ls->d_errs++;
+			skip_dir++;
+		}
+
+		if (skip_dir)
+			return;
+
+		if (verbose)
+			printf("%s mkdir: %o %d:%d: %s \n", __func__,
+			       md->fc_mode, md->fc_uid, md->fc_gid, md->famfs_relpath);
+
+		if (dry_run)
+			return;
+
+		name = famfs_relpath_split(relpath, &dirlen);
+		pfd = famfs_dirfd_get(dc, relpath, dirlen);
+		if (pfd < 0) {
+			fprintf(stderr, "%s: no parent directory for directory %s\n",
+				__func__, relpath);
+			ls->d_errs++;
+			return;
+		}
+
+		rc = fstatat(pfd, name, &st, 0);
+		if (!rc) {
+			switch (st.st_mode & S_IFMT) {
+			case S_IFDIR:
+				/* This is normal for log replay */
+				if (verbose > 1) {
+					fprintf(stderr,
+						"famfs logplay: directory %s exists\n",
+						relpath);
+					ls->d_existed++;
+				}
+				break;
+
+			case S_IFREG:
+				fprintf(stderr,
+					"%s: file (%s) exists where dir should be\n",
+					__func__, relpath);
+				ls->d_errs++;
+				break;
+
+			default:
+				fprintf(stderr,
+					"%s: something (%s) exists where dir should be\n",
+					__func__, relpath);
+				ls->d_errs++;
+				break;
+			}
+			return;
+		}
+
+		if (verbose)
+			printf("famfs logplay: creating directory %s\n", md->famfs_relpath);
+
+		rc = mkdirat(pfd, name, md->fc_mode);
+		if (!rc && md->fc_uid && md->fc_gid)
+			rc = fchownat(pfd, name, md->fc_uid, md->fc_gid, 0);
+		if (rc) {
+			fprintf(stderr,
+				"%s: error: unable to create directory (%s) errno %d\n",
+				__func__, md->famfs_relpath, errno);
+			ls->d_errs++;
+			return;
+		}
+
+		ls->d_created++;
+		break;
+	}
+	case FAMFS_LOG_UNLINK: {
+		const struct famfs_file_creation *fc = &le->famfs_fc;
+		const char *relpath = (const char *)fc->famfs_relpath;
+		const char *name;
+		size_t dirlen;
+		int match;
+		int pfd;
+		int fd;
+
+		ls->f_unlinked++;
+		if (!famfs_log_entry_fc_path_is_relative(fc) || mock_path) {
+			fprintf(stderr, "%s: ignoring unlink entry; path is not relative\n",
+				__func__);
+			ls->f_errs++;
+			return;
+		}
+		if (verbose)
+			printf("famfs logplay: removing file %s\n", relpath);
+		if (dry_run)
+			return;
+
+		/* A missing file (or parent) was removed by an earlier play of the log */
+		name = famfs_relpath_split(relpath, &dirlen);
+		pfd = famfs_dirfd_get(dc, relpath, dirlen);
+		if (pfd < 0)
+			return;
+		fd = openat(pfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		/* On a replay, the file at this path may have been created after the unlink */
+		match = famfs_file_map_matches(fd, fc);
+		close(fd);
+		if (!match) {
+			if (verbose > 1)
+				printf("famfs logplay: %s was re-created\n", relpath);
+			return;
+		}
+		if (unlinkat(pfd, name, 0) && errno != ENOENT) {
+			fprintf(stderr, "%s: unable to remove file %s errno %d\n",
+				__func__, relpath, errno);
+			ls->f_errs++;
+			return;
+		}
+		ls->f_removed++;
+		break;
+	}
+	case FAMFS_LOG_RMDIR: {
+		const struct famfs_mkdir *md = &le->famfs_md;
+		const char *relpath = (const char *)md->famfs_relpath;
+		const char *name;
+		size_t dirlen;
+		int pfd;
+
+		ls->d_rmdirs++;
+		if (!famfs_log_entry_md_path_is_relative(md) || mock_path) {
+			fprintf(stderr, "%s: ignoring rmdir entry; path is not relative\n",
+				__func__);
+			ls->d_errs++;
+			return;
+		}
+		if (verbose)
+			printf("famfs logplay: removing directory %s\n", relpath);
+		if (dry_run)
+			return;
+
+		famfs_dirfd_cache_invalidate(dc, relpath);
+		name = famfs_relpath_split(relpath, &dirlen);
+		pfd = famfs_dirfd_get(dc, relpath, dirlen);
+		if (pfd < 0)
+			return;
+		if (unlinkat(pfd, name, AT_REMOVEDIR)) {
+			if (errno == ENOENT)
+				return;
+			fprintf(stderr, "%s: unable to remove directory %s errno %d\n",
+				__func__, relpath, errno);
+			ls->d_errs++;
+			return;
+		}
+		ls->d_removed++;
+		break;
+	}
+	case FAMFS_LOG_ACCESS:
+	default:
+		if (verbose)
+			printf("%s: invalid log entry\n", __func__);
+		break;
+	}
+}
+
+/**
+ * famfs_logplay_entries()
+ *
+ * Apply the entries that a log cursor yields. On return the cursor is positioned
+ * after the last entry that was played (at the invalid entry, if one was found).
+ *
+ * @cur          - cursor over a read-only copy or mmap of the log
+ * @mpt          - mount point path
+ * @dry_run      - process the log but don't create the files & directories
+ * @role         - files are created read-only on clients
+ * @ls           - stats are accumulated here
+ *
+ * Returns: 0 if all entries were valid (apply errors are counted in @ls), -1 if an
+ * invalid entry was found
+ */
+static int
+famfs_logplay_entries(
+	struct famfs_log_cursor *cur,
+	const char              *mpt,
+	int                      dry_run,
+	enum famfs_system_role   role,
+	struct famfs_log_stats  *ls,
+	int                      verbose)
+{
+	const struct famfs_log_entry *le;
+	struct famfs_dirfd_cache dc;
+
+	famfs_dirfd_cache_init(&dc, mpt);
+	while ((le = famfs_log_cursor_next(cur))) {
+		ls->n_entries++;
+		famfs_logplay_entry(le, cur->seqnum - 1, &dc, dry_run, role, ls, verbose);
+	}
+	famfs_dirfd_cache_release(&dc);
+	return (cur->invalid) ? -1 : 0;
+}
+
+/**
+ * famfs_logplay_snapshot()
+ *
+ * Apply every record in the current snapshot (if there is one). As with log entries,
+ * files and directories that already exist are skipped.
+ *
+ * Returns: 0 on success (apply errors are counted in @ls), -1 if the snapshot is
+ * not valid
+ */
+static int
+famfs_logplay_snapshot(
+	const struct famfs_log  *logp,
+	const char              *mpt,
+	int                      dry_run,
+	enum famfs_system_role   role,
+	struct famfs_log_stats  *ls,
+	int                      verbose)
+{
+	const struct famfs_snap_rec *rec = NULL;
+	const struct famfs_snap *snap;
+	struct famfs_dirfd_cache dc;
+	struct famfs_log_entry le;
+
+	if (famfs_log_get_snapshot(logp, &snap))
+		return -1;
+	if (!snap)
+		return 0;
+
+	if (verbose)
+		printf("famfs logplay: snapshot at seqnum %lld has %lld records\n",
+		       snap->fs_seqnum, snap->fs_nrecords);
+
+	famfs_dirfd_cache_init(&dc, mpt);
+	while ((rec = famfs_snap_next(snap, rec))) {
+		famfs_snap_rec_to_log_entry(rec, &le);
+		ls->n_snap++;
+		famfs_logplay_entry(&le, 0, &dc, dry_run, role, ls, verbose);
+	}
+	famfs_dirfd_cache_release(&dc);
+	return 0;
+}
+
+/********************************************************************************
+ *
+ * Parallel logplay
+ *
+ * Applying a file entry costs an open, a MAP_CREATE ioctl and a close, so replaying a
+ * big log is bound by syscall latency. famfs_logplay_parallel() validates the entries
+ * (and snapshot records) to be played up front, creates the directories on the calling
+ * thread in order of depth (so every parent exists before its children), and then
+ * fans the files out over a pool of workers. Files are sharded by parent directory,
+ * so workers don't contend for the same directory, and each shard is applied in log
+ * order. Every worker has its own famfs_log_stats, which are merged at the end; the
+ * result is the same as for a serial logplay.
+ *
+ * Removals are played with the files of their shard (an unlink is in the same shard
+ * as the file it removes). A path can only change from file to directory, or from
+ * directory to file, through a removal, so a batch in which a directory is removed,
+ * or created after a file was removed, is played serially in log order instead.
+ */
+
+struct famfs_logplay_worker {
+	pthread_t                     thread;
+	u32                           id;
+	const struct famfs_log_entry *ents;
+	const u32                    *shard;
+	u64                           nents;
+	const char                   *mpt;
+	int                           dry_run;
+	enum famfs_system_role        role;
+	int                           verbose;
+	struct famfs_log_stats        ls;
+};
+
+static u32
+famfs_path_depth(const char *relpath)
+{
+	u32 depth = 0;
+
+	for (; *relpath; relpath++)
+		if (*relpath == '/')
+			depth++;
+	return depth;
+}
+
+/* Shard a file by its parent directory (FNV-1a hash of everything before the last /) */
+static u32
+famfs_logplay_shard(const char *relpath, u32 nshards)
+{
+	const char *slash = strrchr(relpath, '/');
+	u32 hash = 2166136261u;
+
+	for (; slash && relpath < slash; relpath++)
+		hash = (hash ^ (u8)*relpath) * 16777619u;
+	return hash % nshards;
+}
+
+static void
+famfs_log_stats_merge(struct famfs_log_stats *to, const struct famfs_log_stats *from)
+{
+	to->n_entries += from->n_entries;
+	to->f_logged  += from->f_logged;
+	to->f_existed += from->f_existed;
+	to->f_created += from->f_created;
+	to->f_errs    += from->f_errs;
+	to->d_logged  += from->d_logged;
+	to->d_existed += from->d_existed;
+	to->d_created += from->d_created;
+	to->d_errs    += from->d_errs;
+	to->f_unlinked += from->f_unlinked;
+	to->f_removed  += from->f_removed;
+	to->d_rmdirs   += from->d_rmdirs;
+	to->d_removed  += from->d_removed;
+	to->n_snap    += from->n_snap;
+}
+
+static void *
+famfs_logplay_worker(void *arg)
+{
+	struct famfs_logplay_worker *w = arg;
+	struct famfs_dirfd_cache dc;
+	u64 i;
+
+	famfs_dirfd_cache_init(&dc, w->mpt);
+	for (i = 0; i < w->nents; i++) {
+		if (!famfs_log_type_is_file(w->ents[i].famfs_log_entry_type)
+		    || w->shard[i] != w->id)
+			continue;
+		famfs_logplay_entry(&w->ents[i], i, &dc, w->dry_run, w->role,
+				    &w->ls, w->verbose);
+	}
+	famfs_dirfd_cache_release(&dc);
+	return NULL;
+}
+
+/* Order for the directory pass: by depth, and in log order within a depth */
+static int
+famfs_logplay_dir_cmp(const void *a, const void *b, void *arg)
+{
+	const struct famfs_log_entry *ents = arg;
+	u64 ia = *(const u64 *)a;
+	u64 ib = *(const u64 *)b;
+	const struct famfs_log_entry *ea = &ents[ia];
+	const struct famfs_log_entry *eb = &ents[ib];
+	u32 da = 0, db = 0;
+
+	if (ea->famfs_log_entry_type == FAMFS_LOG_MKDIR)
+		da = famfs_path_depth((const char *)ea->famfs_md.famfs_relpath);
+	if (eb->famfs_log_entry_type == FAMFS_LOG_MKDIR)
+		db = famfs_path_depth((const char *)eb->famfs_md.famfs_relpath);
+	if (da != db)
+		return (da < db) ? -1 : 1;
+	return (ia < ib) ? -1 : (ia > ib);
+}
+
+static int
+famfs_logplay_ents_append(struct famfs_log_entry **ents, u64 *nents, u64 *maxents,
+			  const struct famfs_log_entry *le)
+{
+	if (*nents == *maxents) {
+		u64 newmax = (*maxents) ? *maxents * 2 : 1024;
+		struct famfs_log_entry *n = realloc(*ents, newmax * sizeof(*n));
+
+		if (!n)
+			return -ENOMEM;
+		*ents = n;
+		*maxents = newmax;
+	}
+	(*ents)[(*nents)++] = *le;
+	return 0;
+}
+
+/**
+ * famfs_logplay_parallel()
+ *
+ * Play the log (and the snapshot, if @start_seqnum precedes it) from @start_seqnum
+ * with @nthreads workers. See __famfs_logplay_from() for the parameters.
+ *
+ * Returns: 0 if everything was valid (apply errors are counted in @ls), -1 if the
+ * snapshot or an entry was invalid (the entries before an invalid entry are applied)
+ */
+static int
+famfs_logplay_parallel(
+	const struct famfs_log  *logp,
+	const char              *mpt,
+	u64                      start_seqnum,
+	u64                     *next_seqnum_out,
+	int                      dry_run,
+	enum famfs_system_role   role,
+	u32                      nthreads,
+	struct famfs_log_stats  *ls,
+	int                      verbose)
+{
+	const struct famfs_snap_rec *rec = NULL;
+	struct famfs_logplay_worker *workers;
+	const struct famfs_log_entry *lep;
+	struct famfs_log_entry *ents = NULL;
+	struct famfs_log_cursor cur;
+	struct famfs_dirfd_cache dc;
+	const struct famfs_snap *snap;
+	struct famfs_log_entry le;
+	u64 nents = 0, maxents = 0;
+	u64 *dirs = NULL;
+	u64 ndirs = 0;
+	u32 *shard = NULL;
+	int unlinked = 0;
+	int serial = 0;
+	int invalid = 0;
+	int rc = -1;
+	u64 i;
+	u32 t;
+
+	/* Pass 0: validate and collect everything that is to be played */
+	famfs_log_acquire_header(logp);
+	if (start_seqnum < logp->famfs_log_snap_seqnum) {
+		if (famfs_log_get_snapshot(logp, &snap))
+			return -1;
+		if (verbose && snap)
+			printf("famfs logplay: snapshot at seqnum %lld has %lld records\n",
+			       snap->fs_seqnum, snap->fs_nrecords);
+		while (snap && (rec = famfs_snap_next(snap, rec))) {
+			famfs_snap_rec_to_log_entry(rec, &le);
+			if (famfs_logplay_ents_append(&ents, &nents, &maxents, &le))
+				goto out;
+			ls->n_snap++;
+		}
+		start_seqnum = logp->famfs_log_snap_seqnum;
+	}
+	if (famfs_log_cursor_init_mt(&cur, logp, start_seqnum, nthreads))
+		goto out;
+	if (verbose)
+		printf("famfs logplay: log contains %lld %s\n", cur.end,
+		       (famfs_log_is_v2(logp)) ? "bytes of records" : "entries");
+
+	while ((lep = famfs_log_cursor_next(&cur))) {
+		if (famfs_logplay_ents_append(&ents, &nents, &maxents, lep))
+			goto out;
+		ls->n_entries++;
+	}
+	invalid = cur.invalid;
+	*next_seqnum_out = cur.seqnum;
+
+	/* Pass 1: directories (and anything else that is not a file), by depth */
+	dirs = calloc(nents + 1, sizeof(*dirs));
+	shard = calloc(nents + 1, sizeof(*shard));
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!dirs || !shard || !workers)
+		goto out_free;
+
+	for (i = 0; i < nents; i++) {
+		switch (ents[i].famfs_log_entry_type) {
+		case FAMFS_LOG_UNLINK:
+			unlinked = 1;
+			/* fallthrough */
+		case FAMFS_LOG_FILE:
+			shard[i] = famfs_logplay_shard((const char *)ents[i].famfs_fc.famfs_relpath,
+						       nthreads);
+			continue;
+		case FAMFS_LOG_RMDIR:
+			serial = 1;
+			break;
+		case FAMFS_LOG_MKDIR:
+			serial |= unlinked;
+			break;
+		}
+		dirs[ndirs++] = i;
+	}
+	if (serial) {
+		if (verbose)
+			printf("famfs logplay: paths are removed and re-created; playing serially\n");
+		famfs_dirfd_cache_init(&dc, mpt);
+		for (i = 0; i < nents; i++)
+			famfs_logplay_entry(&ents[i], i, &dc, dry_run, role, ls, verbose);
+		famfs_dirfd_cache_release(&dc);
+		rc = (invalid) ? -1 : 0;
+		goto out_free;
+	}
+	qsort_r(dirs, ndirs, sizeof(*dirs), famfs_logplay_dir_cmp, ents);
+	famfs_dirfd_cache_init(&dc, mpt);
+	for (i = 0; i < ndirs; i++)
+		famfs_logplay_entry(&ents[dirs[i]], dirs[i], &dc, dry_run, role, ls, verbose);
+	famfs_dirfd_cache_release(&dc);
+
+	/* Pass 2: files, sharded by parent directory */
+	for (t = 0; t < nthreads; t++) {
+		workers[t].id      = t;
+		workers[t].ents    = ents;
+		workers[t].shard   = shard;
+		workers[t].nents   = nents;
+		workers[t].mpt     = mpt;
+		workers[t].dry_run = dry_run;
+		workers[t].role    = role;
+		workers[t].verbose = verbose;
+		if (pthread_create(&workers[t].thread, NULL, famfs_logplay_worker, &workers[t])) {
+			/* Couldn't start this worker; do its shard here */
+			famfs_logplay_worker(&workers[t]);
+			workers[t].thread = 0;
+		}
+	}
+	for (t = 0; t < nthreads; t++) {
+		if (workers[t].thread)
+			pthread_join(workers[t].thread, NULL);
+		famfs_log_stats_merge(ls, &workers[t].ls);
+	}
+	rc = (invalid) ? -1 : 0;
+
+out_free:
+	free(workers);
+out:
+	free(dirs);
+	free(shard);
+	free(ents);
+	return rc;
+}
+
+/**
+ * __famfs_logplay_from()
+ *
+ * Play the log starting at @start_seqnum. Entries prior to @start_seqnum are neither
+ * validated nor applied. If any of them have been compacted into the snapshot, the
+ * snapshot is played first and then the whole log.
+ *
+ * @logp            - pointer to a read-only copy or mmap of the log
+ * @mpt             - mount point path
+ * @start_seqnum    - seqnum of the first entry to play
+ * @next_seqnum_out - if non-NULL, receives the seqnum after the last entry played
+ * @dry_run         - process the log but don't create the files & directories
+ * @client_mode     - for testing; play the log as if this is a client node, even on master
+ * @nthreads        - if > 1, play the log in parallel (see famfs_logplay_parallel())
+ *
+ * Returns value: Number of errors detected (0=complete success)
+ */
+int
+__famfs_logplay_from(
+	const struct famfs_log *logp,
+	const char             *mpt,
+	u64                     start_seqnum,
+	u64                    *next_seqnum_out,
+	int                     dry_run,
+	int                     client_mode,
+	int                     nthreads,
+	int                     verbose)
+{
+	struct famfs_log_stats ls = { 0 };
+	enum famfs_system_role role;
+	struct famfs_superblock *sb;
+	struct famfs_log_cursor cur;
+	u64 next_seqnum;
+	int rc;
+
+	sb = famfs_map_superblock_by_path(mpt, 1 /* read-only */);
+	if (!sb)
+		return -1;
+
+	if (famfs_check_super(sb)) {
+		fprintf(stderr, "%s: no valid superblock for mpt %s\n", __func__, mpt);
+		return -1;
+	}
+
+	role = (client_mode) ? FAMFS_CLIENT : famfs_get_role(sb);
+
+	if (famfs_validate_log_header(logp)) {
+		fprintf(stderr, "%s: invalid log header\n", __func__);
+		return -1;
+	}
+	if (famfs_log_attach(logp, mpt, 0, 0))
+		return -1;
+
+	if (nthreads > 1) {
+		rc = famfs_logplay_parallel(logp, mpt, start_seqnum, &next_seqnum, dry_run,
+					    role, nthreads, &ls, verbose);
+		if (rc)
+			goto out;
+		goto done;
+	}
+
+	famfs_log_acquire_header(logp);
+	if (start_seqnum < logp->famfs_log_snap_seqnum) {
+		rc = famfs_logplay_snapshot(logp, mpt, dry_run, role, &ls, verbose);
+		if (rc)
+			goto out;
+		start_seqnum = logp->famfs_log_snap_seqnum;
+	}
+	/* Entries appended after this point will be picked up by the next logplay */
+	if (famfs_log_cursor_init(&cur, logp, start_seqnum)) {
+		rc = -1;
+		goto out;
+	}
+
+	if (verbose)
+		printf("famfs logplay: log contains %lld %s\n", cur.end,
+		       (famfs_log_is_v2(logp)) ? "bytes of records" : "entries");
+
+	rc = famfs_logplay_entries(&cur, mpt, dry_run, role, &ls, verbose);
+	if (rc)
+		goto out;
+	next_seqnum = cur.seqnum;
+
+done:
+	famfs_print_log_stats("famfs_logplay", &ls, verbose);
+
+	if (next_seqnum_out)
+		*next_seqnum_out = next_seqnum;
+	rc = ls.f_errs + ls.d_errs;
+out:
+	famfs_log_detach(logp);
+	return rc;
+}
+
+/**
+ * famfs_logplay()
+ *
+ * Outer function to play the log for a famfs file system
+ *
+ * @fspath      - mount point, or any path within the famfs file system
+ * @use_mmap    - Use mmap rather than reading the log into a buffer
+ * @dry_run     - process the log but don't create the files & directories
+ * @client_mode - for testing; play the log as if this is a client node, even on master
+ * @full_replay - ignore the logplay checkpoint (if any) and play the whole log
+ * @nthreads    - number of threads to apply entries with (<= 1: serial)
+ * @verbose
+ */
+int
+famfs_logplay(
+	const char             *fspath,
+	int                     use_mmap,
+	int                     dry_run,
+	int                     client_mode,
+	int                     full_replay,
+	int                     nthreads,
+	int                     verbose)
+{
+	struct famfs_logplay_ckpt ckpt;
+	struct famfs_superblock *sb;
+	char ckpt_path[PATH_MAX];
+	char mpt_out[PATH_MAX];
+	struct famfs_log *logp;
+	u64 start_seqnum = 0;
+	u64 next_seqnum = 0;
+	int use_ckpt = 0;
+	size_t log_size;
+	int lfd;
+	int rc;
+
+	lfd = open_log_file_read_only(fspath, &log_size, mpt_out, NO_LOCK);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
+			__func__, fspath);
+		return -1;
+	}
+
+	if (use_mmap) {
+		logp = mmap(0, log_size, PROT_READ, MAP_PRIVATE, lfd, 0);
+		if (logp == MAP_FAILED) {
+			fprintf(stderr, "%s: failed to mmap log file %s/.meta/log\n",
+				__func__, mpt_out);
+			close(lfd);
+			return -1;
+		}
+		/* Only the log header needs to be invalidated here; the entries are
+		 * invalidated as they are read (see famfs_log_acquire())
+		 */
+		invalidate_processor_cache(logp, sizeof(*logp));
+	} else {
+		size_t resid = 0;
+		size_t total = 0;
+		char *buf;
+
+		/* XXX: Hmm, not sure how to invalidate the processor cache before a posix read.
+		 * default is mmap; posix read may not work correctly for non-cache-coherent configs
+		 */
+		/* Get log via posix read */
+		logp = malloc(log_size);
+		if (!logp) {
+			close(lfd);
+			fprintf(stderr, "%s: malloc %ld failed for log\n", __func__, log_size);
+			return -ENOMEM;
+		}
+		resid = log_size;
+		buf = (char *)logp;
+		do {
+			rc = read(lfd, &buf[total], resid);
+			if (rc < 0) {
+				fprintf(stderr, "%s: error %d reading log file\n",
+					__func__, errno);
+				return -errno;
+			}
+			printf("%s: read %d bytes of log\n", __func__, rc);
+			if (rc == 0)
+				goto err_out; /* if we didn't get the whole log, err out */
+			resid -= rc;
+			total += rc;
+		} while (resid > 0);
+	}
+
+	/* The checkpoint may be in a segment */
+	if (famfs_log_attach(logp, mpt_out, 0, 0)) {
+		rc = -1;
+		goto err_out;
+	}
+
+	/* Dry runs neither honor nor update the checkpoint */
+	if (!dry_run) {
+		sb = famfs_map_superblock_by_path(mpt_out, 1 /* read-only */);
+		if (sb && !famfs_check_super(sb) && !famfs_validate_log_header(logp)
+		    && !famfs_logplay_ckpt_init(&ckpt, sb, logp, lfd)) {
+			famfs_logplay_ckpt_path(&sb->ts_uuid, ckpt_path);
+			use_ckpt = 1;
+			if (!full_replay)
+				start_seqnum = famfs_logplay_ckpt_start(ckpt_path, &ckpt,
+								       logp, verbose);
+		}
+		if (sb)
+			munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	}
+
+	rc = __famfs_logplay_from(logp, mpt_out, start_seqnum, &next_seqnum,
+				  dry_run, client_mode, nthreads, verbose);
+
+	/* Only advance the checkpoint past a clean run, so failed entries get retried */
+	if (use_ckpt && rc == 0)
+		famfs_logplay_ckpt_save(ckpt_path, &ckpt, logp, next_seqnum);
+	famfs_log_detach(logp);
+err_out:
+	if (use_mmap)
+		munmap(logp, log_size);
+	else
+		free(logp);
+	close(lfd);
+	return rc;
+}
+
+static inline u64
+famfs_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * famfs_logplay_follow()
+ *
+ * Play the log, and then keep following it: poll the log header for new entries and
+ * apply them as they appear, until @fa->stop_now is set or @fa->max_batches batches
+ * have been applied.
+ *
+ * The log stays mapped for the duration. Each poll only invalidates the cache line
+ * that holds famfs_log_next_index and famfs_log_next_seqnum; the cache is only
+ * invalidated for log entries once they have been published. The poll interval
+ * starts at @fa->poll_min_us, doubles each time a poll finds nothing new (up to
+ * @fa->poll_max_us), and drops back to @fa->poll_min_us when new entries show up.
+ *
+ * @fspath - mount point, or any path within the famfs file system
+ * @fa     - parameters and outputs (see struct famfs_follow_args)
+ *
+ * Returns: 0 on success (including being stopped), <0 if the log could not be
+ * followed. Errors applying individual entries are counted in @fa->nerrors.
+ */
+int
+famfs_logplay_follow(
+	const char               *fspath,
+	struct famfs_follow_args *fa)
+{
+	u64 poll_us = (fa->poll_min_us) ? fa->poll_min_us : 1;
+	struct famfs_logplay_ckpt ckpt;
+	enum famfs_system_role role;
+	struct famfs_superblock *sb;
+	char ckpt_path[PATH_MAX];
+	char mpt_out[PATH_MAX];
+	const struct famfs_log *flog = NULL; /* The log or segment we are following in */
+	struct famfs_log *logp;
+	u64 base = (u64)-1;
+	int ckpt_valid = 0;
+	u64 applied = 0;
+	u64 from = 0;
+	size_t log_size;
+	int lfd;
+	int rc = 0;
+
+	lfd = open_log_file_read_only(fspath, &log_size, mpt_out, NO_LOCK);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
+			__func__, fspath);
+		return -1;
+	}
+
+	logp = mmap(0, log_size, PROT_READ, MAP_SHARED, lfd, 0);
+	if (logp == MAP_FAILED) {
+		fprintf(stderr, "%s: failed to mmap log file %s/.meta/log\n", __func__, mpt_out);
+		close(lfd);
+		return -1;
+	}
+	invalidate_processor_cache(logp, log_size);
+	if (famfs_log_attach(logp, mpt_out, 0, 0)) {
+		munmap(logp, log_size);
+		close(lfd);
+		return -1;
+	}
+
+	sb = famfs_map_superblock_by_path(mpt_out, 1 /* read-only */);
+	if (!sb) {
+		rc = -1;
+		goto out;
+	}
+	if (famfs_check_super(sb)) {
+		fprintf(stderr, "%s: no valid superblock for mpt %s\n", __func__, mpt_out);
+		rc = -1;
+		goto out;
+	}
+	role = (fa->client_mode) ? FAMFS_CLIENT : famfs_get_role(sb);
+
+	if (famfs_validate_log_header(logp)) {
+		fprintf(stderr, "%s: invalid log header\n", __func__);
+		rc = -1;
+		goto out;
+	}
+
+	if (!famfs_logplay_ckpt_init(&ckpt, sb, logp, lfd)) {
+		famfs_logplay_ckpt_path(&sb->ts_uuid, ckpt_path);
+		ckpt_valid = 1;
+		if (!fa->full_replay)
+			applied = famfs_logplay_ckpt_start(ckpt_path, &ckpt, logp, fa->verbose);
+	}
+
+	if (fa->verbose)
+		printf("%s: following log of %s from seqnum %lld\n", __func__, mpt_out, applied);
+
+	while (!fa->stop_now) {
+		struct famfs_log_stats ls = { 0 };
+		u64 next_index, played, next_seqnum;
+		struct famfs_log_cursor cur;
+		struct famfs_log_view v;
+		struct famfs_log *seg;
+		u64 t0, elapsed;
+
+		if (fa->max_batches && fa->nbatches >= fa->max_batches)
+			break;
+
+		/* One cache line tells us whether there is anything new */
+		famfs_log_acquire_header(logp);
+		t0 = famfs_now_us();
+		if (applied < logp->famfs_log_snap_seqnum) {
+			/* Entries we have not applied were compacted into the snapshot */
+			if (famfs_logplay_snapshot(logp, mpt_out, 0, role, &ls, fa->verbose)) {
+				usleep(poll_us);
+				poll_us = MIN(poll_us * 2, MAX(fa->poll_max_us, poll_us));
+				continue;
+			}
+			applied = logp->famfs_log_snap_seqnum;
+		}
+		if (base != logp->famfs_log_snap_seqnum) {
+			/* First poll, or the log was compacted: find our place in it */
+			if (famfs_log_seek(logp, applied, &flog, &from, &v)) {
+				fprintf(stderr, "%s: seqnum %lld is not in the log; giving up\n",
+					__func__, applied);
+				rc = -1;
+				break;
+			}
+			base = logp->famfs_log_snap_seqnum;
+		}
+		next_index = famfs_log_acquire(flog, from);
+
+		if (next_index < from || next_index > flog->famfs_log_last_index + 1) {
+			fprintf(stderr, "%s: log next_index went from %lld to %lld; giving up\n",
+				__func__, from, next_index);
+			rc = -1;
+			break;
+		}
+		if (next_index == from && !ls.n_snap) {
+			/* Nothing new here; the log may have continued into a segment */
+			seg = famfs_log_next_seg(flog, applied);
+			if (seg) {
+				flog = seg;
+				from = 0;
+				continue;
+			}
+			usleep(poll_us);
+			poll_us = MIN(poll_us * 2, MAX(fa->poll_max_us, poll_us));
+			continue;
+		}
+
+		famfs_log_cursor_at(&cur, flog, from, applied, next_index);
+		rc = famfs_logplay_entries(&cur, mpt_out, 0, role, &ls, fa->verbose);
+		played = cur.pos;
+		next_seqnum = cur.seqnum;
+		elapsed = famfs_now_us() - t0;
+
+		if (next_seqnum > applied || ls.n_snap) {
+			fa->nbatches++;
+			fa->nentries += ls.n_entries + ls.n_snap;
+			fa->nerrors += ls.f_errs + ls.d_errs;
+			fa->total_apply_us += elapsed;
+			fa->max_apply_us = MAX(fa->max_apply_us, elapsed);
+			printf("famfs logplay: batch %lld: %lld entries (%lld files, %lld dirs) "
+			       "applied in %lld us\n", fa->nbatches, ls.n_entries + ls.n_snap,
+			       ls.f_created, ls.d_created, elapsed);
+
+			/* Once anything has failed, leave the checkpoint behind the failure
+			 * so the next logplay retries it
+			 */
+			if (ls.f_errs || ls.d_errs)
+				ckpt_valid = 0;
+			applied = next_seqnum;
+			flog = cur.logp; /* The cursor may have moved on to a segment */
+			from = played;
+			if (ckpt_valid)
+				famfs_logplay_ckpt_save(ckpt_path, &ckpt, logp, applied);
+		}
+		if (rc) {
+			/* An entry that is not valid (yet?); try again at the next poll */
+			rc = 0;
+			usleep(poll_us);
+			poll_us = MIN(poll_us * 2, MAX(fa->poll_max_us, poll_us));
+			continue;
+		}
+		poll_us = (fa->poll_min_us) ? fa->poll_min_us : 1;
+	}
+
+	if (fa->nbatches)
+		printf("%s: %lld batches, %lld entries; apply latency avg %lld us max %lld us\n",
+		       __func__, fa->nbatches, fa->nentries,
+		       fa->total_apply_us / fa->nbatches, fa->max_apply_us);
+out:
+	if (sb)
+		munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	famfs_log_detach(logp);
+	munmap(logp, log_size);
+	close(lfd);
+	return rc;
+}
+
+/********************************************************************************
+ *
+ * Log maintenance / append
+ */
+
+/**
+ * famfs_log_seg_len()
+ *
+ * Segment n is twice the size of segment n-1, from lp->seg_min_len (or
+ * FAMFS_LOG_SEG_MIN_LEN) up to FAMFS_LOG_SEG_MAX_LEN. Segments are whole allocation
+ * units, so a segment is the whole extent that is allocated for it.
+ */
+static u64
+famfs_log_seg_len(const struct famfs_locked_log *lp, u64 seg_num)
+{
+	u64 len = round_size_to_alloc_unit((lp->seg_min_len) ? lp->seg_min_len
+					   : FAMFS_LOG_SEG_MIN_LEN, lp->alloc_unit);
+
+	while (--seg_num && len < FAMFS_LOG_SEG_MAX_LEN)
+		len *= 2;
+	return round_size_to_alloc_unit(MIN(len, FAMFS_LOG_SEG_MAX_LEN), lp->alloc_unit);
+}
+
+/**
+ * famfs_log_seg_create()
+ *
+ * Map and format a new segment at @offset on the device. The segment is not linked
+ * from the log yet, so nobody else can see it.
+ */
+static struct famfs_log *
+famfs_log_seg_create(
+	struct famfs_locked_log *lp,
+	u64                      seg_num,
+	u64                      offset,
+	u64                      len)
+{
+	const struct famfs_log *logp = lp->logp;
+	struct famfs_log_chain *chain;
+	struct famfs_log *seg = NULL;
+	u64 area;
+
+	pthread_mutex_lock(&famfs_log_chains_lock);
+	chain = famfs_log_chain_find(logp, NULL);
+	if (!chain || !chain->writable || chain->logs[seg_num]) {
+		fprintf(stderr, "%s: log is not attached for writing\n", __func__);
+		goto out;
+	}
+	seg = famfs_log_seg_map(chain, seg_num, offset, len);
+	if (!seg)
+		goto out;
+
+	/* Like mkfs, but without a snapshot region */
+	area = len - offsetof(struct famfs_log, entries);
+	memset(seg, 0, sizeof(*seg));
+	seg->famfs_log_magic       = logp->famfs_log_magic;
+	seg->famfs_log_len         = len;
+	seg->famfs_log_last_index  = (famfs_log_is_v2(logp)) ?
+		area - 1 : area / sizeof(struct famfs_log_entry) - 1;
+	seg->famfs_log_snap_offset = len;
+	seg->famfs_log_seg_num     = seg_num;
+	seg->famfs_log_crc = famfs_gen_log_header_crc(seg, famfs_log_csum_alg(logp));
+	flush_processor_cache(seg, sizeof(*seg));
+	chain->logs[seg_num] = seg;
+out:
+	pthread_mutex_unlock(&famfs_log_chains_lock);
+	return seg;
+}
+
+/**
+ * famfs_log_grow()
+ *
+ * The log (or its last segment) is full; continue it in a segment. A segment that is
+ * already linked (from before the log was compacted) is reused. Otherwise a new one
+ * is allocated from the data space, formatted and linked. Either way, readers only see
+ * the log continue into the segment once the segment's header says it starts at the
+ * next seqnum.
+ *
+ * Returns 0 on success, -ENOMEM if the log cannot grow
+ */
+static int
+famfs_log_grow(struct famfs_locked_log *lp)
+{
+	struct famfs_log *tail = lp->tail;
+	u64 seg_num = tail->famfs_log_seg_num + 1;
+	struct famfs_log *seg;
+	s64 offset = 0;
+	u64 len = 0;
+
+	if (lp->nogrow)
+		return -ENOMEM;
+	if (seg_num > FAMFS_LOG_MAX_SEGS) {
+		fprintf(stderr, "%s: log is full (%d segments)\n", __func__, FAMFS_LOG_MAX_SEGS);
+		return -ENOMEM;
+	}
+
+	if (tail->famfs_log_next_seg_offset) {
+		seg = famfs_log_linked_seg(tail);
+		if (!seg)
+			return -ENOMEM;
+	} else {
+		len = famfs_log_seg_len(lp, seg_num);
+		offset = famfs_alloc_contiguous(lp, len, 0);
+		if (offset < 0) {
+			fprintf(stderr, "%s: no space for a %lld byte log segment\n",
+				__func__, len);
+			return -ENOMEM;
+		}
+		seg = famfs_log_seg_create(lp, seg_num, offset, len);
+		if (!seg) {
+			famfs_free_extent(lp, offset, len);
+			return -ENOMEM;
+		}
+	}
+
+	/* Start the segment at the next seqnum: this is what makes it continue the log */
+	famfs_log_write_begin(seg);
+	seg->famfs_log_next_seqnum = tail->famfs_log_next_seqnum;
+	seg->famfs_log_next_index  = 0;
+	seg->famfs_log_snap_seqnum = tail->famfs_log_next_seqnum;
+	flush_processor_cache(&seg->famfs_log_next_seqnum, FAMFS_LOG_PUBLISHED_BYTES);
+	famfs_log_write_end(seg);
+
+	if (!tail->famfs_log_next_seg_offset) {
+		famfs_log_write_begin(tail);
+		tail->famfs_log_next_seg_offset = offset;
+		tail->famfs_log_next_seg_len    = len;
+		flush_processor_cache(&tail->famfs_log_next_seg_offset,
+				      2 * sizeof(tail->famfs_log_next_seg_offset));
+		famfs_log_write_end(tail);
+		famfs_log_count_space(lp, len);
+	}
+	lp->tail = seg;
+	return 0;
+}
+
+/**
+ * famfs_append_log()
+ *
+ * Append a log entry. If a transaction is open on @lp, the entry is staged and will be
+ * published by the next famfs_log_txn_commit(); otherwise it is published immediately.
+ *
+ * @lp   - locked log
+ * @e    - pointer to log entry in memory
+ *
+ * NOTE: this function is not re-entrant. Must hold a lock or mutex when calling this
+ * function if there is any chance of re-entrancy.
+ *
+ * Returns 0 on success, -ENOMEM if the log is full and cannot grow
+ */
+static int
+famfs_append_log(struct famfs_locked_log *lp,
+		 struct famfs_log_entry  *e)
+{
+	struct famfs_log *logp;
+	u64 pos, next_pos;
+
+	assert(lp);
+	assert(lp->tail);
+	assert(e);
+
+	if (lp->txn_active)
+		return famfs_log_txn_stage(lp, e);
+
+	/* XXX This function is not re-entrant */
+	logp = lp->tail;
+	pos = logp->famfs_log_next_index;
+	if (famfs_log_put_entry(logp, pos, e, logp->famfs_log_next_seqnum, &next_pos)) {
+		if (famfs_log_grow(lp)) {
+			fprintf(stderr, "%s: log full\n", __func__);
+			return -ENOMEM;
+		}
+		logp = lp->tail;
+		pos = logp->famfs_log_next_index;
+		if (famfs_log_put_entry(logp, pos, e, logp->famfs_log_next_seqnum, &next_pos))
+			return -ENOMEM;
+	}
+
+	famfs_log_count_entry(&lp->cnt, e, lp->alloc_unit);
+	famfs_log_flush_entries(logp, pos, next_pos);
+	famfs_log_publish(lp, logp, next_pos, e->famfs_log_entry_seqnum + 1);
+
+	return 0;
+}
+
+/********************************************************************************
+ *
+ * Group commit
+ *
+ * Multi-entry operations (cp -r, mkdir -p, cp of many files) open a transaction on
+ * their famfs_locked_log. While it is open, famfs_append_log() stages entries in the
+ * unpublished slots at famfs_log_next_index and beyond, without touching the log
+ * header. famfs_log_txn_commit() flushes the staged entries and publishes all of them
+ * with a single header update.
+ *
+ * Slots are reserved in batches of up to txn_batch entries. When a batch is used up,
+ * it is published and a new one is reserved, so a long copy pays one commit per batch
+ * rather than one per file. (In a v2 log, where records vary in size, a batch is
+ * txn_batch entries and each record is checked for space as it is staged.)
+ *
+ * Staged entries occupy positions famfs_log_next_index through lp->txn_end.
+ *
+ * Crash semantics: a batch is published all or nothing, but files are created (and
+ * mapped, and filled by famfs cp) locally as their entries are staged, ahead of the
+ * publish. If the master dies with a transaction open, up to a batch of files exists
+ * locally that no other node will ever see, on extents that the log does not own.
+ * The next famfs_init_locked_log() on that node finds the staged entries (which are
+ * still valid records after famfs_log_next_index) and removes those files before any
+ * allocation can hand the extents out again; see famfs_log_txn_recover(). Files in
+ * published batches stay, but the data copy into the last of them may not have
+ * finished. A master node that crashes outright has no local files to reconcile;
+ * they are rebuilt from the log by famfs logplay.
+ */
+
+/**
+ * famfs_log_txn_reserve()
+ *
+ * Reserve up to lp->txn_batch slots after the staged entries. Returns the number
+ * of slots reserved (0 if the log is full)
+ */
+static u64
+famfs_log_txn_reserve(struct famfs_locked_log *lp)
+{
+	const struct famfs_log *logp = lp->tail;
+	u64 first = lp->txn_end;
+	u64 avail = (first > logp->famfs_log_last_index) ?
+		0 : logp->famfs_log_last_index + 1 - first;
+
+	if (famfs_log_is_v2(logp) && !famfs_log_full(logp))
+		avail = lp->txn_batch;
+
+	lp->txn_reserved = lp->txn_nstaged + ((avail < lp->txn_batch) ? avail : lp->txn_batch);
+	return lp->txn_reserved - lp->txn_nstaged;
+}
+
+/**
+ * famfs_log_txn_publish()
+ *
+ * Publish all staged entries with one flush and one header update. The transaction
+ * stays open.
+ */
+static void
+famfs_log_txn_publish(struct famfs_locked_log *lp)
+{
+	struct famfs_log *logp = lp->tail;
+
+	if (lp->txn_nstaged) {
+		famfs_log_flush_entries(logp, logp->famfs_log_next_index, lp->txn_end);
+		famfs_log_publish(lp, logp, lp->txn_end,
+				  logp->famfs_log_next_seqnum + lp->txn_nstaged);
+	}
+	lp->txn_nstaged = 0;
+	lp->txn_reserved = 0;
+	lp->txn_end = logp->famfs_log_next_index;
+}
+
+/**
+ * famfs_log_txn_begin()
+ *
+ * Open a transaction on a locked log
+ *
+ * @lp    - locked log
+ * @batch - max entries per published batch (0: FAMFS_LOG_TXN_BATCH)
+ *
+ * Returns 0 on success, -EINVAL if a transaction is already open
+ */
+int
+famfs_log_txn_begin(struct famfs_locked_log *lp, u64 batch)
+{
+	assert(lp);
+	assert(lp->tail);
 
-		switch (le.famfs_log_entry_type) {
-		case FAMFS_LOG_FILE: {
-			const struct famfs_file_creation *fc = &le.famfs_fc;
-			struct famfs_simple_extent *el;
-			char fullpath[PATH_MAX];
-			char rpath[PATH_MAX];
-			struct stat st;
-			int skip_file = 0;
-			int fd;
+	if (lp->txn_active) {
+		fprintf(stderr, "%s: transaction already open\n", __func__);
+		return -EINVAL;
+	}
+	lp->txn_active = 1;
+	lp->txn_batch = (batch) ? batch : FAMFS_LOG_TXN_BATCH;
+	lp->txn_nstaged = 0;
+	lp->txn_reserved = 0;
+	lp->txn_end = lp->tail->famfs_log_next_index;
+	return 0;
+}
 
-			ls.f_logged++;
-			if (verbose > 1)
-				printf("%s: %lld file=%s size=%lld\n", __func__, i,
-				       fc->famfs_relpath, fc->famfs_fc_size);
+/**
+ * famfs_log_txn_grow()
+ *
+ * The log (or segment) is full: publish the staged entries, continue in a segment
+ * (see famfs_log_grow()) and reserve slots there.
+ *
+ * Returns 0 on success, -ENOMEM if the log cannot grow
+ */
+static int
+famfs_log_txn_grow(struct famfs_locked_log *lp)
+{
+	famfs_log_txn_publish(lp);
+	if (famfs_log_grow(lp))
+		return -ENOMEM;
+	lp->txn_end = lp->tail->famfs_log_next_index;
+	return (famfs_log_txn_reserve(lp)) ? 0 : -ENOMEM;
+}
 
-			if (!famfs_log_entry_fc_path_is_relative(fc) || mock_path) {
-				fprintf(stderr,
-					"%s: ignoring log entry; path is not relative\n",
-					__func__);
-				ls.f_errs++;
-				skip_file++;
-			}
+/**
+ * famfs_log_txn_stage()
+ *
+ * Write an entry into the next reserved slot, reserving (and publishing the current
+ * batch) if needed. Nothing is written if the log is full.
+ *
+ * Returns 0 on success, -ENOMEM if the log is full
+ */
+static int
+famfs_log_txn_stage(struct famfs_locked_log *lp, struct famfs_log_entry *e)
+{
+	struct famfs_log *logp;
 
-			/* The only file that should have an extent with offset 0
-			 * is the superblock, which is not in the log. Check for files with
-			 * null offset...
-			 */
-			for (j = 0; j < fc->famfs_nextents; j++) {
-				const struct famfs_simple_extent *se = &fc->famfs_ext_list[j].se;
+	if (lp->txn_nstaged == lp->txn_reserved) {
+		/* Batch used up: publish it and reserve the next one */
+		famfs_log_txn_publish(lp);
+		if (!famfs_log_txn_reserve(lp) && famfs_log_txn_grow(lp)) {
+			fprintf(stderr, "%s: log full\n", __func__);
+			return -ENOMEM;
+		}
+	}
 
-				if (se->famfs_extent_offset == 0 || mock_path) {
-					fprintf(stderr,
-						"%s: ERROR file %s has extent with 0 offset\n",
-						__func__, fc->famfs_relpath);
-					ls.f_errs++;
-					skip_file++;
-				}
-			}
+	logp = lp->tail;
+	if (famfs_log_put_entry(logp, lp->txn_end, e,
+				logp->famfs_log_next_seqnum + lp->txn_nstaged, &lp->txn_end)) {
+		/* A v2 record that does not fit in what is left */
+		logp = NULL;
+		if (!famfs_log_txn_grow(lp)) {
+			logp = lp->tail;
+			if (famfs_log_put_entry(logp, lp->txn_end, e,
+						logp->famfs_log_next_seqnum + lp->txn_nstaged,
+						&lp->txn_end))
+				logp = NULL;
+		}
+		if (!logp) {
+			fprintf(stderr, "%s: log full\n", __func__);
+			return -ENOMEM;
+		}
+	}
+	famfs_log_count_entry(&lp->cnt, e, lp->alloc_unit);
+	lp->txn_nstaged++;
+	return 0;
+}
 
-			if (skip_file)
-				continue;
+/**
+ * famfs_log_txn_reserve_contig()
+ *
+ * Make sure that the next @n entries staged in the open transaction go into the same
+ * log (or segment) and are published together, so a crash or a full log cannot leave
+ * only some of them published. Anything already staged is published first. If what is
+ * left of the log might not hold @n entries (of the largest size, in a v2 log), the
+ * log continues in a segment now, before any of them are staged.
+ *
+ * @lp - locked log, with a transaction open
+ * @n  - number of entries; at most the transaction's batch size
+ *
+ * Returns 0 on success, -ENOMEM if the log cannot grow, -EINVAL if no transaction is
+ * open or @n is bigger than a batch
+ */
+int
+famfs_log_txn_reserve_contig(struct famfs_locked_log *lp, u64 n)
+{
+	u64 need;
 
-			snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, fc->famfs_relpath);
-			realpath(fullpath, rpath);
-			if (dry_run)
-				continue;
+	assert(lp);
+	if (!lp->txn_active || n > lp->txn_batch) {
+		fprintf(stderr, "%s: cannot reserve %lld entries\n", __func__, n);
+		return -EINVAL;
+	}
 
-			rc = stat(rpath, &st);
-			if (!rc) {
-				if (verbose > 1)
-					fprintf(stderr, "famfs logplay: File %s exists\n",
-						rpath);
-				ls.f_existed++;
-				continue;
-			}
-			if (verbose) {
-				printf("famfs logplay: creating file %s", fc->famfs_relpath);
-				if (verbose > 1)
-					printf(" mode %o", fc->fc_mode);
+	famfs_log_txn_publish(lp);
+	need = (famfs_log_is_v2(lp->tail)) ?
+		n * famfs_log_rec_size(FAMFS_FC_MAX_EXTENTS, FAMFS_MAX_PATHLEN) : n;
+	if (lp->txn_end + need > lp->tail->famfs_log_last_index + 1) {
+		if (famfs_log_grow(lp)) {
+			fprintf(stderr, "%s: log full\n", __func__);
+			return -ENOMEM;
+		}
+		lp->txn_end = lp->tail->famfs_log_next_index;
+		if (lp->txn_end + need > lp->tail->famfs_log_last_index + 1)
+			return -ENOMEM;
+	}
+	famfs_log_txn_reserve(lp);
+	return 0;
+}
 
-				printf("\n");
-			}
+/**
+ * famfs_log_txn_commit()
+ *
+ * Publish the staged entries and close the transaction
+ *
+ * Returns 0 on success, -EINVAL if no transaction is open
+ */
+int
+famfs_log_txn_commit(struct famfs_locked_log *lp)
+{
+	assert(lp);
 
-			fd = famfs_file_create(rpath, fc->fc_mode, fc->fc_uid, fc->fc_gid,
-					       (role == FAMFS_CLIENT) ? 1 : 0);
-			if (fd < 0) {
-				fprintf(stderr,
-					"%s: unable to create destfile (%s)\n",
-					__func__, fc->famfs_relpath);
+	if (!lp->txn_active) {
+		fprintf(stderr, "%s: no open transaction\n", __func__);
+		return -EINVAL;
+	}
+	famfs_log_txn_publish(lp);
+	lp->txn_active = 0;
+	return 0;
+}
 
-				unlink(rpath);
-				ls.f_errs++;
-				continue;
-			}
+/**
+ * famfs_log_txn_abort()
+ *
+ * Discard the entries staged since the last published batch, release the space that
+ * their file entries allocated, and close the transaction. The log header is not
+ * touched, so readers never see the discarded entries.
+ *
+ * The caller is responsible for any files it created for the discarded entries.
+ */
+void
+famfs_log_txn_abort(struct famfs_locked_log *lp)
+{
+	struct famfs_log *logp = lp->tail;
+	const struct famfs_file_creation *fc;
+	struct famfs_log_entry le;
+	u64 pos, i, j;
 
-			/* Build extent list of famfs_simple_extent; the log entry has a
-			 * different kind of extent list...
-			 */
-			el = calloc(fc->famfs_nextents, sizeof(*el));
-			for (j = 0; j < fc->famfs_nextents; j++) {
-				const struct famfs_log_extent *tle = &fc->famfs_ext_list[j];
+	assert(lp);
+	if (!lp->txn_active)
+		return;
+
+	pos = logp->famfs_log_next_index;
+	for (i = 0; lp->bitmap && i < lp->txn_nstaged; i++) {
+		if (famfs_log_get_entry(logp, pos, lp->txn_end,
+					logp->famfs_log_next_seqnum + i, &le, &pos))
+			break;
+		if (le.famfs_log_entry_type != FAMFS_LOG_FILE)
+			continue;
+		fc = &le.famfs_fc;
+		for (j = 0; j < fc->famfs_nextents; j++)
+			famfs_free_extent(lp, fc->famfs_ext_list[j].se.famfs_extent_offset,
+					  fc->famfs_ext_list[j].se.famfs_extent_len);
+	}
+	memset(famfs_log_pos_addr(logp, logp->famfs_log_next_index), 0,
+	       famfs_log_pos_bytes(logp, logp->famfs_log_next_index, lp->txn_end));
+	lp->txn_end = logp->famfs_log_next_index;
+	lp->txn_nstaged = 0;
+	lp->txn_reserved = 0;
+	lp->txn_active = 0;
+	memset(&lp->cnt, 0, sizeof(lp->cnt));
+}
+
+/*
+ * Compaction drops each removal along with the entry that created what it removed
+ * (the nearest preceding creation of the same path and kind). They are matched in a
+ * reverse pass over the entries, which counts the removals that have not been
+ * matched yet by path in a small open-addressing table.
+ */
+struct famfs_compact_rm {
+	u32  kind;    /* 1 + FAMFS_LOG_FILE or FAMFS_LOG_MKDIR; 0: empty slot */
+	u32  count;
+	char relpath[FAMFS_MAX_PATHLEN];
+};
+
+static struct famfs_compact_rm *
+famfs_compact_rm_slot(struct famfs_compact_rm *tbl, u32 nslots, u32 type,
+		      const char *relpath, int insert)
+{
+	u32 h = 2166136261u + type;
+	u32 kind = type + 1;
+	const char *c;
+	u32 s;
+
+	for (c = relpath; *c && c < relpath + FAMFS_MAX_PATHLEN; c++)
+		h = (h ^ (u8)*c) * 16777619u;
+	for (s = h & (nslots - 1); tbl[s].kind; s = (s + 1) & (nslots - 1)) {
+		if (tbl[s].kind == kind && !strncmp(tbl[s].relpath, relpath, FAMFS_MAX_PATHLEN))
+			return &tbl[s];
+	}
+	if (!insert)
+		return NULL;
+	tbl[s].kind = kind;
+	strncpy(tbl[s].relpath, relpath, FAMFS_MAX_PATHLEN - 1);
+	return &tbl[s];
+}
+
+/**
+ * famfs_compact_drop_removed()
+ *
+ * Mark (in @keep) the entries that go into a new snapshot: creations of files and
+ * directories that have not been removed since.
+ *
+ * Returns 0, or -ENOMEM
+ */
+static int
+famfs_compact_drop_removed(const struct famfs_log_entry *ents, u64 nents, u8 *keep)
+{
+	struct famfs_compact_rm *tbl, *rm;
+	u64 nrm = 0;
+	u32 nslots = 16;
+	u32 type;
+	u64 i;
+
+	for (i = 0; i < nents; i++) {
+		type = ents[i].famfs_log_entry_type;
+		keep[i] = (type == FAMFS_LOG_FILE || type == FAMFS_LOG_MKDIR);
+		nrm += (type == FAMFS_LOG_UNLINK || type == FAMFS_LOG_RMDIR);
+	}
+	if (!nrm)
+		return 0;
+
+	while (nslots < 2 * nrm)
+		nslots *= 2;
+	tbl = calloc(nslots, sizeof(*tbl));
+	if (!tbl)
+		return -ENOMEM;
 
-				el[j].famfs_extent_offset = tle[j].se.famfs_extent_offset;
-				el[j].famfs_extent_len    = tle[j].se.famfs_extent_len;
+	for (i = nents; i-- > 0; ) {
+		const struct famfs_log_entry *le = &ents[i];
+		const char *relpath;
+
+		type = le->famfs_log_entry_type;
+		relpath = (famfs_log_type_is_file(type)) ? (const char *)le->famfs_fc.famfs_relpath
+			: (const char *)le->famfs_md.famfs_relpath;
+		switch (type) {
+		case FAMFS_LOG_UNLINK:
+		case FAMFS_LOG_RMDIR:
+			type = (type == FAMFS_LOG_UNLINK) ? FAMFS_LOG_FILE : FAMFS_LOG_MKDIR;
+			famfs_compact_rm_slot(tbl, nslots, type, relpath, 1)->count++;
+			break;
+		case FAMFS_LOG_FILE:
+		case FAMFS_LOG_MKDIR:
+			rm = famfs_compact_rm_slot(tbl, nslots, type, relpath, 0);
+			if (rm && rm->count) {
+				rm->count--;
+				keep[i] = 0;
 			}
-			famfs_file_map_create(rpath, fd, fc->famfs_fc_size,
-					      fc->famfs_nextents, el, FAMFS_REG);
-			close(fd);
-			free(el);
-			ls.f_created++;
 			break;
 		}
-		case FAMFS_LOG_MKDIR: {
-			const struct famfs_mkdir *md = &le.famfs_md;
-			char fullpath[PATH_MAX];
-			char rpath[PATH_MAX];
-			int skip_dir = 0;
-			struct stat st;
+	}
+	free(tbl);
+	return 0;
+}
 
-			ls.d_logged++;
+/**
+ * famfs_log_compact()
+ *
+ * Write everything that has been logged (the current snapshot plus all log entries,
+ * including those in log segments) into a new snapshot in the other snapshot slot,
+ * and publish it along with an empty log. Files and directories that have been
+ * removed are left out. Sequence numbers are not reset, so readers can tell which
+ * entries they have already applied.
+ *
+ * @lp - locked log (no transaction may be open)
+ *
+ * Returns 0 on success, -ENOSPC if the snapshot does not fit in a slot, -1 if the
+ * log or the current snapshot is not valid. The log is untouched on failure.
+ */
+int
+famfs_log_compact(struct famfs_locked_log *lp, int verbose)
+{
+	const struct famfs_snap_rec *rec = NULL;
+	const struct famfs_log_entry *lep;
+	struct famfs_log *logp = lp->logp;
+	struct famfs_log_entry *ents = NULL;
+	u64 nents = 0, maxents = 0;
+	struct famfs_log_cursor lc;
+	const struct famfs_snap *cur;
+	struct famfs_log_entry le;
+	struct famfs_snap *snap;
+	u64 next_seqnum;
+	u8 *keep = NULL;
+	u64 new_slot;
+	u64 i;
+	int rc;
 
-			if (!famfs_log_entry_md_path_is_relative(md) || mock_path) {
-				fprintf(stderr,
-					"%s: ignoring log mkdir entry; path is not relative\n",
-					__func__);
-				ls.d_errs++;
-				skip_dir++;
-			}
+	assert(!lp->txn_active);
 
-			if (skip_dir)
-				continue;
+	if (!logp->famfs_log_snap_offset) {
+		fprintf(stderr, "%s: log has no snapshot region\n", __func__);
+		return -1;
+	}
+	if (logp->famfs_log_next_index == 0) {
+		if (verbose)
+			printf("%s: log is empty; nothing to compact\n", __func__);
+		return 0;
+	}
+	if (famfs_log_get_snapshot(logp, &cur))
+		return -1;
 
-			if (verbose)
-				printf("%s mkdir: %o %d:%d: %s \n", __func__,
-				       md->fc_mode, md->fc_uid, md->fc_gid, md->famfs_relpath);
+	rc = -ENOMEM;
+	while (cur && (rec = famfs_snap_next(cur, rec))) {
+		famfs_snap_rec_to_log_entry(rec, &le);
+		if (famfs_logplay_ents_append(&ents, &nents, &maxents, &le))
+			goto out;
+	}
+	/* We own the log (and validated its header when it was locked) */
+	famfs_log_cursor_at(&lc, logp, 0, logp->famfs_log_snap_seqnum,
+			    logp->famfs_log_next_index);
+	while ((lep = famfs_log_cursor_next(&lc))) {
+		if (famfs_logplay_ents_append(&ents, &nents, &maxents, lep))
+			goto out;
+	}
+	rc = -1;
+	if (lc.invalid)
+		goto out;
 
-			snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, md->famfs_relpath);
-			realpath(fullpath, rpath);
-			if (dry_run)
-				continue;
+	keep = calloc(nents + 1, 1);
+	if (!keep || famfs_compact_drop_removed(ents, nents, keep)) {
+		rc = -ENOMEM;
+		goto out;
+	}
 
-			rc = stat(rpath, &st);
-			if (!rc) {
-				switch (st.st_mode & S_IFMT) {
-				case S_IFDIR:
-					/* This is normal for log replay */
-					if (verbose > 1) {
-						fprintf(stderr,
-							"famfs logplay: directory %s exists\n",
-							rpath);
-						ls.d_existed++;
-					}
-					break;
+	new_slot = (cur) ? !logp->famfs_log_snap_slot : 0;
+	snap = famfs_log_snap_slot(logp, new_slot);
+	memset(snap, 0, sizeof(*snap));
+	for (i = 0; i < nents; i++) {
+		if (!keep[i])
+			continue;
+		rc = famfs_snap_append(snap, logp->famfs_log_snap_len, &ents[i]);
+		if (rc)
+			goto full;
+	}
 
-				case S_IFREG:
-					fprintf(stderr,
-						"%s: file (%s) exists where dir should be\n",
-						__func__, rpath);
-					ls.d_errs++;
-					break;
+	next_seqnum = lc.seqnum; /* The cursor went on into the segments, if any */
+	assert(next_seqnum == lp->tail->famfs_log_next_seqnum);
+	snap->fs_magic  = FAMFS_SNAP_MAGIC;
+	snap->fs_seqnum = next_seqnum;
+	snap->fs_crc    = famfs_gen_snap_crc(snap, famfs_log_csum_alg(logp));
+	flush_processor_cache(snap, sizeof(*snap) + snap->fs_len);
+	__sync_synchronize(); /* The snapshot must be in memory before it is published */
 
-				default:
-					fprintf(stderr,
-						"%s: something (%s) exists where dir should be\n",
-						__func__, rpath);
-					ls.d_errs++;
-					break;
-				}
-				continue;
-			}
+	/* Publish: all of these are in the log header cache line */
+	famfs_log_write_begin(logp);
+	logp->famfs_log_next_seqnum = next_seqnum;
+	logp->famfs_log_next_index  = 0;
+	logp->famfs_log_snap_slot   = new_slot;
+	logp->famfs_log_snap_seqnum = next_seqnum;
+	flush_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_PUBLISHED_BYTES);
+	famfs_log_write_end(logp);
 
-			if (verbose)
-				printf("famfs logplay: creating directory %s\n", md->famfs_relpath);
+	/* Segments stay linked, and are reused when the log fills up again */
+	lp->tail = logp;
 
-			rc = famfs_dir_create(mpt, (char *)md->famfs_relpath, md->fc_mode,
-					      md->fc_uid, md->fc_gid);
-			if (rc) {
-				fprintf(stderr,
-					"%s: error: unable to create directory (%s)\n",
-					__func__, md->famfs_relpath);
-				ls.d_errs++;
-				continue;
-			}
+	/* An index that is behind could miss removals that are no longer in the log */
+	famfs_index_free(lp->index);
+	lp->index = NULL;
 
-			ls.d_created++;
-			break;
-		}
-		case FAMFS_LOG_ACCESS:
-		default:
-			if (verbose)
-				printf("%s: invalid log entry\n", __func__);
-			break;
-		}
-	}
-	famfs_print_log_stats("famfs_logplay", &ls, verbose);
+	if (verbose)
+		printf("%s: snapshot at seqnum %lld: %lld files, %lld dirs, %lld bytes (slot %lld)\n",
+		       __func__, next_seqnum, snap->fs_nfiles, snap->fs_ndirs,
+		       snap->fs_len, new_slot);
+	rc = 0;
+	goto out;
 
-	return (ls.f_errs + ls.d_errs);
+full:
+	fprintf(stderr, "%s: snapshot does not fit in %lld bytes\n", __func__,
+		logp->famfs_log_snap_len);
+out:
+	free(keep);
+	free(ents);
+	return rc;
 }
 
 /**
- * famfs_logplay()
+ * famfs_compact()
  *
- * Outer function to play the log for a famfs file system
+ * Compact the log of a famfs file system (master only)
  *
- * @fspath      - mount point, or any path within the famfs file system
- * @use_mmap    - Use mmap rather than reading the log into a buffer
- * @dry_run     - process the log but don't create the files & directories
- * @client_mode - for testing; play the log as if this is a client node, even on master
- * @verbose
+ * @fspath - mount point, or any path within the famfs file system
  */
 int
-famfs_logplay(
-	const char             *fspath,
-	int                     use_mmap,
-	int                     dry_run,
-	int                     client_mode,
-	int                     verbose)
+famfs_compact(const char *fspath, int verbose)
 {
-	char mpt_out[PATH_MAX];
-	struct famfs_log *logp;
-	size_t log_size;
-	int lfd;
+	struct famfs_locked_log ll;
 	int rc;
 
-	lfd = open_log_file_read_only(fspath, &log_size, mpt_out, NO_LOCK);
-	if (lfd < 0) {
-		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
-			__func__, fspath);
+	rc = famfs_init_locked_log(&ll, fspath, verbose);
+	if (rc)
+		return rc;
+
+	rc = famfs_log_compact(&ll, verbose);
+
+	famfs_release_locked_log(&ll);
+	return rc;
+}
+
+/**
+ * famfs_log_convert_v2()
+ *
+ * Convert a log in place from the fixed-size entry format (v1) to packed variable-length
+ * records (log format v2). Sequence numbers and the snapshot are preserved. The caller
+ * must hold the log lock; clients pick up the converted log at their next logplay,
+ * which will be a full replay because the log header changes.
+ *
+ * @logp - the log
+ *
+ * Returns 0 on success (including if the log is already v2), -1 if the log is not
+ * valid. The log is untouched on failure.
+ */
+int
+famfs_log_convert_v2(struct famfs_log *logp, int verbose)
+{
+	u64 last_index = logp->famfs_log_last_index;
+	struct famfs_log_entry *old;
+	u64 nentries, area;
+	u64 pos, next_pos;
+	u64 i;
+	int rc = 0;
+
+	if (famfs_validate_log_header(logp))
+		return -1;
+	if (famfs_log_is_v2(logp)) {
+		if (verbose)
+			printf("%s: log is already in format v2\n", __func__);
+		return 0;
+	}
+	if (!logp->famfs_log_snap_offset) {
+		fprintf(stderr, "%s: log has no snapshot region\n", __func__);
+		return -1;
+	}
+	if (logp->famfs_log_next_seg_offset) {
+		fprintf(stderr, "%s: log has segments, which cannot be converted\n", __func__);
 		return -1;
 	}
 
-	if (use_mmap) {
-		logp = mmap(0, log_size, PROT_READ, MAP_PRIVATE, lfd, 0);
-		if (logp == MAP_FAILED) {
-			fprintf(stderr, "%s: failed to mmap log file %s/.meta/log\n",
-				__func__, mpt_out);
-			close(lfd);
+	nentries = logp->famfs_log_next_index;
+	old = calloc(nentries + 1, sizeof(*old));
+	if (!old)
+		return -1;
+	for (i = 0; i < nentries; i++) {
+		old[i] = logp->entries[i];
+		if (famfs_validate_log_entry(&old[i], logp->famfs_log_snap_seqnum + i)) {
+			fprintf(stderr, "%s: invalid log entry at index %lld\n", __func__, i);
+			free(old);
 			return -1;
-		}
-		/* Note that this dereferences logp to get the length, and then invalidates the
-		 * cache. I think this is ok...
-		 */
-		invalidate_processor_cache(logp, logp->famfs_log_len);
-	} else {
-		size_t resid = 0;
-		size_t total = 0;
-		char *buf;
-
-		/* XXX: Hmm, not sure how to invalidate the processor cache before a posix read.
-		 * default is mmap; posix read may not work correctly for non-cache-coherent configs
-		 */
-		/* Get log via posix read */
-		logp = malloc(log_size);
-		if (!logp) {
-			close(lfd);
-			fprintf(stderr, "%s: malloc %ld failed for log\n", __func__, log_size);
-			return -ENOMEM;
-		}
-		resid = log_size;
-		buf = (char *)logp;
-		do {
-			rc = read(lfd, &buf[total], resid);
-			if (rc < 0) {
-				fprintf(stderr, "%s: error %d reading log file\n",
-					__func__, errno);
-				return -errno;
-			}
-			printf("%s: read %d bytes of log\n", __func__, rc);
-			if (rc == 0)
-				goto err_out; /* if we didn't get the whole log, err out */
-			resid -= rc;
-			total += rc;
-		} while (resid > 0);
+		}
 	}
 
-	rc = __famfs_logplay(logp, mpt_out, dry_run, client_mode, verbose);
-err_out:
-	if (use_mmap)
-		munmap(logp, log_size);
-	else
-		free(logp);
-	close(lfd);
-	return rc;
-}
+	/* The record area is the same space that held the v1 entries */
+	area = logp->famfs_log_snap_offset - offsetof(struct famfs_log, entries);
+	famfs_log_write_begin(logp);
+	memset(logp->entries, 0, area);
+	logp->famfs_log_magic = FAMFS_LOG_MAGIC_V2;
+	logp->famfs_log_last_index = area - 1;
 
-/********************************************************************************
- *
- * Log maintenance / append
- */
+	for (i = 0, pos = 0; i < nentries; i++, pos = next_pos) {
+		rc = famfs_log_put_entry(logp, pos, &old[i], old[i].famfs_log_entry_seqnum,
+					 &next_pos);
+		if (rc)
+			break;
+	}
+	if (rc) {
+		/* Can't happen (records are never bigger than entries); put it back */
+		fprintf(stderr, "%s: converted log does not fit\n", __func__);
+		memset(logp->entries, 0, area);
+		logp->famfs_log_magic = FAMFS_LOG_MAGIC;
+		logp->famfs_log_last_index = last_index;
+		memcpy(logp->entries, old, nentries * sizeof(*old));
+		flush_processor_cache(logp->entries, area);
+		famfs_log_write_end(logp);
+		free(old);
+		return -1;
+	}
+	logp->famfs_log_next_index = pos;
+	logp->famfs_log_crc = famfs_gen_log_header_crc(logp, famfs_log_csum_alg(logp));
+	flush_processor_cache(logp, logp->famfs_log_snap_offset);
+	famfs_log_write_end(logp);
+
+	if (verbose)
+		printf("%s: converted %lld entries: %lld bytes of records (was %lld)\n",
+		       __func__, nentries, pos, nentries * sizeof(*old));
+	free(old);
+	return 0;
+}
 
 /**
- * famfs_append_log()
+ * famfs_logconvert()
  *
- * @logp - pointer to struct famfs_log in memory media
- * @e    - pointer to log entry in memory
+ * Convert the log of a famfs file system to log format v2 (master only)
  *
- * NOTE: this function is not re-entrant. Must hold a lock or mutex when calling this
- * function if there is any chance of re-entrancy.
+ * @fspath - mount point, or any path within the famfs file system
  */
-static int
-famfs_append_log(struct famfs_log       *logp,
-		 struct famfs_log_entry *e)
+int
+famfs_logconvert(const char *fspath, int verbose)
 {
-	assert(logp);
-	assert(e);
-
-	/* XXX This function is not re-entrant */
-
-	e->famfs_log_entry_seqnum = logp->famfs_log_next_seqnum;
-	e->famfs_log_entry_crc = famfs_gen_log_entry_crc(e);
-
-	memcpy(&logp->entries[logp->famfs_log_next_index], e, sizeof(*e));
+	struct famfs_locked_log ll;
+	int rc;
 
-	logp->famfs_log_next_seqnum++;
-	logp->famfs_log_next_index++;
+	rc = famfs_init_locked_log(&ll, fspath, verbose);
+	if (rc)
+		return rc;
 
-	/* Could flush: 1) the log entry, 2) the log header
-	 * That would be less flushing, but would not guarantee that the entry is visible
-	 * before the log header. If the log header becomes visible first (leading to
-	 * reading a cache-incoherent log entry), the checksum on the log entry will
-	 * save us - and the logplay can be retried.
-	 *
-	 * But now we're just flushing the whole log every time...
-	 */
-	flush_processor_cache(logp, logp->famfs_log_len);
+	rc = famfs_log_convert_v2(ll.logp, verbose);
 
-	return 0;
+	famfs_release_locked_log(&ll);
+	return rc;
 }
 
-
 /**
  * famfs_relpath_from_fullpath()
  *
@@ -1724,7 +5577,7 @@ famfs_relpath_from_fullpath(
  */
 static int
 famfs_log_file_creation(
-	struct famfs_log           *logp,
+	struct famfs_locked_log    *lp,
 	u64                         nextents,
 	struct famfs_simple_extent *ext_list,
 	const char                 *relpath,
@@ -1737,17 +5590,11 @@ famfs_log_file_creation(
 	struct famfs_file_creation *fc = &le.famfs_fc;
 	int i;
 
-	assert(logp);
+	assert(lp);
 	assert(ext_list);
 	assert(nextents >= 1);
 	assert(relpath[0] != '/');
 
-	if (famfs_log_full(logp)) {
-		fprintf(stderr, "%s: log full\n", __func__);
-		//assert(0);
-		return -ENOMEM;
-	}
-
 	le.famfs_log_entry_type = FAMFS_LOG_FILE;
 
 	fc->famfs_fc_size = size;
@@ -1769,7 +5616,7 @@ famfs_log_file_creation(
 		ext->se.famfs_extent_len    = ext_list[i].famfs_extent_len;
 	}
 
-	return famfs_append_log(logp, &le);
+	return famfs_append_log(lp, &le);
 }
 
 /**
@@ -1778,10 +5625,9 @@ famfs_log_file_creation(
 /* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
  * conversion itself. Then pretty much all calls would use the same stuff.
  */
-/* XXX should take famfs_locked_log struct as input */
 static int
 famfs_log_dir_creation(
-	struct famfs_log           *logp,
+	struct famfs_locked_log    *lp,
 	const char                 *relpath,
 	mode_t                      mode,
 	uid_t                       uid,
@@ -1790,15 +5636,9 @@ famfs_log_dir_creation(
 	struct famfs_log_entry le = {0};
 	struct famfs_mkdir *md = &le.famfs_md;
 
-	assert(logp);
+	assert(lp);
 	assert(relpath[0] != '/');
 
-	if (famfs_log_full(logp)) {
-		fprintf(stderr, "%s: log full\n", __func__);
-		//assert(0);
-		return -ENOMEM;
-	}
-
 	le.famfs_log_entry_type = FAMFS_LOG_MKDIR;
 
 	strncpy((char *)md->famfs_relpath, relpath, FAMFS_MAX_PATHLEN - 1);
@@ -1807,7 +5647,7 @@ famfs_log_dir_creation(
 	md->fc_uid  = uid;
 	md->fc_gid  = gid;
 
-	return famfs_append_log(logp, &le);
+	return famfs_append_log(lp, &le);
 }
 
 /**
@@ -2048,7 +5888,7 @@ famfs_map_superblock_by_path(
 		return NULL;
 	}
 	sb = (struct famfs_superblock *)addr;
-	flush_processor_cache(sb, sb_size); /* invalidate processor cache */
+	invalidate_processor_cache(sb, sb_size);
 	return sb;
 }
 
@@ -2056,6 +5896,7 @@ static struct famfs_log *
 famfs_map_log_by_path(
 	const char *path,
 	int         read_only,
+	char       *mpt_out,
 	enum lock_opt lockopt)
 {
 	struct famfs_log *logp;
@@ -2067,7 +5908,7 @@ famfs_map_log_by_path(
 	/* XXX: the open is always read-only, but the mmap is sometimes writable;
 	 * Why does this work ?!
 	 */
-	fd = __open_log_file(path, 1 /* read only */, &log_size, NULL, lockopt);
+	fd = __open_log_file(path, 1 /* read only */, &log_size, mpt_out, lockopt);
 	if (fd < 0) {
 		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
 			__func__, path);
@@ -2089,7 +5930,7 @@ famfs_map_log_by_path(
 		munmap(addr, log_size);
 		return NULL;
 	}
-	flush_processor_cache(logp, log_size);  /* invalidate processor cache */
+	invalidate_processor_cache(logp, log_size);
 	return logp;
 }
 
@@ -2102,6 +5943,7 @@ famfs_fsck(
 {
 	struct famfs_superblock *sb = NULL;
 	struct famfs_log *logp = NULL;
+	char mpt[PATH_MAX] = { 0 };
 	struct stat st;
 	size_t size;
 	int rc;
@@ -2145,6 +5987,8 @@ famfs_fsck(
 		rc = famfs_mmap_superblock_and_log_raw(path, &sb, &logp,
 						       0 /* figure out log size */,
 						       1 /* read-only */);
+		if (rc == 0 && famfs_log_attach(logp, path, 1 /* raw */, 0))
+			return -1;
 		break;
 	}
 	case S_IFREG:
@@ -2168,7 +6012,7 @@ famfs_fsck(
 				return -1;
 			}
 
-			logp = famfs_map_log_by_path(path, 1 /* read only */, NO_LOCK);
+			logp = famfs_map_log_by_path(path, 1 /* read only */, mpt, NO_LOCK);
 			if (!logp) {
 				fprintf(stderr, "%s: failed to map log from file %s\n",
 					__func__, path);
@@ -2208,7 +6052,7 @@ famfs_fsck(
 			}
 			close(sfd);
 
-			lfd = open_log_file_read_only(path, NULL, NULL, NO_LOCK);
+			lfd = open_log_file_read_only(path, NULL, mpt, NO_LOCK);
 			if (lfd < 0 || mock_failure == MOCK_FAIL_OPEN_LOG) {
 				free(sb);
 				close(sfd);
@@ -2259,7 +6103,11 @@ famfs_fsck(
 		fprintf(stderr, "%s: no valid famfs superblock on device %s\n", __func__, path);
 		return -1;
 	}
+	/* Segments are mapped from the device or from the log segment files */
+	if (mpt[0] && famfs_log_attach(logp, mpt, 0, 0))
+		return -1;
 	rc = famfs_fsck_scan(sb, logp, human, verbose);
+	famfs_log_detach(logp);
 	if (!use_mmap && sb)
 		free(sb);
 	if (!use_mmap && logp)
@@ -2273,11 +6121,12 @@ err_out:
  * famfs_validate_superblock_by_path()
  *
  * @path
+ * @sb_flags_out - if non-NULL, receives ts_sb_flags
  *
  * Validate the superblock and return the dax device size, or -1 if sb or size invalid
  */
 static ssize_t
-famfs_validate_superblock_by_path(const char *path)
+famfs_validate_superblock_by_path(const char *path, u32 *sb_flags_out)
 {
 	int sfd;
 	void *addr;
@@ -2305,40 +6154,149 @@ famfs_validate_superblock_by_path(const char *path)
 		return -1;
 	}
 	daxdevsize = sb->ts_devlist[0].dd_size;
+	if (sb_flags_out)
+		*sb_flags_out = sb->ts_sb_flags;
 	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
 	close(sfd);
 	return daxdevsize;
 }
 
+/* Format a df size in bytes, or in GiB if @human */
+static void
+famfs_df_size(char *buf, size_t len, u64 bytes, int human)
+{
+	if (human)
+		snprintf(buf, len, "%.2fG", (double)bytes / (1024.0 * 1024.0 * 1024.0));
+	else
+		snprintf(buf, len, "%lld", bytes);
+}
+
+/**
+ * famfs_df()
+ *
+ * Print the capacity of a mounted famfs file system, like df(1). This reads the
+ * counters that the master keeps in the log header (one cache line; see
+ * famfs_log_read_counters()), so it neither scans the log nor takes the log lock,
+ * and works on clients as well as the master.
+ *
+ * @path    - mount point, or any path in the file system
+ * @human   - sizes in GiB rather than bytes
+ * @verbose
+ */
+int
+famfs_df(const char *path, int human, int verbose)
+{
+	char size[32], used[32], avail[32];
+	struct famfs_log_counters c;
+	struct famfs_superblock *sb;
+	char mpt[PATH_MAX] = { 0 };
+	char dev[FAMFS_DEVNAME_LEN + 1] = { 0 };
+	u64 alloc_unit, capacity;
+	struct famfs_log *logp;
+	void *addr;
+	int lfd;
+	int rc;
+
+	sb = famfs_map_superblock_by_path(path, 1 /* read only */);
+	if (!sb)
+		return -1;
+	invalidate_processor_cache(sb, sizeof(*sb));
+	if (famfs_check_super(sb)) {
+		fprintf(stderr, "%s: invalid superblock\n", __func__);
+		munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+		return -1;
+	}
+	alloc_unit = famfs_sb_alloc_unit(sb->ts_sb_flags);
+	capacity = famfs_alloc_units(sb->ts_devlist[0].dd_size, alloc_unit) * alloc_unit;
+	strncpy(dev, sb->ts_devlist[0].dd_daxdev, FAMFS_DEVNAME_LEN);
+	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+
+	/* Only the log header is needed */
+	lfd = open_log_file_read_only(path, NULL, mpt, NO_LOCK);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: failed to open log file\n", __func__);
+		return -1;
+	}
+	addr = mmap(0, sizeof(*logp), PROT_READ, MAP_SHARED, lfd, 0);
+	close(lfd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: failed to mmap log header\n", __func__);
+		return -1;
+	}
+	logp = (struct famfs_log *)addr;
+	rc = famfs_log_read_counters(logp, &c);
+	munmap(addr, sizeof(*logp));
+	if (rc == -ENODATA) {
+		fprintf(stderr, "%s: no capacity counters yet (the master computes them the "
+			"next time it updates the log); famfs fsck reports the space in use\n",
+			__func__);
+		return rc;
+	}
+	if (rc)
+		return rc;
+
+	c.alloc_bytes = MIN(c.alloc_bytes, capacity);
+	famfs_df_size(size, sizeof(size), capacity, human);
+	famfs_df_size(used, sizeof(used), c.alloc_bytes, human);
+	famfs_df_size(avail, sizeof(avail), capacity - c.alloc_bytes, human);
+	printf("%-16s %14s %14s %14s %5s %10s %10s %s\n", "Filesystem", "Size", "Used",
+	       "Avail", "Use%", "Files", "Dirs", "Mounted on");
+	printf("%-16s %14s %14s %14s %4lld%% %10lld %10lld %s\n", dev, size, used, avail,
+	       (capacity) ? (c.alloc_bytes * 100 + capacity - 1) / capacity : 0,
+	       c.nfiles, c.ndirs, mpt);
+	if (verbose)
+		printf("(as of log seqnum %lld)\n", c.seqnum);
+	return 0;
+}
+
 /**
  * set_extent_in_bitmap() - Set bits for an allocation range
  */
-static inline u64 set_extent_in_bitmap(u8 *bitmap, u64 offset, u64 len, u64 *alloc_sum)
+static inline u64 set_extent_in_bitmap(u8 *bitmap, u64 unit, u64 offset, u64 len,
+					u64 *alloc_sum)
 {
-	u64 errors = 0;
+	u64 errors; /* bits that were already set */
 	u64 page_num;
 	u64 np;
-	int rc;
-	u64 k;
 
-	assert(!(offset & (FAMFS_ALLOC_UNIT  - 1)));
+	assert(!(offset & (unit - 1)));
 
-	page_num = offset / FAMFS_ALLOC_UNIT;
-	np = (len + FAMFS_ALLOC_UNIT - 1) / FAMFS_ALLOC_UNIT;
+	page_num = offset / unit;
+	np = famfs_alloc_units(len, unit);
 
-	for (k = page_num; k < (page_num + np); k++) {
-		rc = mu_bitmap_test_and_set(bitmap, k);
-		if (rc == 0) {
-			errors++; /* bit was already set */
-		} else {
-			/* Don't count double allocations */
-			if (alloc_sum)
-				*alloc_sum += FAMFS_ALLOC_UNIT;
-		}
-	}
+	errors = mu_bitmap_count_range(bitmap, page_num, np);
+	mu_bitmap_set_range(bitmap, page_num, np);
+
+	/* Don't count double allocations */
+	if (alloc_sum)
+		*alloc_sum += (np - errors) * unit;
 	return errors;
 }
 
+/**
+ * clear_extent_in_bitmap() - Clear the bits of a freed allocation range
+ *
+ * Returns the number of bits that were not set (which is an error)
+ */
+static inline u64 clear_extent_in_bitmap(u8 *bitmap, u64 unit, u64 offset, u64 len,
+					  u64 *alloc_sum)
+{
+	u64 page_num;
+	u64 np, nset;
+
+	assert(!(offset & (unit - 1)));
+
+	page_num = offset / unit;
+	np = famfs_alloc_units(len, unit);
+
+	nset = mu_bitmap_count_range(bitmap, page_num, np);
+	mu_bitmap_clear_range(bitmap, page_num, np);
+
+	if (alloc_sum)
+		*alloc_sum -= nset * unit;
+	return np - nset;
+}
+
 /**
  * put_sb_log_into_bitmap()
  *
@@ -2349,19 +6307,21 @@ static inline u64 set_extent_in_bitmap(u8 *bitmap, u64 offset, u64 len, u64 *all
  * @log_len - size of the log (superblock size is invariant)
  */
 static inline void
-put_sb_log_into_bitmap(u8 *bitmap, u64 log_len, u64 *alloc_sum)
+put_sb_log_into_bitmap(u8 *bitmap, u64 unit, u64 log_len, u64 *alloc_sum)
 {
-	set_extent_in_bitmap(bitmap, 0, FAMFS_SUPERBLOCK_SIZE + log_len, alloc_sum);
+	set_extent_in_bitmap(bitmap, unit, 0, FAMFS_SUPERBLOCK_SIZE + log_len, alloc_sum);
 }
 
 /**
  * famfs_build_bitmap()
  *
- * XXX: this is only aware of the first daxdev in the superblock's list
+ * Only the first daxdev in the superblock's list is supported (see famfs_check_super())
  * @logp
  * @size_in          - total size of allocation space in bytes
+ * @alloc_unit       - bytes per bit (see famfs_sb_alloc_unit())
  * @bitmap_nbits_out - output: size of the bitmap
  * @alloc_errors_out - output: number of times a file referenced a bit that was already set
+ *                    (or an unlinked file freed a bit that was not set)
  * @fsize_total_out  - output: if ptr non-null, this is the sum of the file sizes
  * @alloc_sum_out    - output: if ptr non-null, this is the sum of all allocation sizes
  *                    (excluding double-allocations; space amplification is
@@ -2374,6 +6334,7 @@ put_sb_log_into_bitmap(u8 *bitmap, u64 log_len, u64 *alloc_sum)
 static u8 *
 famfs_build_bitmap(const struct famfs_log   *logp,
 		   u64                       dev_size_in,
+		   u64                       alloc_unit,
 		   u64                      *bitmap_nbits_out,
 		   u64                      *alloc_errors_out,
 		   u64                      *fsize_total_out,
@@ -2381,15 +6342,19 @@ famfs_build_bitmap(const struct famfs_log   *logp,
 		   struct famfs_log_stats   *log_stats_out,
 		   int                       verbose)
 {
-	u64 nbits = (dev_size_in + FAMFS_ALLOC_UNIT - 1) / FAMFS_ALLOC_UNIT;
-	u64 bitmap_nbytes = mu_bitmap_size(nbits);
-	u8 *bitmap = calloc(1, bitmap_nbytes + 1); /* Note: mu_bitmap_foreach accesses
-						    * 1 bit past the end */
+	u64 nbits = famfs_alloc_units(dev_size_in, alloc_unit);
+	u64 bitmap_nbytes = mu_bitmap_alloc_size(nbits);
+	u8 *bitmap = calloc(1, bitmap_nbytes);
 	struct famfs_log_stats ls = { 0 }; /* We collect a subset of stats collected by logplay */
+	const struct famfs_snap_rec *rec = NULL;
+	const struct famfs_log_entry *le;
+	const struct famfs_log *seg;
+	const struct famfs_snap *snap;
+	struct famfs_log_cursor cur;
 	u64 errors = 0;
 	u64 alloc_sum = 0;
 	u64 fsize_sum  = 0;
-	u64 i, j;
+	u64 j;
 
 	if (verbose > 1)
 		printf("%s: dev_size %lld nbits %lld bitmap_nbytes %lld\n",
@@ -2398,16 +6363,37 @@ famfs_build_bitmap(const struct famfs_log   *logp,
 	if (!bitmap)
 		return NULL;
 
-	put_sb_log_into_bitmap(bitmap, logp->famfs_log_len, &alloc_sum);
+	put_sb_log_into_bitmap(bitmap, alloc_unit, logp->famfs_log_len, &alloc_sum);
 
-	/* This loop is over all log entries */
-	for (i = 0; i < logp->famfs_log_next_index; i++) {
-		const struct famfs_log_entry *le = &logp->entries[i];
+	/* Files that have been compacted into the snapshot */
+	if (famfs_log_get_snapshot(logp, &snap)) {
+		fprintf(stderr, "%s: invalid snapshot; allocations are unknown\n", __func__);
+		free(bitmap);
+		return NULL;
+	}
+	while (snap && (rec = famfs_snap_next(snap, rec))) {
+		ls.n_snap++;
+		if (rec->sr_type == FAMFS_LOG_MKDIR) {
+			ls.d_logged++;
+			continue;
+		}
+		ls.f_logged++;
+		fsize_sum += rec->sr_size;
+		for (j = 0; j < rec->sr_nextents; j++)
+			errors += set_extent_in_bitmap(bitmap, alloc_unit,
+						       rec->sr_ext[j].famfs_extent_offset,
+						       rec->sr_ext[j].famfs_extent_len,
+						       &alloc_sum);
+	}
 
+	/* This loop is over all log entries */
+	if (famfs_log_cursor_init(&cur, logp, logp->famfs_log_snap_seqnum)) {
+		free(bitmap);
+		return NULL;
+	}
+	while ((le = famfs_log_cursor_next(&cur))) {
 		ls.n_entries++;
 
-		/* TODO: validate log sequence number */
-
 		switch (le->famfs_log_entry_type) {
 		case FAMFS_LOG_FILE: {
 			const struct famfs_file_creation *fc = &le->famfs_fc;
@@ -2425,83 +6411,495 @@ famfs_build_bitmap(const struct famfs_log   *logp,
 				u64 len = ext[j].se.famfs_extent_len;
 				int rc;
 
-				assert(!(ofs % FAMFS_ALLOC_UNIT));
+				assert(!(ofs % alloc_unit));
+
+				rc = set_extent_in_bitmap(bitmap, alloc_unit, ofs, len, &alloc_sum);
+				errors += rc;
+				ls.last_alloc_end = ofs + len;
+			}
+			break;
+		}
+		case FAMFS_LOG_MKDIR:
+			ls.d_logged++;
+			/* Ignore directory log entries - no space is used */
+			break;
+
+		case FAMFS_LOG_UNLINK: {
+			const struct famfs_file_creation *fc = &le->famfs_fc;
+			const struct famfs_log_extent *ext = fc->famfs_ext_list;
+
+			ls.f_unlinked++;
+			fsize_sum -= MIN(fsize_sum, fc->famfs_fc_size);
+			if (verbose > 1)
+				printf("%s: unlink file=%s size=%lld\n", __func__,
+				       fc->famfs_relpath, fc->famfs_fc_size);
+
+			for (j = 0; j < fc->famfs_nextents; j++)
+				errors += clear_extent_in_bitmap(bitmap, alloc_unit,
+								 ext[j].se.famfs_extent_offset,
+								 ext[j].se.famfs_extent_len,
+								 &alloc_sum);
+			break;
+		}
+		case FAMFS_LOG_RMDIR:
+			ls.d_rmdirs++;
+			break;
+
+		case FAMFS_LOG_ACCESS:
+		default:
+			printf("%s: invalid log entry\n", __func__);
+			break;
+		}
+	}
+	if (cur.invalid)
+		errors++; /* Nothing past an invalid entry can be trusted */
+	ls.next_seqnum = cur.seqnum;
+
+	/*
+	 * Space that is not logged goes in last: it may have been allocated from a file
+	 * that was removed, and the file's creation and removal must not clear it
+	 */
+	if (logp->famfs_log_bmap_offset)
+		errors += set_extent_in_bitmap(bitmap, alloc_unit, logp->famfs_log_bmap_offset,
+					       logp->famfs_log_bmap_len, &alloc_sum);
+
+	/* Log segments, including segments that are only linked for reuse after compaction */
+	for (seg = logp; seg->famfs_log_next_seg_offset; ) {
+		errors += set_extent_in_bitmap(bitmap, alloc_unit, seg->famfs_log_next_seg_offset,
+					       seg->famfs_log_next_seg_len, &alloc_sum);
+		ls.n_segs++;
+		ls.seg_bytes += seg->famfs_log_next_seg_len;
+		seg = famfs_log_linked_seg(seg);
+		if (!seg) {
+			errors++; /* Allocations in the rest of the chain are unknown */
+			break;
+		}
+	}
+	if (verbose > 1) {
+		mu_print_bitmap(bitmap, nbits);
+	}
+	if (bitmap_nbits_out)
+		*bitmap_nbits_out = nbits;
+	if (alloc_errors_out)
+		*alloc_errors_out = errors;
+	if (fsize_total_out)
+		*fsize_total_out = fsize_sum;
+	if (alloc_sum_out)
+		*alloc_sum_out = alloc_sum;
+	if (log_stats_out)
+		memcpy(log_stats_out, &ls, sizeof(ls));
+	return bitmap;
+}
+
+/**
+ * famfs_bmap_ckpt_load()
+ *
+ * Rebuild an allocation bitmap from a checkpoint: copy the checkpointed bitmap, then
+ * fold in the log entries appended after it
+ *
+ * @logp        - the log
+ * @ck          - the checkpoint (see famfs_bmap_ckpt_map())
+ * @ck_len      - size of its extent
+ * @alloc_unit  - bytes per bit; the checkpoint must have been saved with the same
+ * @nbits       - ...and the same number of bits
+ * @bitmap      - receives the bitmap (mu_bitmap_alloc_size(@nbits) bytes)
+ * @cur_pos_out - optional: the next fit cursor
+ * @nfolded_out - optional: number of log entries folded in
+ * @verbose
+ *
+ * Returns 0, or -1 if the checkpoint is invalid or stale (build the bitmap from the log)
+ */
+static int
+famfs_bmap_ckpt_load(
+	const struct famfs_log       *logp,
+	const struct famfs_bmap_ckpt *ck,
+	u64                           ck_len,
+	u64                           alloc_unit,
+	u64                           nbits,
+	u8                           *bitmap,
+	u64                          *cur_pos_out,
+	u64                          *nfolded_out,
+	int                           verbose)
+{
+	enum famfs_csum_alg alg = famfs_log_csum_alg(logp);
+	u64 nbytes = mu_bitmap_alloc_size(nbits);
+	const struct famfs_log_entry *le;
+	const struct famfs_log *seg;
+	struct famfs_log_cursor cur;
+	u64 cur_pos, nfolded = 0;
+	u64 errors = 0;
+	u32 crc;
+	u64 j;
+
+	if (ck->bc_magic != FAMFS_BMAP_MAGIC || ck->bc_alloc_unit != alloc_unit
+	    || ck->bc_nbits != nbits || sizeof(*ck) + nbytes > ck_len) {
+		if (verbose)
+			printf("%s: no checkpoint for this geometry\n", __func__);
+		return -1;
+	}
+	crc = famfs_csum(alg, 0, ck, offsetof(struct famfs_bmap_ckpt, bc_crc));
+	crc = famfs_csum(alg, crc, ck->bc_bitmap, nbytes);
+	if (ck->bc_crc != FAMFS_CSUM_VAL(alg, crc)) {
+		if (verbose)
+			printf("%s: checkpoint crc is bad\n", __func__);
+		return -1;
+	}
+	invalidate_processor_cache(logp, sizeof(*logp));
+	if (ck->bc_seqnum < logp->famfs_log_snap_seqnum) {
+		if (verbose)
+			printf("%s: checkpoint (seqnum %lld) predates the snapshot\n",
+			       __func__, ck->bc_seqnum);
+		return -1;
+	}
+
+	memcpy(bitmap, ck->bc_bitmap, nbytes);
+	cur_pos = ck->bc_cur_pos;
+	if (famfs_log_cursor_init(&cur, logp, ck->bc_seqnum))
+		return -1;
+	while ((le = famfs_log_cursor_next(&cur))) {
+		const struct famfs_file_creation *fc = &le->famfs_fc;
+		const struct famfs_log_extent *ext = fc->famfs_ext_list;
+
+		nfolded++;
+		if (!famfs_log_type_is_file(le->famfs_log_entry_type))
+			continue;
+		for (j = 0; j < fc->famfs_nextents; j++) {
+			u64 ofs = ext[j].se.famfs_extent_offset;
+			u64 len = ext[j].se.famfs_extent_len;
+
+			if (le->famfs_log_entry_type == FAMFS_LOG_FILE) {
+				errors += set_extent_in_bitmap(bitmap, alloc_unit, ofs, len, NULL);
+				cur_pos = (ofs + len) / alloc_unit;
+			} else {
+				errors += clear_extent_in_bitmap(bitmap, alloc_unit, ofs, len, NULL);
+			}
+		}
+	}
+	if (cur.invalid || errors) {
+		if (verbose)
+			printf("%s: log entries after the checkpoint do not fold into it\n",
+			       __func__);
+		return -1;
+	}
+
+	/* Space that is not logged, which a master that died may have linked since */
+	put_sb_log_into_bitmap(bitmap, alloc_unit, logp->famfs_log_len, NULL);
+	set_extent_in_bitmap(bitmap, alloc_unit, logp->famfs_log_bmap_offset,
+			     logp->famfs_log_bmap_len, NULL);
+	for (seg = logp; seg && seg->famfs_log_next_seg_offset; seg = famfs_log_linked_seg(seg))
+		set_extent_in_bitmap(bitmap, alloc_unit, seg->famfs_log_next_seg_offset,
+				     seg->famfs_log_next_seg_len, NULL);
+
+	if (cur_pos_out)
+		*cur_pos_out = MIN(cur_pos, nbits);
+	if (nfolded_out)
+		*nfolded_out = nfolded;
+	return 0;
+}
+
+/**
+ * famfs_bmap_ckpt_check()
+ *
+ * fsck: cross-check the bitmap checkpoint (with the entries after it folded in)
+ * against @bitmap, which was built from the whole log
+ *
+ * Returns 1 if they differ; 0 if they match, or there is no valid checkpoint (which
+ * only means the next master builds the bitmap from the log)
+ */
+static int
+famfs_bmap_ckpt_check(
+	const struct famfs_log *logp,
+	const u8               *bitmap,
+	u64                     alloc_unit,
+	u64                     nbits,
+	int                     verbose)
+{
+	u64 nbytes = mu_bitmap_alloc_size(nbits);
+	struct famfs_bmap_ckpt *ck;
+	u64 ck_len, nfolded;
+	u8 *ck_bitmap;
+	int rc = 0;
+
+	if (!logp->famfs_log_bmap_offset)
+		return 0;
+	ck = famfs_bmap_ckpt_map(logp, &ck_len);
+	if (!ck) {
+		printf("  bitmap checkpoint cannot be mapped\n");
+		return 0;
+	}
+	ck_bitmap = calloc(1, nbytes);
+	if (!ck_bitmap) {
+		munmap(ck, ck_len);
+		return 0;
+	}
+	if (famfs_bmap_ckpt_load(logp, ck, ck_len, alloc_unit, nbits, ck_bitmap,
+				 NULL, &nfolded, verbose)) {
+		printf("  bitmap checkpoint is invalid or stale (the master will rebuild it)\n");
+	} else if (memcmp(ck_bitmap, bitmap, nbytes)) {
+		printf("ERROR: BITMAP CHECKPOINT (SEQNUM %lld) DOES NOT MATCH THE LOG\n",
+		       ck->bc_seqnum);
+		rc = 1;
+	} else {
+		printf("  bitmap checkpoint at seqnum %lld (+%lld entries) matches the log\n",
+		       ck->bc_seqnum, nfolded);
+	}
+	free(ck_bitmap);
+	munmap(ck, ck_len);
+	return rc;
+}
+
+/**
+ * famfs_bmap_ckpt_save()
+ *
+ * Save the allocation bitmap of @lp as the checkpoint, allocating and linking the
+ * checkpoint extent the first time. Called when the log is released, after any open
+ * transaction was aborted, so the bitmap reflects exactly the published log.
+ *
+ * Returns 0, or -1 if no checkpoint was saved (the next master builds the bitmap
+ * from the log)
+ */
+static int
+famfs_bmap_ckpt_save(struct famfs_locked_log *lp)
+{
+	struct famfs_log *logp = lp->logp;
+	enum famfs_csum_alg alg = famfs_log_csum_alg(logp);
+	u64 nbytes = mu_bitmap_alloc_size(lp->nbits);
+	u64 cur_pos = lp->cur_pos;
+	struct famfs_bmap_ckpt *ck;
+	u64 len, ck_len;
+	s64 offset;
+	u32 crc;
+
+	if (!logp->famfs_log_bmap_offset) {
+		len = famfs_alloc_units(sizeof(*ck) + nbytes, lp->alloc_unit) * lp->alloc_unit;
+		offset = famfs_alloc_contiguous(lp, len, 0);
+		if (offset < 0) {
+			fprintf(stderr, "%s: no space for a %lld byte bitmap checkpoint\n",
+				__func__, len);
+			return -1;
+		}
+		lp->cur_pos = cur_pos; /* Not a file; don't move the next fit cursor */
+
+		famfs_log_write_begin(logp);
+		logp->famfs_log_bmap_offset = offset;
+		logp->famfs_log_bmap_len    = len;
+		flush_processor_cache(&logp->famfs_log_bmap_offset,
+				      2 * sizeof(logp->famfs_log_bmap_offset));
+		famfs_log_write_end(logp);
+		famfs_log_count_space(lp, len);
+	}
+
+	ck = famfs_bmap_ckpt_map(logp, &ck_len);
+	if (!ck)
+		return -1;
+	if (sizeof(*ck) + nbytes > ck_len) {
+		fprintf(stderr, "%s: bitmap checkpoint extent is too small\n", __func__);
+		munmap(ck, ck_len);
+		return -1;
+	}
+
+	stream_copy_to_memory(ck->bc_bitmap, lp->bitmap, nbytes);
+	ck->bc_magic      = FAMFS_BMAP_MAGIC;
+	ck->bc_seqnum     = lp->tail->famfs_log_next_seqnum;
+	ck->bc_alloc_unit = lp->alloc_unit;
+	ck->bc_nbits      = lp->nbits;
+	ck->bc_nfree      = lp->nbits - mu_bitmap_count_range(lp->bitmap, 0, lp->nbits);
+	ck->bc_cur_pos    = lp->cur_pos;
+	crc = famfs_csum(alg, 0, ck, offsetof(struct famfs_bmap_ckpt, bc_crc));
+	crc = famfs_csum(alg, crc, lp->bitmap, nbytes);
+	ck->bc_crc        = FAMFS_CSUM_VAL(alg, crc);
+	flush_processor_cache(ck, sizeof(*ck));
+	munmap(ck, ck_len);
+	return 0;
+}
+
+/* Start from the bitmap checkpoint, if there is a valid one; returns 0 if it was used */
+static int
+famfs_bmap_ckpt_use(struct famfs_locked_log *lp, int verbose)
+{
+	u64 nbits = famfs_alloc_units(lp->devsize, lp->alloc_unit);
+	struct famfs_bmap_ckpt *ck;
+	u64 ck_len, nfolded;
+	u8 *bitmap;
+	int rc = -1;
+
+	ck = famfs_bmap_ckpt_map(lp->logp, &ck_len);
+	if (!ck)
+		return -1;
+	bitmap = calloc(1, mu_bitmap_alloc_size(nbits));
+	if (bitmap)
+		rc = famfs_bmap_ckpt_load(lp->logp, ck, ck_len, lp->alloc_unit, nbits, bitmap,
+					  &lp->cur_pos, &nfolded, verbose);
+	munmap(ck, ck_len);
+	if (rc) {
+		free(bitmap);
+		return -1;
+	}
+	if (verbose)
+		printf("%s: bitmap checkpoint plus %lld log entries\n", __func__, nfolded);
+	lp->bitmap = bitmap;
+	lp->nbits = nbits;
+	lp->bitmap_ckpt_used = 1;
+	return 0;
+}
 
-				rc = set_extent_in_bitmap(bitmap, ofs, len, &alloc_sum);
-				errors += rc;
-			}
-			break;
-		}
-		case FAMFS_LOG_MKDIR:
-			ls.d_logged++;
-			/* Ignore directory log entries - no space is used */
-			break;
+/**
+ * famfs_log_counters_sync()
+ *
+ * Bring the capacity counters in the log header up to the end of the log. They lag
+ * it if a master died between publishing entries in a segment and publishing the
+ * counters; the entries since are folded in. File systems made before the counters
+ * existed (or whose counters are behind a compaction, or were computed with another
+ * allocation unit) get them recomputed from the whole log.
+ *
+ * @lp      - locked log; lp->tail must be set
+ * @verbose
+ */
+static int
+famfs_log_counters_sync(struct famfs_locked_log *lp, int verbose)
+{
+	u64 next_seqnum = lp->tail->famfs_log_next_seqnum;
+	struct famfs_log *logp = lp->logp;
+	const struct famfs_log_entry *le;
+	struct famfs_log_counters c = { 0 };
+	struct famfs_log_cursor cur;
+	struct famfs_log_stats ls;
+	int folded = 0;
+	u8 *bitmap;
 
-		case FAMFS_LOG_ACCESS:
-		default:
-			printf("%s: invalid log entry\n", __func__);
-			break;
+	c.seqnum      = logp->famfs_log_cnt_seqnum;
+	c.alloc_bytes = logp->famfs_log_alloc_bytes;
+	c.nfiles      = logp->famfs_log_nfiles;
+	c.ndirs       = logp->famfs_log_ndirs;
+	if (logp->famfs_log_cnt_unit != lp->alloc_unit)
+		c.alloc_bytes = 0;
+	if (c.alloc_bytes && c.seqnum == next_seqnum)
+		return 0;
+
+	if (c.alloc_bytes && c.seqnum >= logp->famfs_log_snap_seqnum && c.seqnum < next_seqnum
+	    && !famfs_log_cursor_init(&cur, logp, c.seqnum)) {
+		while ((le = famfs_log_cursor_next(&cur)))
+			famfs_log_count_entry(&c, le, lp->alloc_unit);
+		folded = (!cur.invalid && cur.seqnum == next_seqnum);
+	}
+	if (!folded) {
+		bitmap = famfs_build_bitmap(logp, lp->devsize, lp->alloc_unit, NULL, NULL, NULL,
+					    &c.alloc_bytes, &ls, verbose);
+		if (!bitmap) {
+			fprintf(stderr, "%s: cannot recompute the capacity counters\n", __func__);
+			return -1;
 		}
+		free(bitmap);
+		c.nfiles = ls.f_logged - ls.f_unlinked;
+		c.ndirs  = ls.d_logged - ls.d_rmdirs;
 	}
-	if (verbose > 1) {
-		mu_print_bitmap(bitmap, nbits);
-	}
-	if (bitmap_nbits_out)
-		*bitmap_nbits_out = nbits;
-	if (alloc_errors_out)
-		*alloc_errors_out = errors;
-	if (fsize_total_out)
-		*fsize_total_out = fsize_sum;
-	if (alloc_sum_out)
-		*alloc_sum_out = alloc_sum;
-	if (log_stats_out)
-		memcpy(log_stats_out, &ls, sizeof(ls));
-	return bitmap;
+	if (verbose)
+		printf("%s: capacity counters %s from seqnum %lld to %lld\n", __func__,
+		       (folded) ? "caught up" : "recomputed", c.seqnum, next_seqnum);
+
+	famfs_log_write_begin(logp);
+	logp->famfs_log_cnt_seqnum  = next_seqnum;
+	logp->famfs_log_cnt_unit    = lp->alloc_unit;
+	logp->famfs_log_alloc_bytes = c.alloc_bytes;
+	logp->famfs_log_nfiles      = c.nfiles;
+	logp->famfs_log_ndirs       = c.ndirs;
+	famfs_log_write_end(logp);
+	return 0;
 }
 
 /**
- * bitmap_alloc_contiguous()
+ * famfs_log_txn_recover()
+ *
+ * Clean up after a master that was killed with a transaction open. Its staged entries
+ * are still in the slots after famfs_log_next_index, but were never published, so the
+ * extents of their files are free as far as the log is concerned; the local files it
+ * created for them would alias whatever is allocated there next. Remove those files
+ * (and directories), zero the staged entries, and replay the log to put back anything
+ * that the discarded entries had removed locally.
+ *
+ * Staged entries are recognized by their seqnums and crcs, like published ones.
  *
- * @bitmap
- * @nbits - number of bits in the bitmap
- * @alloc_size - size to allocate in bytes (must convert to bits)
+ * @lp      - locked log, with lp->tail set
+ * @verbose
  *
- * Return value: the offset in bytes
+ * Returns the number of discarded entries
  */
-static s64
-bitmap_alloc_contiguous(u8 *bitmap,
-			u64 nbits,
-			u64 alloc_size,
-			u64 *cur_pos)
-{
-	u64 i, j;
-	u64 alloc_bits = (alloc_size + FAMFS_ALLOC_UNIT - 1) /  FAMFS_ALLOC_UNIT;
-	u64 bitmap_remainder;
-
-	for (i = *cur_pos; i < nbits; i++) {
-		/* Skip bits that are set... */
-		if (mu_bitmap_test(bitmap, i))
-			continue;
+static u64
+famfs_log_txn_recover(struct famfs_locked_log *lp, int verbose)
+{
+	struct famfs_log *logp = lp->tail;
+	u64 end = logp->famfs_log_last_index + 1;
+	u64 seqnum = logp->famfs_log_next_seqnum;
+	u64 first = logp->famfs_log_next_index;
+	char (*dirs)[FAMFS_MAX_PATHLEN] = NULL;
+	char fullpath[PATH_MAX];
+	struct famfs_log_entry le;
+	u64 pos = first;
+	u64 ndirs = 0;
+	u64 n = 0;
 
-		bitmap_remainder = nbits - i;
-		if (alloc_bits > bitmap_remainder) /* Remaining space is not enough */
-			return -1;
+	for (;;) {
+		const char *relpath;
+
+		/* Quietly stop at the first slot that was not staged */
+		if (pos >= end)
+			break;
+		if (famfs_log_is_v2(logp)) {
+			const struct famfs_log_rec *rec = famfs_log_pos_addr(logp, pos);
+
+			invalidate_processor_cache(rec, sizeof(*rec));
+			if (!famfs_log_rec_len_valid(rec, pos, end) || rec->lr_seqnum != seqnum)
+				break;
+			invalidate_processor_cache(rec, rec->lr_len);
+			if (rec->lr_crc != famfs_gen_log_rec_crc(rec, famfs_log_csum_alg(logp)))
+				break;
+		} else {
+			const struct famfs_log_entry *e = &logp->entries[pos];
+			enum famfs_csum_alg alg = FAMFS_CSUM_ALG(e->famfs_log_entry_crc);
 
-		for (j = i; j < (i+alloc_bits); j++) {
-			if (mse_bitmap_test32(bitmap, j))
-				goto next;
+			invalidate_processor_cache(e, sizeof(*e));
+			if (e->famfs_log_entry_seqnum != seqnum || !famfs_csum_alg_valid(alg)
+			    || e->famfs_log_entry_crc != famfs_gen_log_entry_crc(e, alg))
+				break;
+		}
+		if (famfs_log_get_entry(logp, pos, end, seqnum, &le, &pos))
+			break;
+		seqnum++;
+		n++;
+
+		if (le.famfs_log_entry_type == FAMFS_LOG_FILE) {
+			relpath = (const char *)le.famfs_fc.famfs_relpath;
+			if (snprintf(fullpath, PATH_MAX, "%s/%s", lp->mpt, relpath) >= PATH_MAX)
+				continue;
+			if (unlink(fullpath) == 0 && verbose)
+				printf("%s: removed unlogged file %s\n", __func__, relpath);
+		} else if (le.famfs_log_entry_type == FAMFS_LOG_MKDIR) {
+			char (*d)[FAMFS_MAX_PATHLEN] = realloc(dirs, (ndirs + 1) * sizeof(*dirs));
+
+			if (!d)
+				continue;
+			dirs = d;
+			memcpy(dirs[ndirs++], le.famfs_md.famfs_relpath, FAMFS_MAX_PATHLEN);
 		}
-		/* If we get here, we didn't hit the "continue" which means that bits
-		 * i-(i+alloc_bits) are available
-		 */
-		for (j = i; j < (i+alloc_bits); j++)
-			mse_bitmap_set32(bitmap, j);
-		*cur_pos = j;
-		return i * FAMFS_ALLOC_UNIT;
-next:
 	}
-	fprintf(stderr, "%s: alloc failed\n", __func__);
-	return -1;
+	if (!n)
+		return 0;
+
+	/* Children were staged after their parents */
+	while (ndirs--) {
+		if (snprintf(fullpath, PATH_MAX, "%s/%s", lp->mpt, dirs[ndirs]) >= PATH_MAX)
+			continue;
+		if (rmdir(fullpath) == 0 && verbose)
+			printf("%s: removed unlogged directory %s\n", __func__, dirs[ndirs]);
+	}
+	free(dirs);
+
+	memset(famfs_log_pos_addr(logp, first), 0, famfs_log_pos_bytes(logp, first, pos));
+	flush_processor_cache(famfs_log_pos_addr(logp, first),
+			      famfs_log_pos_bytes(logp, first, pos));
+	fprintf(stderr, "%s: discarded %lld unpublished log entries\n", __func__, n);
+	__famfs_logplay(lp->logp, lp->mpt, 0, 0, verbose);
+	return n;
 }
 
 /**
@@ -2516,15 +6914,20 @@ famfs_init_locked_log(struct famfs_locked_log *lp,
 		      int verbose)
 {
 	size_t log_size;
+	u32 sb_flags;
 	void *addr;
 	int role;
 	int rc;
 
 	memset(lp, 0, sizeof(*lp));
 
-	lp->devsize = famfs_validate_superblock_by_path(fspath);
+	lp->devsize = famfs_validate_superblock_by_path(fspath, &sb_flags);
 	if (lp->devsize < 0)
 		return -1;
+	lp->alloc_policy = famfs_sb_alloc_policy(sb_flags);
+	lp->max_extents = (sb_flags & FAMFS_SB_ALLOC_CONTIG) ? 1 : FAMFS_FILE_MAX_EXTENTS;
+	lp->alloc_unit = famfs_sb_alloc_unit(sb_flags);
+	lp->group_len = MAX(FAMFS_ALLOC_GROUP_LEN / lp->alloc_unit, 1);
 
 	/* famfs_get_role also validates the superblock */
 	role = famfs_get_role_by_path(fspath, NULL);
@@ -2553,6 +6956,30 @@ famfs_init_locked_log(struct famfs_locked_log *lp,
 	lp->logp = (struct famfs_log *)addr;
 	invalidate_processor_cache(lp->logp, log_size); /* Invalidate the processor cache for the log */
 	assert(lp->logp->famfs_log_len == log_size);
+
+	if (famfs_log_attach(lp->logp, lp->mpt, 0, 1 /* writable */)) {
+		rc = -1;
+		goto err_out;
+	}
+
+	/* Find the segment that is being appended to. A master that died while
+	 * publishing left the generation odd; readers would wait for it until they time out
+	 */
+	lp->tail = lp->logp;
+	for (;;) {
+		struct famfs_log *seg;
+
+		if (lp->tail->famfs_log_gen & 1)
+			famfs_log_write_end(lp->tail);
+		seg = famfs_log_next_seg(lp->tail, lp->tail->famfs_log_next_seqnum);
+		if (!seg)
+			break;
+		lp->tail = seg;
+	}
+	famfs_log_txn_recover(lp, verbose);
+
+	/* Not fatal: famfs df reports stale counters, and fsck flags them */
+	famfs_log_counters_sync(lp, verbose);
 	return 0;
 
 err_out:
@@ -2561,6 +6988,75 @@ err_out:
 	return rc;
 }
 
+/**
+ * famfs_alloc_prepare()
+ *
+ * Build the allocation bitmap and free space index, if that has not been done yet
+ *
+ * @lp      - locked log struct
+ * @verbose
+ */
+static int
+famfs_alloc_prepare(struct famfs_locked_log *lp, int verbose)
+{
+	const struct famfs_log *logp = lp->tail;
+	struct famfs_log_stats ls;
+	struct famfs_log_entry le;
+	u64 pos, i, j;
+
+	if (!lp->bitmap) {
+		/* Bitmap is needed and hasn't been built yet: from the checkpoint if possible */
+		if (famfs_bmap_ckpt_use(lp, verbose)) {
+			lp->bitmap = famfs_build_bitmap(lp->logp, lp->devsize, lp->alloc_unit,
+							&lp->nbits, NULL, NULL, NULL, &ls, verbose);
+			if (!lp->bitmap) {
+				fprintf(stderr, "%s: failed to allocate bitmap\n", __func__);
+				return -1;
+			}
+			/* Next fit picks up after the last allocation in the log */
+			lp->cur_pos = MIN(ls.last_alloc_end / lp->alloc_unit, lp->nbits);
+		}
+
+		/* Entries staged in an open transaction are not in the log yet */
+		pos = logp->famfs_log_next_index;
+		for (i = 0; lp->txn_active && i < lp->txn_nstaged; i++) {
+			const struct famfs_file_creation *fc = &le.famfs_fc;
+
+			if (famfs_log_get_entry(logp, pos, lp->txn_end,
+						logp->famfs_log_next_seqnum + i, &le, &pos))
+				break;
+			if (le.famfs_log_entry_type != FAMFS_LOG_FILE)
+				continue;
+			for (j = 0; j < fc->famfs_nextents; j++)
+				set_extent_in_bitmap(lp->bitmap, lp->alloc_unit,
+						     fc->famfs_ext_list[j].se.famfs_extent_offset,
+						     fc->famfs_ext_list[j].se.famfs_extent_len, NULL);
+		}
+
+		if (famfs_free_index_build(&lp->free, lp->bitmap, lp->nbits)) {
+			fprintf(stderr, "%s: failed to index free space\n", __func__);
+			free(lp->bitmap);
+			lp->bitmap = NULL;
+			return -1;
+		}
+		lp->free.align_max = MAX(FAMFS_ALLOC_ALIGN_MAX / lp->alloc_unit, 1);
+	}
+	return 0;
+}
+
+/* Allocate @nbits units (there must be room) and mark them in the bitmap */
+static s64
+__famfs_alloc_bits(struct famfs_locked_log *lp, u64 nbits, enum famfs_alloc_policy policy)
+{
+	s64 bit = famfs_free_index_alloc(&lp->free, nbits, policy, lp->cur_pos);
+
+	if (bit < 0)
+		return -1;
+	mu_bitmap_set_range(lp->bitmap, bit, nbits);
+	lp->cur_pos = bit + nbits;
+	return bit;
+}
+
 /**
  * famfs_alloc_contiguous()
  *
@@ -2571,17 +7067,346 @@ err_out:
 static s64
 famfs_alloc_contiguous(struct famfs_locked_log *lp, u64 size, int verbose)
 {
-	if (!lp->bitmap) {
-		/* Bitmap is needed and hasn't been built yet */
-		lp->bitmap = famfs_build_bitmap(lp->logp, lp->devsize, &lp->nbits,
-						NULL, NULL, NULL, NULL, verbose);
-		if (!lp->bitmap) {
-			fprintf(stderr, "%s: failed to allocate bitmap\n", __func__);
+	u64 nbits = famfs_alloc_units(size, lp->alloc_unit);
+	s64 bit;
+
+	if (famfs_alloc_prepare(lp, verbose))
+		return -1;
+
+	bit = __famfs_alloc_bits(lp, nbits, lp->alloc_policy);
+	if (bit < 0) {
+		fprintf(stderr, "%s: alloc failed\n", __func__);
+		return -1;
+	}
+	return bit * lp->alloc_unit;
+}
+
+/*
+ * Allocation groups
+ *
+ * With FAMFS_ALLOC_GROUP_FIT, the files of each top-level directory (or all files,
+ * while a tag is set by famfs_alloc_group_set()) are placed together: the first file
+ * of a group reserves a region of lp->group_len units (aligned to its size, up to
+ * 1GiB), and the files of the group are carved from the region in the order they are
+ * created. When the region is full, the group takes the space right after it if that
+ * is free, and another region otherwise. A group that already has files starts after
+ * the last of them if that space is free. Files in the root directory, and files that
+ * their group has no room for, are placed by next fit.
+ */
+
+/* Put the group of @relpath in @tag; returns -1 if it has none */
+static int
+famfs_alloc_group_tag(const struct famfs_locked_log *lp, const char *relpath, char *tag)
+{
+	const char *slash;
+	size_t len;
+
+	if (lp->group_tag[0]) {
+		strcpy(tag, lp->group_tag);
+		return 0;
+	}
+	slash = strchr(relpath, '/');
+	if (!slash)
+		return -1;
+	len = MIN((size_t)(slash - relpath), FAMFS_ALLOC_GROUP_TAGLEN - 1);
+	memcpy(tag, relpath, len);
+	tag[len] = '\0';
+	return 0;
+}
+
+/* The unit after the last extent of the files in directory @tag, or 0 if there are none */
+static u64
+famfs_alloc_group_hint(struct famfs_locked_log *lp, const char *tag, int verbose)
+{
+	const struct famfs_simple_extent *ext;
+	const struct famfs_index_node *n;
+	size_t len = strlen(tag);
+	u64 end = 0;
+	u32 i, j;
+
+	if (lp->group_tag[0] || famfs_locked_log_index(lp, verbose))
+		return 0;
+	for (i = 1; i < lp->index->nnodes; i++) {
+		n = &lp->index->nodes[i];
+		if (n->type != FAMFS_LOG_FILE || strncmp(n->relpath, tag, len)
+		    || n->relpath[len] != '/')
+			continue;
+		ext = famfs_index_extents(lp->index, n);
+		for (j = 0; j < n->nextents; j++)
+			end = MAX(end, (ext[j].famfs_extent_offset + ext[j].famfs_extent_len)
+				  / lp->alloc_unit);
+	}
+	return end;
+}
+
+/* Reserve @len units at @start, or (@start == 0) in an aligned region; -1 if not free */
+static s64
+famfs_alloc_group_reserve(struct famfs_locked_log *lp, u64 start, u64 len)
+{
+	s64 bit;
+
+	if (!start)
+		bit = famfs_free_index_alloc(&lp->free, len, FAMFS_ALLOC_ALIGNED_FIT, 0);
+	else if (start + len > lp->nbits || famfs_free_index_reserve(&lp->free, start, len))
+		bit = -1;
+	else
+		bit = start;
+	if (bit >= 0)
+		lp->group_reserved += len;
+	return bit;
+}
+
+/* Return the unused end of the region of @g to the free space */
+static u64
+famfs_alloc_group_put(struct famfs_locked_log *lp, struct famfs_alloc_group *g)
+{
+	u64 n = g->start + g->len - g->next;
+
+	if (n && famfs_free_index_insert(&lp->free, g->next, n))
+		fprintf(stderr, "%s: failed to index %lld released units at %lld\n",
+			__func__, n, g->next);
+	g->len -= n;
+	lp->group_reserved -= n;
+	return n;
+}
+
+/**
+ * famfs_alloc_group()
+ *
+ * Allocate @nbits units for the file @relpath in the region of its group
+ *
+ * @lp      - locked log struct (bitmap must be built)
+ * @relpath - path of the file relative to the mount point
+ * @nbits
+ * @verbose
+ *
+ * Returns the first unit, or -1 if the file is to be placed by the fallback policy
+ */
+static s64
+famfs_alloc_group(struct famfs_locked_log *lp, const char *relpath, u64 nbits, int verbose)
+{
+	char tag[FAMFS_ALLOC_GROUP_TAGLEN];
+	struct famfs_alloc_group *g = NULL;
+	u64 rlen, end, len = 0;
+	s64 start = -1;
+	int i;
+
+	if (famfs_alloc_group_tag(lp, relpath, tag))
+		return -1;
+	for (i = 0; i < lp->ngroups; i++) {
+		if (strcmp(lp->groups[i].tag, tag) == 0) {
+			g = &lp->groups[i];
+			break;
+		}
+	}
+	/* Regions end on a group_len boundary */
+	rlen = ((nbits + lp->group_len - 1) / lp->group_len) * lp->group_len;
+
+	if (!g) {
+		if (lp->ngroups == FAMFS_ALLOC_GROUP_MAX)
+			return -1;
+		end = famfs_alloc_group_hint(lp, tag, verbose);
+		if (end) {
+			len = ((end + nbits + lp->group_len - 1) / lp->group_len)
+				* lp->group_len - end;
+			start = famfs_alloc_group_reserve(lp, end, len);
+		}
+		if (start < 0) {
+			len = rlen;
+			start = famfs_alloc_group_reserve(lp, 0, len);
+		}
+		if (start < 0)
 			return -1;
+		g = &lp->groups[lp->ngroups++];
+		memset(g, 0, sizeof(*g));
+		strcpy(g->tag, tag);
+		g->start = start;
+		g->len   = len;
+		g->next  = start;
+	} else if (g->next + nbits > g->start + g->len) {
+		end = g->start + g->len;
+		if (famfs_alloc_group_reserve(lp, end, rlen) >= 0) {
+			g->len += rlen;
+		} else {
+			start = famfs_alloc_group_reserve(lp, 0, rlen);
+			if (start < 0)
+				return -1;
+			famfs_alloc_group_put(lp, g);
+			g->start = start;
+			g->len   = rlen;
+			g->next  = start;
+		}
+	}
+
+	start = g->next;
+	g->next += nbits;
+	g->used += nbits;
+	lp->group_reserved -= nbits;
+	mu_bitmap_set_range(lp->bitmap, start, nbits);
+	if (verbose > 1)
+		printf("%s: %s: %lld units at %lld\n", __func__, tag, nbits, start);
+	return start;
+}
+
+/**
+ * famfs_alloc_group_set()
+ *
+ * Put the files allocated from now on in group @tag, rather than in the group of their
+ * top-level directory (with FAMFS_ALLOC_GROUP_FIT)
+ *
+ * @lp
+ * @tag - NULL or "" to go back to top-level directories
+ */
+int
+famfs_alloc_group_set(struct famfs_locked_log *lp, const char *tag)
+{
+	if (tag && strlen(tag) >= FAMFS_ALLOC_GROUP_TAGLEN) {
+		fprintf(stderr, "%s: tag %s is too long\n", __func__, tag);
+		return -EINVAL;
+	}
+	strcpy(lp->group_tag, (tag) ? tag : "");
+	return 0;
+}
+
+/**
+ * famfs_alloc_group_release()
+ *
+ * Return the unused part of the region of group @tag to the free space. The files in
+ * the region stay where they are; the next file of the group reserves a new region.
+ *
+ * @lp
+ * @tag - NULL for all groups
+ *
+ * Returns the number of units released
+ */
+u64
+famfs_alloc_group_release(struct famfs_locked_log *lp, const char *tag)
+{
+	u64 n = 0;
+	int i;
+
+	for (i = lp->ngroups - 1; i >= 0; i--) {
+		if (tag && strcmp(lp->groups[i].tag, tag))
+			continue;
+		n += famfs_alloc_group_put(lp, &lp->groups[i]);
+		lp->groups[i] = lp->groups[--lp->ngroups];
+	}
+	return n;
+}
+
+/**
+ * famfs_alloc_extents()
+ *
+ * Allocate @size bytes as one extent if there is a free extent big enough (placed
+ * by lp->alloc_policy); otherwise, if @max_extents allows, as pieces carved from the
+ * largest free extents, largest first. Extents are whole allocation units. With
+ * FAMFS_ALLOC_GROUP_FIT, the file goes in the region of its group if it can.
+ *
+ * @lp          - locked log struct. Will perform bitmap build if no already done
+ * @relpath     - the file (which determines its group)
+ * @size
+ * @max_extents - up to FAMFS_FILE_MAX_EXTENTS; 1 allocates contiguously or fails
+ * @ext_list    - receives the extents (room for @max_extents)
+ * @verbose
+ *
+ * Returns the number of extents, or -1 if there is not enough room in @max_extents
+ * extents (in which case nothing is allocated)
+ */
+static int
+famfs_alloc_extents(
+	struct famfs_locked_log    *lp,
+	const char                 *relpath,
+	u64                         size,
+	int                         max_extents,
+	struct famfs_simple_extent *ext_list,
+	int                         verbose)
+{
+	u64 remaining = famfs_alloc_units(size, lp->alloc_unit);
+	int nextents = 0;
+	u64 len;
+	s64 bit;
+
+	assert(max_extents > 0 && max_extents <= FAMFS_FILE_MAX_EXTENTS);
+
+	if (famfs_alloc_prepare(lp, verbose))
+		return -1;
+
+	if (lp->alloc_policy == FAMFS_ALLOC_GROUP_FIT) {
+		bit = famfs_alloc_group(lp, relpath, remaining, verbose);
+		if (bit >= 0) {
+			ext_list[0].famfs_extent_offset = bit * lp->alloc_unit;
+			ext_list[0].famfs_extent_len    = remaining * lp->alloc_unit;
+			return 1;
+		}
+	}
+
+	while (remaining && nextents < max_extents) {
+		len = famfs_free_index_largest(&lp->free);
+		if (!len)
+			break;
+		if (len >= remaining) {
+			len = remaining;
+			bit = __famfs_alloc_bits(lp, len, lp->alloc_policy);
+		} else {
+			if (nextents == max_extents - 1)
+				break;
+			/* Best fit for the largest length is the largest extent */
+			bit = __famfs_alloc_bits(lp, len, FAMFS_ALLOC_BEST_FIT);
 		}
-		lp->cur_pos = 0;
+		if (bit < 0)
+			break;
+		ext_list[nextents].famfs_extent_offset = bit * lp->alloc_unit;
+		ext_list[nextents].famfs_extent_len    = len * lp->alloc_unit;
+		nextents++;
+		remaining -= len;
+	}
+
+	if (remaining) {
+		while (nextents--)
+			famfs_free_extent(lp, ext_list[nextents].famfs_extent_offset,
+					  ext_list[nextents].famfs_extent_len);
+		fprintf(stderr, "%s: no room for %lld bytes in %d extent(s)\n",
+			__func__, size, max_extents);
+		return -1;
+	}
+	if (verbose > 1 && nextents > 1)
+		printf("%s: %lld bytes in %d extents\n", __func__, size, nextents);
+	return nextents;
+}
+
+/**
+ * famfs_free_extent()
+ *
+ * Return an extent to the bitmap: an allocation that was never published to the log,
+ * or the extent of a file whose removal has been logged.
+ *
+ * @lp     - locked log struct (bitmap must be built)
+ * @offset - extent offset
+ * @len    - extent length
+ */
+static void
+famfs_free_extent(struct famfs_locked_log *lp, u64 offset, u64 len)
+{
+	u64 page_num = offset / lp->alloc_unit;
+	u64 np = famfs_alloc_units(len, lp->alloc_unit);
+
+	assert(lp->bitmap);
+	assert(!(offset & (lp->alloc_unit - 1)));
+
+	if (page_num >= lp->nbits)
+		return;
+	np = MIN(np, lp->nbits - page_num);
+	if (mu_bitmap_count_range(lp->bitmap, page_num, np) != np) {
+		fprintf(stderr, "%s: extent at %lld is not (all) allocated\n", __func__, offset);
+		return;
 	}
-	return bitmap_alloc_contiguous(lp->bitmap, lp->nbits, size, &lp->cur_pos);
+	mu_bitmap_clear_range(lp->bitmap, page_num, np);
+	if (famfs_free_index_insert(&lp->free, page_num, np))
+		fprintf(stderr, "%s: failed to index freed extent at %lld\n", __func__, offset);
+
+	/* Let the next allocation reuse the freed space */
+	if (page_num < lp->cur_pos)
+		lp->cur_pos = page_num;
 }
 
 
@@ -2590,8 +7415,19 @@ famfs_release_locked_log(struct famfs_locked_log *lp)
 {
 	int rc;
 
-	if (lp->bitmap)
+	if (lp->txn_active) {
+		fprintf(stderr, "%s: discarding uncommitted transaction (%lld entries)\n",
+			__func__, lp->txn_nstaged);
+		famfs_log_txn_abort(lp);
+	}
+	if (lp->bitmap) {
+		famfs_alloc_group_release(lp, NULL);
+		famfs_bmap_ckpt_save(lp);
 		free(lp->bitmap);
+		famfs_free_index_destroy(&lp->free);
+	}
+	famfs_index_free(lp->index);
+	famfs_log_detach(lp->logp);
 
 	assert(lp->lfd > 0);
 	rc = flock(lp->lfd, LOCK_UN);
@@ -2637,19 +7473,17 @@ famfs_file_alloc(
 	u64                      size,
 	int                      verbose)
 {
-	struct famfs_simple_extent ext = {0};
-	struct famfs_log *logp;
+	struct famfs_simple_extent ext[FAMFS_FILE_MAX_EXTENTS] = {0};
 	char mpt[PATH_MAX];
 	char *relpath;
 	char *rpath = strdup(path);
-	s64 offset;
+	int nextents;
 	int rc = 0;
+	int i;
 
 	assert(lp);
 	assert(fd > 0);
 
-	/* XXX do we need the non-locked-log case? */
-	logp = lp->logp;
 	strncpy(mpt, lp->mpt, PATH_MAX - 1);
 
 	/* For the log, we need the path relative to the mount point.
@@ -2659,26 +7493,28 @@ famfs_file_alloc(
 	if (!relpath)
 		return -EINVAL;
 
-	offset = famfs_alloc_contiguous(lp, size, verbose);
-	if (offset < 0) {
+	nextents = famfs_alloc_extents(lp, relpath, size, lp->max_extents, ext, verbose);
+	if (nextents < 0) {
 		rc = -ENOMEM;
 		fprintf(stderr, "%s: Out of space!\n", __func__);
-		//assert(0);
 		goto out;
 	}
 	/* Allocation at offset 0 is always wrong - the superblock lives there */
-	assert(offset != 0);
+	for (i = 0; i < nextents; i++)
+		assert(ext[i].famfs_extent_offset != 0);
 
-	ext.famfs_extent_len    = round_size_to_alloc_unit(size);
-	ext.famfs_extent_offset = offset;
-
-	rc = famfs_log_file_creation(logp, 1, &ext,
+	rc = famfs_log_file_creation(lp, nextents, ext,
 				     relpath, mode, uid, gid, size);
-	if (rc)
+	if (rc) {
+		/* Not logged, so nobody else knows about this allocation */
+		for (i = 0; i < nextents; i++)
+			famfs_free_extent(lp, ext[i].famfs_extent_offset,
+					  ext[i].famfs_extent_len);
 		goto out;
+	}
 
 	if (!mock_kmod)
-		rc =  famfs_file_map_create(path, fd, size, 1, &ext, FAMFS_REG);
+		rc =  famfs_file_map_create(path, fd, size, nextents, ext, FAMFS_REG);
 out:
 	free(rpath);
 	return rc;
@@ -2981,7 +7817,7 @@ __famfs_mkdir(
 	}
 
 	/* Should it be logged before it's locally created? */
-	rc = famfs_log_dir_creation(lp->logp, relpath, mode, uid, gid);
+	rc = famfs_log_dir_creation(lp, relpath, mode, uid, gid);
 
 err_out:
 	if (dirdupe)
@@ -3022,6 +7858,446 @@ famfs_mkdir(
 	return rc;
 }
 
+/*
+ * Build the FAMFS_LOG_UNLINK entry for a file in the namespace index
+ *
+ * Returns 0, or -ENAMETOOLONG if the relpath does not fit in a log entry
+ */
+static int
+famfs_unlink_entry(
+	const struct famfs_index      *idx,
+	const struct famfs_index_node *n,
+	struct famfs_log_entry        *le)
+{
+	const struct famfs_simple_extent *ext = famfs_index_extents(idx, n);
+	struct famfs_file_creation *fc = &le->famfs_fc;
+	size_t len = strnlen(n->relpath, FAMFS_MAX_PATHLEN);
+	u32 i;
+
+	if (len >= FAMFS_MAX_PATHLEN) {
+		fprintf(stderr, "%s: relpath too long\n", __func__);
+		return -ENAMETOOLONG;
+	}
+
+	memset(le, 0, sizeof(*le));
+	le->famfs_log_entry_type = FAMFS_LOG_UNLINK;
+	fc->famfs_fc_size  = n->size;
+	fc->famfs_nextents = n->nextents;
+	fc->famfs_fc_flags = FAMFS_FC_ALL_HOSTS_RW;
+	fc->fc_uid  = n->uid;
+	fc->fc_gid  = n->gid;
+	fc->fc_mode = n->mode;
+	for (i = 0; i < n->nextents; i++) {
+		fc->famfs_ext_list[i].famfs_extent_type = FAMFS_EXT_SIMPLE;
+		fc->famfs_ext_list[i].se = ext[i];
+	}
+	memcpy(fc->famfs_relpath, n->relpath, len + 1);
+	return 0;
+}
+
+/* Build or catch up lp->index */
+static int
+famfs_locked_log_index(struct famfs_locked_log *lp, int verbose)
+{
+	if (!lp->index) {
+		lp->index = famfs_index_build(lp->logp, verbose > 1);
+		if (!lp->index)
+			return -ENOMEM;
+	} else if (famfs_index_update(lp->index, lp->logp) < 0) {
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * __famfs_rm()
+ *
+ * Remove a file (or an empty directory) from famfs: log its removal, return a file's
+ * extents to the allocator, and remove it locally. Clients remove it at their next
+ * logplay. The space is reused by later allocations, so nothing may still have the
+ * file open or mmapped on any node.
+ *
+ * @lp      - locked log (no transaction may be open)
+ * @path    - the file or directory
+ * @dirs_ok - allow removing empty directories
+ *
+ * Returns 0 on success, or a negative errno
+ */
+int
+__famfs_rm(
+	struct famfs_locked_log *lp,
+	const char              *path,
+	int                      dirs_ok,
+	int                      verbose)
+{
+	const struct famfs_index_node *n;
+	char fullpath[PATH_MAX];
+	struct famfs_log_entry le = {0};
+	char *relpath;
+	u32 i;
+	int rc;
+
+	assert(lp);
+
+	if (lp->txn_active)
+		return -EBUSY;
+	if (!realpath(path, fullpath)) {
+		fprintf(stderr, "%s: %s not found\n", __func__, path);
+		return -ENOENT;
+	}
+	if (strcmp(fullpath, lp->mpt) == 0) {
+		fprintf(stderr, "%s: cannot remove the mount point\n", __func__);
+		return -EINVAL;
+	}
+	relpath = famfs_relpath_from_fullpath(lp->mpt, fullpath);
+	if (!relpath)
+		return -EINVAL;
+	if (strlen(relpath) >= FAMFS_MAX_PATHLEN) {
+		fprintf(stderr, "%s: relpath too long: %s\n", __func__, relpath);
+		return -ENAMETOOLONG;
+	}
+
+	rc = famfs_locked_log_index(lp, verbose);
+	if (rc)
+		return rc;
+
+	n = famfs_index_lookup(lp->index, relpath);
+	if (!n) {
+		fprintf(stderr, "%s: %s is not in the log\n", __func__, fullpath);
+		return -ENOENT;
+	}
+	switch (n->type) {
+	case FAMFS_LOG_FILE:
+		rc = famfs_unlink_entry(lp->index, n, &le);
+		if (rc)
+			return rc;
+		break;
+	case FAMFS_LOG_MKDIR:
+		if (!dirs_ok) {
+			fprintf(stderr, "%s: %s is a directory\n", __func__, fullpath);
+			return -EISDIR;
+		}
+		if (famfs_index_readdir(lp->index, n, NULL)) {
+			fprintf(stderr, "%s: directory %s is not empty\n", __func__, fullpath);
+			return -ENOTEMPTY;
+		}
+		le.famfs_log_entry_type = FAMFS_LOG_RMDIR;
+		le.famfs_md.fc_uid  = n->uid;
+		le.famfs_md.fc_gid  = n->gid;
+		le.famfs_md.fc_mode = n->mode;
+		/* The index key is no longer than relpath, which was checked above */
+		strcpy((char *)le.famfs_md.famfs_relpath, n->relpath);
+		break;
+	default:
+		return -ENOENT;
+	}
+
+	rc = famfs_append_log(lp, &le);
+	if (rc)
+		return rc;
+
+	/* Logged; the space is free as far as any bitmap built from now on is concerned */
+	if (lp->bitmap && le.famfs_log_entry_type == FAMFS_LOG_UNLINK) {
+		for (i = 0; i < le.famfs_fc.famfs_nextents; i++)
+			famfs_free_extent(lp, le.famfs_fc.famfs_ext_list[i].se.famfs_extent_offset,
+					  le.famfs_fc.famfs_ext_list[i].se.famfs_extent_len);
+	}
+
+	rc = (le.famfs_log_entry_type == FAMFS_LOG_UNLINK) ? unlink(fullpath) : rmdir(fullpath);
+	if (rc && errno != ENOENT)
+		fprintf(stderr, "%s: logged, but local removal of %s failed (errno %d)\n",
+			__func__, fullpath, errno);
+	if (verbose)
+		printf("famfs rm: removed %s\n", fullpath);
+	return 0;
+}
+
+/**
+ * famfs_rm()
+ *
+ * Remove files (and, with @dirs_ok, empty directories) from famfs (master only)
+ *
+ * @path    - the file or directory
+ * @dirs_ok - allow removing empty directories
+ */
+int
+famfs_rm(
+	const char *path,
+	int         dirs_ok,
+	int         verbose)
+{
+	struct famfs_locked_log ll;
+	char fullpath[PATH_MAX];
+	int rc;
+
+	if (!realpath(path, fullpath)) {
+		fprintf(stderr, "%s: %s not found\n", __func__, path);
+		return -ENOENT;
+	}
+	rc = famfs_init_locked_log(&ll, fullpath, verbose);
+	if (rc)
+		return rc;
+
+	rc = __famfs_rm(&ll, fullpath, dirs_ok, verbose);
+
+	famfs_release_locked_log(&ll);
+	return rc;
+}
+
+/********************************************************************************
+ *
+ * Defragmentation
+ *
+ * Files are visited from the top of the device down, and each one is moved into
+ * the lowest free extent that holds all of it, if that is below where it is now (a
+ * file in several extents is always moved if it fits in one). This slides the data
+ * down and merges the free space above it. A move copies the data into a file in
+ * .meta that is mapped to the new extent (the log doesn't know about it yet, so a
+ * crash leaves the old file intact and the new space free), logs the removal of the
+ * file and its re-creation on the new extent in one transaction, renames the copy
+ * over the file, and frees the old extents.
+ */
+
+struct famfs_defrag_file {
+	u32 node;
+	u64 top;  /* Highest extent offset of the file */
+};
+
+static int
+famfs_defrag_cmp(const void *a, const void *b)
+{
+	const struct famfs_defrag_file *fa = a;
+	const struct famfs_defrag_file *fb = b;
+
+	return (fa->top > fb->top) ? -1 : (fa->top < fb->top);
+}
+
+/* Copy a file into @ext, log the move and put the copy in its place */
+static int
+famfs_defrag_move(
+	struct famfs_locked_log       *lp,
+	const struct famfs_index_node *n,
+	struct famfs_simple_extent    *ext,
+	int                            verbose)
+{
+	char fullpath[PATH_MAX];
+	char tmppath[PATH_MAX];
+	struct famfs_log_entry le;
+	void *src = MAP_FAILED;
+	void *dst = MAP_FAILED;
+	int sfd = -1, dfd = -1;
+	int rc = -1;
+
+	if (snprintf(fullpath, PATH_MAX, "%s/%s", lp->mpt, n->relpath) >= PATH_MAX
+	    || snprintf(tmppath, PATH_MAX, "%s/.meta/.defrag", lp->mpt) >= PATH_MAX)
+		return -1;
+
+	sfd = open(fullpath, O_RDONLY | O_CLOEXEC);
+	if (sfd < 0) {
+		fprintf(stderr, "%s: unable to open %s\n", __func__, fullpath);
+		return -1;
+	}
+	unlink(tmppath); /* Left over from a crash; it was never logged */
+	dfd = open(tmppath, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, n->mode);
+	if (dfd < 0) {
+		fprintf(stderr, "%s: unable to create %s\n", __func__, tmppath);
+		goto out;
+	}
+	if (n->uid && n->gid && fchown(dfd, n->uid, n->gid))
+		fprintf(stderr, "%s: fchown returned errno %d\n", __func__, errno);
+	if ((mock_kmod && ftruncate(dfd, n->size))
+	    || (!mock_kmod && famfs_file_map_create(tmppath, dfd, n->size, 1, ext, FAMFS_REG)))
+		goto out_unlink;
+
+	src = mmap(0, n->size, PROT_READ, MAP_SHARED, sfd, 0);
+	dst = mmap(0, n->size, PROT_READ | PROT_WRITE, MAP_SHARED, dfd, 0);
+	if (src == MAP_FAILED || dst == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed for %s\n", __func__, fullpath);
+		goto out_unlink;
+	}
+	invalidate_processor_cache(src, n->size);
+	stream_copy_to_memory(dst, src, n->size);
+
+	/* Clients see the removal and the re-creation together: both go in one batch */
+	rc = famfs_unlink_entry(lp->index, n, &le);
+	if (!rc)
+		rc = famfs_log_txn_begin(lp, 2);
+	if (!rc)
+		rc = famfs_log_txn_reserve_contig(lp, 2);
+	if (!rc)
+		rc = famfs_append_log(lp, &le);
+	if (!rc)
+		rc = famfs_log_file_creation(lp, 1, ext, n->relpath, n->mode, n->uid, n->gid,
+					     n->size);
+	if (rc) {
+		/* The creation was not staged, so the caller still owns the new extent */
+		famfs_log_txn_abort(lp);
+		goto out_unlink;
+	}
+	famfs_log_txn_commit(lp);
+
+	if (rename(tmppath, fullpath))
+		fprintf(stderr, "%s: %s moved, but the local rename failed (errno %d)\n",
+			__func__, fullpath, errno);
+	if (verbose)
+		printf("famfs defrag: moved %s to %lld\n", n->relpath, ext->famfs_extent_offset);
+	rc = 0;
+	goto out;
+
+out_unlink:
+	unlink(tmppath);
+	rc = -1;
+out:
+	if (src != MAP_FAILED)
+		munmap(src, n->size);
+	if (dst != MAP_FAILED)
+		munmap(dst, n->size);
+	if (dfd >= 0)
+		close(dfd);
+	close(sfd);
+	return rc;
+}
+
+/**
+ * __famfs_defrag()
+ *
+ * Move files so the free space is in fewer, larger extents. Files that are moved
+ * must not be open or mmapped on any node.
+ *
+ * @lp      - locked log (no transaction may be open)
+ * @dry_run - plan the moves but don't make them (the allocation state of @lp is
+ *            discarded afterward)
+ * @st      - receives the statistics (largest free extent before and after, etc.)
+ * @verbose
+ *
+ * Returns 0 on success (files that could not be moved are counted in @st->nerrs),
+ * or a negative errno
+ */
+int
+__famfs_defrag(
+	struct famfs_locked_log   *lp,
+	int                        dry_run,
+	struct famfs_defrag_stats *st,
+	int                        verbose)
+{
+	struct famfs_simple_extent ext[FAMFS_FC_MAX_EXTENTS];
+	struct famfs_defrag_file *files;
+	const struct famfs_index_node *n;
+	u64 unit = lp->alloc_unit;
+	u64 nfiles = 0;
+	u64 i, nunits;
+	u32 j, k;
+	s64 bit;
+	int rc;
+
+	assert(lp);
+
+	memset(st, 0, sizeof(*st));
+	if (lp->txn_active)
+		return -EBUSY;
+	rc = famfs_locked_log_index(lp, verbose);
+	if (rc)
+		return rc;
+	if (famfs_alloc_prepare(lp, verbose))
+		return -ENOMEM;
+	famfs_alloc_group_release(lp, NULL);
+	st->largest_before = famfs_free_index_largest(&lp->free) * unit;
+
+	files = calloc(lp->index->nnodes + 1, sizeof(*files));
+	if (!files)
+		return -ENOMEM;
+	for (j = 1; j < lp->index->nnodes; j++) {
+		n = &lp->index->nodes[j];
+		if (n->type != FAMFS_LOG_FILE || !n->nextents || !n->size)
+			continue;
+		files[nfiles].node = j;
+		for (k = 0; k < n->nextents; k++)
+			files[nfiles].top = MAX(files[nfiles].top,
+						famfs_index_extents(lp->index, n)[k].famfs_extent_offset);
+		nfiles++;
+	}
+	qsort(files, nfiles, sizeof(*files), famfs_defrag_cmp);
+	st->nfiles = nfiles;
+
+	for (i = 0; i < nfiles; i++) {
+		const struct famfs_simple_extent *old;
+
+		n = &lp->index->nodes[files[i].node];
+		old = famfs_index_extents(lp->index, n);
+		nunits = famfs_alloc_units(n->size, unit);
+		bit = __famfs_alloc_bits(lp, nunits, FAMFS_ALLOC_FIRST_FIT);
+		if (bit < 0)
+			continue;
+		ext[0].famfs_extent_offset = bit * unit;
+		ext[0].famfs_extent_len    = nunits * unit;
+		if (n->nextents == 1 && ext[0].famfs_extent_offset >= old[0].famfs_extent_offset) {
+			famfs_free_extent(lp, ext[0].famfs_extent_offset, ext[0].famfs_extent_len);
+			continue;
+		}
+		if (verbose > 1 || (dry_run && verbose))
+			printf("famfs defrag: %s: %d extent(s) at %lld -> %lld\n", n->relpath,
+			       n->nextents, old[0].famfs_extent_offset, ext[0].famfs_extent_offset);
+		if (!dry_run && famfs_defrag_move(lp, n, ext, verbose)) {
+			famfs_free_extent(lp, ext[0].famfs_extent_offset, ext[0].famfs_extent_len);
+			st->nerrs++;
+			continue;
+		}
+		for (k = 0; k < n->nextents; k++)
+			famfs_free_extent(lp, old[k].famfs_extent_offset, old[k].famfs_extent_len);
+		st->nmoved++;
+		st->bytes_moved += n->size;
+	}
+	free(files);
+
+	st->largest_after = famfs_free_index_largest(&lp->free) * unit;
+	st->free_bytes = lp->free.free_units * unit;
+	if (dry_run) {
+		/* The plan freed extents that are still in use */
+		free(lp->bitmap);
+		lp->bitmap = NULL;
+		famfs_free_index_destroy(&lp->free);
+	}
+	return 0;
+}
+
+/**
+ * famfs_defrag()
+ *
+ * Defragment the free space of a famfs file system (master only)
+ *
+ * @fspath  - mount point, or any path within the famfs file system
+ * @dry_run - report what would be moved, and the largest free extent before and after
+ */
+int
+famfs_defrag(
+	const char *fspath,
+	int         dry_run,
+	int         verbose)
+{
+	struct famfs_defrag_stats st;
+	struct famfs_locked_log ll;
+	int rc;
+
+	rc = famfs_init_locked_log(&ll, fspath, verbose);
+	if (rc)
+		return rc;
+
+	rc = __famfs_defrag(&ll, dry_run, &st, verbose);
+	if (!rc) {
+		printf("famfs defrag: %s%lld of %lld files (%lld bytes) moved",
+		       (dry_run) ? "(dry run) " : "", st.nmoved, st.nfiles, st.bytes_moved);
+		if (st.nerrs)
+			printf(", %lld failed", st.nerrs);
+		printf("\n");
+		printf("  Free space:             %lld\n", st.free_bytes);
+		printf("  Largest free extent:    %lld before, %lld after\n",
+		       st.largest_before, st.largest_after);
+	}
+
+	famfs_release_locked_log(&ll);
+	return (rc || st.nerrs) ? -1 : 0;
+}
+
 /**
  * famfs_make_parent_dir()
  *
@@ -3125,8 +8401,13 @@ famfs_mkdir_parents(
 		return rc;
 	}
 
-	/* Now recurse up fromm abspath till we find an existing parent, and mkdir back down */
+	/* Now recurse up fromm abspath till we find an existing parent, and mkdir back down.
+	 * All the new dirs are published with one log commit. If we fail part way, the
+	 * dirs that were created still get committed.
+	 */
+	famfs_log_txn_begin(&ll, 0);
 	rc = famfs_make_parent_dir(&ll, abspath, mode, uid, gid, 0, verbose);
+	famfs_log_txn_commit(&ll);
 
 	/* Separate function should release ll and lock */
 	famfs_release_locked_log(&ll);
@@ -3586,6 +8867,11 @@ famfs_cp_multi(
 		return rc;
 	}
 
+	/* Log entries are published in batches. Files that were copied before an
+	 * abort are complete, so their entries are committed on the way out too.
+	 */
+	famfs_log_txn_begin(&ll, 0);
+
 	for (i = 0; i < src_argc; i++) {
 		struct stat src_stat;
 
@@ -3645,6 +8931,8 @@ famfs_cp_multi(
 	}
 
 err_out:
+	famfs_log_txn_commit(&ll);
+
 	/* Separate function should release ll and lock */
 	free(dirdupe);
 	famfs_release_locked_log(&ll);
@@ -3665,6 +8953,7 @@ famfs_clone(const char *srcfile,
 	    int   verbose)
 {
 	struct famfs_ioc_map filemap = {0};
+	struct famfs_locked_log ll = { 0 };
 	struct famfs_extent *ext_list = NULL;
 	char srcfullpath[PATH_MAX];
 	char destfullpath[PATH_MAX];
@@ -3812,7 +9101,11 @@ famfs_clone(const char *srcfile,
 		goto err_out;
 	}
 
-	rc = famfs_log_file_creation(logp, filemap.ext_list_count, se,
+	/* Clone holds the log lock itself; the locked log struct is only needed to
+	 * append the entry
+	 */
+	ll.logp = logp;
+	rc = famfs_log_file_creation(&ll, filemap.ext_list_count, se,
 				     relpath, src_stat.st_mode, src_stat.st_uid, src_stat.st_gid,
 				     filemap.file_size);
 	if (rc) {
@@ -3900,7 +9193,7 @@ __famfs_mkfs(const char              *daxdev,
 	strncpy(sb->ts_devlist[0].dd_daxdev, daxdev, FAMFS_DEVNAME_LEN);
 
 	/* Calculate superblock crc */
-	sb->ts_crc = famfs_gen_superblock_crc(sb); /* gotta do this last! */
+	sb->ts_crc = famfs_gen_superblock_crc(sb, FAMFS_CSUM_DEFAULT); /* gotta do this last! */
 
 	/* Zero and setup the log */
 	memset(logp, 0, log_len);
@@ -3908,10 +9201,15 @@ __famfs_mkfs(const char              *daxdev,
 	logp->famfs_log_len        = log_len;
 	logp->famfs_log_next_seqnum = 0;
 	logp->famfs_log_next_index = 0;
-	logp->famfs_log_last_index = (((log_len - offsetof(struct famfs_log, entries))
-				      / sizeof(struct famfs_log_entry)) - 1);
 
-	logp->famfs_log_crc = famfs_gen_log_header_crc(logp);
+	/* The second half of the log holds the two snapshot slots */
+	logp->famfs_log_snap_offset = log_len / 2;
+	logp->famfs_log_snap_len    = log_len / 4;
+	logp->famfs_log_last_index = (((logp->famfs_log_snap_offset
+					- offsetof(struct famfs_log, entries))
+				       / sizeof(struct famfs_log_entry)) - 1);
+
+	logp->famfs_log_crc = famfs_gen_log_header_crc(logp, FAMFS_CSUM_DEFAULT);
 	famfs_fsck_scan(sb, logp, 1, 0);
 
 	/* Force a writeback of the log followed by the superblock */
@@ -3920,11 +9218,28 @@ __famfs_mkfs(const char              *daxdev,
 	return 0;
 }
 
+/**
+ * famfs_mkfs()
+ *
+ * @daxdev  - device
+ * @log_len - log size
+ * @kill    - kill the superblock rather than making a file system
+ * @force   - make a file system even if there is a valid superblock
+ * @log_v2  - use log format v2 (packed variable-length records)
+ * @alloc_policy - default enum famfs_alloc_policy, recorded in the superblock
+ * @contiguous   - never split files into multiple extents
+ * @alloc_unit   - allocation unit: a power of 2 from FAMFS_ALLOC_UNIT to
+ *                 FAMFS_ALLOC_UNIT_MAX (0: FAMFS_ALLOC_UNIT)
+ */
 int
 famfs_mkfs(const char *daxdev,
 	   u64         log_len,
 	   int         kill,
-	   int         force)
+	   int         force,
+	   int         log_v2,
+	   int         alloc_policy,
+	   int         contiguous,
+	   u64         alloc_unit)
 {
 	int rc;
 	size_t devsize;
@@ -3990,7 +9305,195 @@ famfs_mkfs(const char *daxdev,
 	if (rc)
 		return -1;
 
-	return __famfs_mkfs(daxdev, sb, logp, log_len, devsize, force, kill);
+	if (alloc_policy < 0 || alloc_policy >= FAMFS_ALLOC_NPOLICIES) {
+		fprintf(stderr, "%s: invalid allocation policy %d\n", __func__, alloc_policy);
+		return -EINVAL;
+	}
+	if (!alloc_unit)
+		alloc_unit = FAMFS_ALLOC_UNIT;
+	if ((alloc_unit & (alloc_unit - 1)) || alloc_unit < FAMFS_ALLOC_UNIT
+	    || alloc_unit > FAMFS_ALLOC_UNIT_MAX) {
+		fprintf(stderr, "%s: allocation unit (%lld) must be a power of 2 from 2MiB to 1GiB\n",
+			__func__, alloc_unit);
+		return -EINVAL;
+	}
+
+	rc = __famfs_mkfs(daxdev, sb, logp, log_len, devsize, force, kill);
+	if (rc)
+		return rc;
+
+	sb->ts_sb_flags &= ~(FAMFS_SB_ALLOC_POLICY_MASK | FAMFS_SB_ALLOC_CONTIG
+			     | FAMFS_SB_ALLOC_UNIT_MASK);
+	sb->ts_sb_flags |= (u32)alloc_policy << FAMFS_SB_ALLOC_POLICY_SHIFT;
+	sb->ts_sb_flags |= (u32)(__builtin_ctzll(alloc_unit / FAMFS_ALLOC_UNIT))
+		<< FAMFS_SB_ALLOC_UNIT_SHIFT;
+	if (contiguous)
+		sb->ts_sb_flags |= FAMFS_SB_ALLOC_CONTIG;
+	sb->ts_crc = famfs_gen_superblock_crc(sb, FAMFS_CSUM_DEFAULT);
+	flush_processor_cache(sb, FAMFS_SUPERBLOCK_SIZE);
+
+	/* An empty file system: only the superblock and log are allocated */
+	logp->famfs_log_alloc_bytes =
+		famfs_alloc_units(FAMFS_SUPERBLOCK_SIZE + logp->famfs_log_len, alloc_unit)
+		* alloc_unit;
+	logp->famfs_log_cnt_unit = alloc_unit;
+	flush_processor_cache(&logp->famfs_log_gen, 64);
+
+	if (!log_v2)
+		return 0;
+
+	return famfs_log_convert_v2(logp, 0);
+}
+
+/**
+ * __famfs_upgrade_v46()
+ *
+ * Convert a version 46 file system (struct famfs_log_v46) to the current version in
+ * place: move the entries after the current log header, and bump the superblock
+ * version. The log keeps its crc32 checksums. If the entries fit in the first half of
+ * the log, the second half becomes the snapshot region, as on a new file system;
+ * otherwise the log has no snapshot region, and cannot be compacted.
+ *
+ * This is not crash safe: the log is unusable if it is interrupted after the entries
+ * have been moved.
+ *
+ * @sb   - superblock (writable)
+ * @logp - the log (writable, sb->ts_log_len bytes)
+ *
+ * Returns 0 on success (including if @sb is already current), or a negative errno
+ */
+int
+__famfs_upgrade_v46(struct famfs_superblock *sb, struct famfs_log *logp, int verbose)
+{
+	const size_t hdr = offsetof(struct famfs_log, entries);
+	const size_t esize = sizeof(struct famfs_log_entry);
+	struct famfs_log_v46 *old = (struct famfs_log_v46 *)logp;
+	u64 next_index, last_index, snap_offset;
+	u32 crc = 0;
+
+	if (sb->ts_magic != FAMFS_SUPER_MAGIC) {
+		fprintf(stderr, "%s: no famfs superblock\n", __func__);
+		return -EINVAL;
+	}
+	if (sb->ts_version == FAMFS_CURRENT_VERSION) {
+		printf("%s: file system is already version %lld\n", __func__, sb->ts_version);
+		return 0;
+	}
+	if (sb->ts_version != FAMFS_VERSION_V46) {
+		fprintf(stderr, "%s: cannot upgrade from version %lld\n",
+			__func__, sb->ts_version);
+		return -EINVAL;
+	}
+	if (famfs_gen_superblock_crc(sb, FAMFS_CSUM_CRC32) != sb->ts_crc) {
+		fprintf(stderr, "%s: crc mismatch in superblock\n", __func__);
+		return -EINVAL;
+	}
+
+	invalidate_processor_cache(logp, sb->ts_log_len);
+	crc = famfs_csum(FAMFS_CSUM_CRC32, crc, &old->famfs_log_magic,
+			 sizeof(old->famfs_log_magic));
+	crc = famfs_csum(FAMFS_CSUM_CRC32, crc, &old->famfs_log_len,
+			 sizeof(old->famfs_log_len));
+	crc = famfs_csum(FAMFS_CSUM_CRC32, crc, &old->famfs_log_last_index,
+			 sizeof(old->famfs_log_last_index));
+	if (old->famfs_log_magic != FAMFS_LOG_MAGIC || old->famfs_log_len != sb->ts_log_len
+	    || old->famfs_log_crc != crc) {
+		fprintf(stderr, "%s: invalid version %lld log header\n", __func__, sb->ts_version);
+		return -EINVAL;
+	}
+	next_index = old->famfs_log_next_index;
+	if (next_index > old->famfs_log_last_index + 1
+	    || old->famfs_log_next_seqnum != next_index) {
+		fprintf(stderr, "%s: invalid version %lld log (next_index %lld, seqnum %lld)\n",
+			__func__, sb->ts_version, next_index, old->famfs_log_next_seqnum);
+		return -EINVAL;
+	}
+
+	/* The header is bigger now, which costs a slot if the log is completely full */
+	snap_offset = sb->ts_log_len / 2;
+	last_index = (snap_offset - hdr) / esize - 1;
+	if (next_index > last_index + 1) {
+		snap_offset = 0;
+		last_index = (sb->ts_log_len - hdr) / esize - 1;
+	}
+	if (next_index > last_index + 1) {
+		fprintf(stderr, "%s: log is full; there is no room for the current header\n",
+			__func__);
+		return -ENOSPC;
+	}
+
+	memmove(logp->entries, old->entries, next_index * esize);
+	memset(&logp->famfs_log_snap_seqnum, 0,
+	       hdr - offsetof(struct famfs_log, famfs_log_snap_seqnum));
+	logp->famfs_log_last_index  = last_index;
+	logp->famfs_log_snap_offset = snap_offset;
+	logp->famfs_log_snap_len    = (snap_offset) ? sb->ts_log_len / 4 : 0;
+	logp->famfs_log_crc = famfs_gen_log_header_crc(logp, FAMFS_CSUM_CRC32);
+	flush_processor_cache(logp, sb->ts_log_len);
+
+	sb->ts_version = FAMFS_CURRENT_VERSION;
+	sb->ts_crc = famfs_gen_superblock_crc(sb, FAMFS_CSUM_ALG(sb->ts_crc));
+	flush_processor_cache(sb, FAMFS_SUPERBLOCK_SIZE);
+
+	if (verbose)
+		printf("%s: upgraded to version %lld: %lld log entries%s\n", __func__,
+		       sb->ts_version, next_index, (snap_offset) ? "" : ", no snapshot region");
+	return 0;
+}
+
+/**
+ * famfs_upgrade()
+ *
+ * Upgrade a version 46 file system to the current version (see __famfs_upgrade_v46()).
+ * The file system must not be mounted, and this must run on the master.
+ *
+ * @daxdev
+ * @verbose
+ */
+int
+famfs_upgrade(const char *daxdev, int verbose)
+{
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	uuid_le my_uuid;
+	char *mpt;
+	u64 log_len;
+	int rc;
+
+	mpt = famfs_get_mpt_by_dev(daxdev);
+	if (mpt) {
+		fprintf(stderr, "%s: cannot upgrade while %s is mounted on %s\n",
+			__func__, daxdev, mpt);
+		free(mpt);
+		return -EBUSY;
+	}
+
+	/* The superblock does not pass famfs_check_super() yet */
+	rc = famfs_mmap_superblock_and_log_raw(daxdev, &sb, NULL, 0, 1 /* read only */);
+	if (rc)
+		return rc;
+	invalidate_processor_cache(sb, FAMFS_SUPERBLOCK_SIZE);
+	if (sb->ts_magic != FAMFS_SUPER_MAGIC) {
+		fprintf(stderr, "%s: no famfs superblock on %s\n", __func__, daxdev);
+		return -EINVAL;
+	}
+	if (!mock_role) {
+		if (famfs_get_system_uuid(&my_uuid)
+		    || memcmp(&my_uuid, &sb->ts_system_uuid, sizeof(my_uuid))) {
+			fprintf(stderr, "%s: this is not the master of %s\n", __func__, daxdev);
+			return -EPERM;
+		}
+	}
+	log_len = sb->ts_log_len;
+	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+
+	rc = famfs_mmap_superblock_and_log_raw(daxdev, &sb, &logp, log_len, 0 /* read/write */);
+	if (rc)
+		return rc;
+	rc = __famfs_upgrade_v46(sb, logp, verbose);
+	munmap(logp, log_len);
+	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	return rc;
 }
 
 int
@@ -15,6 +15,7 @@
 
 #define SB_FILE_RELPATH    ".meta/.superblock"
 #define LOG_FILE_RELPATH   ".meta/.log"
+#define BMAP_FILE_RELPATH  ".meta/.bitmap"
 
 /* Hack due to unintended consequences of kmod v1/v2 change */
 #ifndef FAMFS_KABI_VERSION
@@ -24,19 +25,55 @@ enum famfs_extent_type {
 };
 #endif
 
+/**
+ * struct famfs_follow_args - parameters and results for famfs_logplay_follow()
+ *
+ * @client_mode    - play the log as if this is a client node, even on master
+ * @full_replay    - ignore the logplay checkpoint when starting
+ * @poll_min_us    - poll interval after new entries have been seen
+ * @poll_max_us    - the poll interval backs off to this while the log is idle
+ * @max_batches    - return after this many batches (0: until @stop_now is set)
+ * @stop_now       - set (e.g. by a signal handler) to stop following
+ * @nbatches       - batches of new entries that were applied
+ * @nentries       - entries that were applied
+ * @nerrors        - file and directory errors while applying entries
+ * @total_apply_us - time spent applying batches
+ * @max_apply_us   - longest time spent applying one batch
+ */
+struct famfs_follow_args {
+	int          client_mode;
+	int          full_replay;
+	u64          poll_min_us;
+	u64          poll_max_us;
+	u64          max_batches;
+	volatile int stop_now;
+	int          verbose;
+
+	/* Outputs */
+	u64          nbatches;
+	u64          nentries;
+	u64          nerrors;
+	u64          total_apply_us;
+	u64          max_apply_us;
+};
+
 int famfs_module_loaded(int verbose);
 void *famfs_mmap_whole_file(const char *fname, int read_only, size_t *sizep);
 
 extern int famfs_get_device_size(const char *fname, size_t *size, enum famfs_extent_type *type);
 int famfs_check_super(const struct famfs_superblock *sb);
 int famfs_fsck(const char *devname, int use_mmap, int human, int verbose);
+int famfs_df(const char *path, int human, int verbose);
 
 void famfs_uuidgen(uuid_le *uuid);
 int famfs_get_system_uuid(uuid_le *uuid_out);
 int famfs_mkmeta(const char *devname);
 u64 famfs_alloc(const char *devname, u64 size);
 int famfs_logplay(const char *mpt, int use_mmap,
-		  int dry_run, int client_mode, int verbose);
+		  int dry_run, int client_mode, int full_replay, int nthreads, int verbose);
+int famfs_logplay_follow(const char *fspath, struct famfs_follow_args *fa);
+int famfs_compact(const char *fspath, int verbose);
+int famfs_logconvert(const char *fspath, int verbose);
 
 int famfs_mkfile(const char *filename, mode_t mode, uid_t uid, gid_t gid, size_t size, int verbose);
 
@@ -45,8 +82,12 @@ int famfs_cp_multi(int argc, char *argv[],
 int famfs_clone(const char *srcfile, const char *destfile, int verbose);
 
 int famfs_mkdir(const char *dirpath, mode_t mode, uid_t uid, gid_t gid, int verbose);
+int famfs_rm(const char *path, int dirs_ok, int verbose);
+int famfs_defrag(const char *fspath, int dry_run, int verbose);
 int famfs_mkdir_parents(const char *dirpath, mode_t mode, uid_t uid, gid_t gid, int verbose);
-int famfs_mkfs(const char *daxdev, u64 log_len, int kill, int force);
+int famfs_mkfs(const char *daxdev, u64 log_len, int kill, int force, int log_v2,
+	       int alloc_policy, int contiguous, u64 alloc_unit);
+int famfs_upgrade(const char *daxdev, int verbose);
 int famfs_check(const char *path, int verbose);
 
 void famfs_dump_log(struct famfs_log *logp);
@@ -6,7 +6,10 @@
 #ifndef _H_FAMFS_LIB_INTERNAL
 #define _H_FAMFS_LIB_INTERNAL
 
+#include <linux/famfs_ioctl.h>
+
 #include "famfs_meta.h"
+#include "famfs_alloc.h"
 
 enum lock_opt {
 	NO_LOCK = 0,
@@ -29,24 +32,124 @@ enum mock_failure {
 	MOCK_FAIL_MMAP,
 };
 
+struct famfs_index;
+
+/**
+ * struct famfs_log_counters - capacity counters of a file system (see famfs df)
+ *
+ * @seqnum      - they reflect the log entries before this seqnum
+ * @alloc_bytes - allocated space, including metadata
+ * @nfiles      - number of files
+ * @ndirs       - number of directories
+ */
+struct famfs_log_counters {
+	u64 seqnum;
+	u64 alloc_bytes;
+	u64 nfiles;
+	u64 ndirs;
+};
+
+/* Allocation groups (see famfs_alloc_group()) */
+#define FAMFS_ALLOC_GROUP_LEN    0x40000000 /* Bytes reserved for a group at a time: 1GiB */
+#define FAMFS_ALLOC_GROUP_MAX    64         /* Groups with a reservation, per locked log */
+#define FAMFS_ALLOC_GROUP_TAGLEN 64
+
+/**
+ * struct famfs_alloc_group - space reserved for the files of one group
+ *
+ * The reservation is not in the free index (so nothing else is allocated there) and
+ * not in the bitmap (so it is not logged); it ends with the locked log, or when it
+ * is released by famfs_alloc_group_release(). Offsets and lengths are in units.
+ *
+ * @tag   - the top-level directory, or the tag set by famfs_alloc_group_set()
+ * @start - the region
+ * @len
+ * @next  - files are allocated from here to the end of the region
+ * @used  - units allocated from the region(s) of this group
+ */
+struct famfs_alloc_group {
+	char tag[FAMFS_ALLOC_GROUP_TAGLEN];
+	u64  start;
+	u64  len;
+	u64  next;
+	u64  used;
+};
+
 struct famfs_locked_log {
 	s64               devsize;
 	struct famfs_log *logp;
 	int               lfd;
 	u64               nbits;
-	u64               cur_pos;
+	u64               cur_pos;      /* Next fit cursor (bit) */
 	u8               *bitmap;
+	int               bitmap_ckpt_used; /* Loaded from the bitmap checkpoint */
 	char              mpt[PATH_MAX];
+
+	/* Free space (see famfs_alloc_contiguous()); built along with the bitmap */
+	struct famfs_free_index free;
+	enum famfs_alloc_policy alloc_policy; /* From the superblock; callers may override */
+	int               max_extents;  /* Per file (1: contiguous only); see famfs_alloc_extents() */
+	u64               alloc_unit;   /* Bytes per bitmap bit (see famfs_sb_alloc_unit()) */
+
+	/* Allocation groups (FAMFS_ALLOC_GROUP_FIT) */
+	struct famfs_alloc_group groups[FAMFS_ALLOC_GROUP_MAX];
+	int               ngroups;
+	char              group_tag[FAMFS_ALLOC_GROUP_TAGLEN]; /* Overrides the directory */
+	u64               group_len;    /* Units reserved at a time (FAMFS_ALLOC_GROUP_LEN) */
+	u64               group_reserved; /* Units reserved and not used yet */
+
+	/* Namespace index, built on demand (see __famfs_rm()) */
+	struct famfs_index *index;
+
+	/* Group commit state (see famfs_log_txn_begin()) */
+	int               txn_active;
+	u64               txn_batch;    /* Max entries published per header update */
+	u64               txn_nstaged;  /* Entries written past famfs_log_next_index */
+	u64               txn_reserved; /* Slots reserved for the current batch */
+	u64               txn_end;      /* Log position after the staged entries */
+
+	/* Counter changes of the entries not published yet (see famfs_log_publish()) */
+	struct famfs_log_counters cnt;
+
+	/* Log segments (see famfs_log_grow()) */
+	struct famfs_log *tail;         /* The log, or the segment entries are appended to */
+	u64               seg_min_len;  /* Size of the first segment (0: FAMFS_LOG_SEG_MIN_LEN) */
+	int               nogrow;       /* Fail appends when the log is full */
 };
 
+/* Extents per file: what fits in both a log entry and a FAMFSIOC_MAP_CREATE */
+#define FAMFS_FILE_MAX_EXTENTS \
+	((FAMFS_FC_MAX_EXTENTS < FAMFS_MAX_EXTENTS) ? FAMFS_FC_MAX_EXTENTS : FAMFS_MAX_EXTENTS)
+
+/* Default number of log entries per group commit batch */
+#define FAMFS_LOG_TXN_BATCH 256
+
+/*
+ * Client-local logplay checkpoint (not stored in famfs). See famfs_logplay_ckpt_start()
+ */
+#define FAMFS_LOGPLAY_CKPT_MAGIC 0xfa3f5c4e
+
+struct famfs_logplay_ckpt {
+	u64     lc_magic;
+	uuid_le lc_fs_uuid;      /* ts_uuid of the file system */
+	u64     lc_log_crc;      /* famfs_log_crc of the log header */
+	u64     lc_log_dev;      /* Identity of the mounted log file, which changes */
+	u64     lc_log_ino;      /*   on every mount/mkmeta */
+	u64     lc_log_ctime_ns;
+	u64     lc_next_seqnum;  /* Seqnum of the first entry that has not been applied */
+	u64     lc_last_crc;     /* crc of the last entry that has been applied */
+	u64     lc_crc;          /* Covers all fields prior to this one */
+};
 
 /* Only exported for unit tests */
 int famfs_validate_log_header(const struct famfs_log *logp);
 int __file_not_famfs(int fd);
-unsigned long famfs_gen_superblock_crc(const struct famfs_superblock *sb);
-unsigned long famfs_gen_log_header_crc(const struct famfs_log *logp);
+unsigned long famfs_gen_superblock_crc(const struct famfs_superblock *sb,
+				       enum famfs_csum_alg alg);
+unsigned long famfs_gen_log_header_crc(const struct famfs_log *logp, enum famfs_csum_alg alg);
 int __famfs_mkfs(const char *daxdev, struct famfs_superblock *sb, struct famfs_log *logp,
 		 u64 log_len, u64 device_size, int force, int kill);
+int __famfs_upgrade_v46(struct famfs_superblock *sb, struct famfs_log *logp, int verbose);
 int __open_relpath(const char *path, const char *relpath, int read_only, size_t *size_out,
 		   char *mpt_out, enum lock_opt lockopt, int no_fscheck);
 int __famfs_cp(struct famfs_locked_log  *lp, const char *srcfile, const char *destfile,
@@ -57,16 +160,126 @@ __famfs_mkfile(struct famfs_locked_log *lp, const char *filename,
 	       mode_t mode, uid_t uid, gid_t gid, size_t size, int verbose);
 int __famfs_mkdir(struct famfs_locked_log *lp, const char *dirpath, mode_t mode,
 		  uid_t uid, gid_t gid, int verbose);
+int __famfs_rm(struct famfs_locked_log *lp, const char *path, int dirs_ok, int verbose);
+
+/**
+ * struct famfs_defrag_stats - what __famfs_defrag() did (or would do, in a dry run)
+ *
+ * @nfiles         - files considered
+ * @nmoved         - files moved
+ * @nerrs          - files that could not be moved
+ * @bytes_moved    - sum of the sizes of the moved files
+ * @largest_before - largest free extent (bytes) before
+ * @largest_after  - ...and after
+ * @free_bytes     - free space (which does not change)
+ */
+struct famfs_defrag_stats {
+	u64 nfiles;
+	u64 nmoved;
+	u64 nerrs;
+	u64 bytes_moved;
+	u64 largest_before;
+	u64 largest_after;
+	u64 free_bytes;
+};
+
+int __famfs_defrag(struct famfs_locked_log *lp, int dry_run, struct famfs_defrag_stats *st,
+		   int verbose);
 int famfs_init_locked_log(struct famfs_locked_log *lp, const char *fspath, int verbose);
+int famfs_alloc_group_set(struct famfs_locked_log *lp, const char *tag);
+u64 famfs_alloc_group_release(struct famfs_locked_log *lp, const char *tag);
+int famfs_alloc_group_affinity(const struct famfs_log *logp, u64 region, u64 *ngrouped,
+			       u64 *nin);
 int famfs_release_locked_log(struct famfs_locked_log *lp);
+int famfs_log_txn_begin(struct famfs_locked_log *lp, u64 batch);
+int famfs_log_txn_reserve_contig(struct famfs_locked_log *lp, u64 n);
+int famfs_log_txn_commit(struct famfs_locked_log *lp);
+void famfs_log_txn_abort(struct famfs_locked_log *lp);
 int __famfs_logplay(const struct famfs_log *logp, const char *mpt, int dry_run,
 		    int client_mode, int verbose);
+int __famfs_logplay_from(const struct famfs_log *logp, const char *mpt, u64 start_seqnum,
+			 u64 *next_seqnum_out, int dry_run, int client_mode, int nthreads,
+			 int verbose);
+void famfs_logplay_ckpt_path(const uuid_le *fs_uuid, char *path_out);
+int famfs_logplay_ckpt_init(struct famfs_logplay_ckpt *ck, const struct famfs_superblock *sb,
+			    const struct famfs_log *logp, int lfd);
+u64 famfs_logplay_ckpt_start(const char *ckpt_path, const struct famfs_logplay_ckpt *cur,
+			     const struct famfs_log *logp, int verbose);
+int famfs_logplay_ckpt_save(const char *ckpt_path, const struct famfs_logplay_ckpt *cur,
+			    const struct famfs_log *logp, u64 next_seqnum);
 int famfs_fsck_scan(const struct famfs_superblock *sb, const struct famfs_log *logp,
 		    int human, int verbose);
 int famfs_create_sys_uuid_file(char *sys_uuid_file);
 int famfs_get_system_uuid(uuid_le *uuid_out);
 void famfs_print_role_string(int role);
-int famfs_validate_log_entry(const struct famfs_log_entry *le, u64 index);
+int famfs_validate_log_entry(const struct famfs_log_entry *le, u64 seqnum);
+int famfs_log_get_snapshot(const struct famfs_log *logp, const struct famfs_snap **snap_out);
+
+/**
+ * struct famfs_log_view - consistent copy of the published fields of the log header
+ *
+ * @gen         - famfs_log_gen when the fields were read (always even)
+ * @next_seqnum, @next_index, @snap_seqnum, @snap_slot - the published fields
+ */
+struct famfs_log_view {
+	u64 gen;
+	u64 next_seqnum;
+	u64 next_index;
+	u64 snap_seqnum;
+	u64 snap_slot;
+};
+
+#define FAMFS_LOG_GEN_SPINS    64     /* Yields before famfs_log_read_header() sleeps */
+#define FAMFS_LOG_GEN_WAIT_US  100000 /* ...and how long it waits for the master */
+#define FAMFS_LOG_READ_RETRIES 8      /* Times a cursor re-reads an invalid entry */
+#define FAMFS_LOG_RETRY_MAX_US 1000   /* Max backoff between those re-reads */
+
+int famfs_log_read_header(const struct famfs_log *logp, struct famfs_log_view *v);
+int famfs_log_read_counters(const struct famfs_log *logp, struct famfs_log_counters *c);
+int famfs_log_attach(const struct famfs_log *logp, const char *path, int raw, int writable);
+void famfs_log_detach(const struct famfs_log *logp);
+
+/**
+ * struct famfs_log_cursor - validated iterator over the published entries of a log
+ *
+ * @logp       - the log, or the segment the cursor is in
+ * @pos        - position of the next entry
+ * @seqnum     - seqnum of the next entry
+ * @end        - position after the last entry to yield
+ * @prefetched - byte offset (in the entry area) up to which entries have been prefetched
+ * @valid_end  - entries before this position were validated by famfs_log_validate()
+ * @snap_seqnum - famfs_log_snap_seqnum when the cursor was started
+ * @retries    - times an invalid entry is re-read before the cursor stops there
+ * @invalid    - set when the cursor stops at an invalid entry
+ * @le         - v2 records are expanded here; v1 entries are yielded in place
+ */
+struct famfs_log_cursor {
+	const struct famfs_log *logp;
+	u64                     pos;
+	u64                     seqnum;
+	u64                     end;
+	u64                     prefetched;
+	u64                     valid_end;
+	u64                     snap_seqnum;
+	u32                     retries;
+	int                     invalid;
+	struct famfs_log_entry  le;
+};
+
+int famfs_log_cursor_init(struct famfs_log_cursor *cur, const struct famfs_log *logp,
+			  u64 start_seqnum);
+int famfs_log_cursor_init_mt(struct famfs_log_cursor *cur, const struct famfs_log *logp,
+			     u64 start_seqnum, u32 nthreads);
+int famfs_log_validate(const struct famfs_log *logp, u64 pos, u64 seqnum, u64 end,
+		       u32 nthreads, u64 *bad_pos_out);
+const struct famfs_log_entry *famfs_log_cursor_next(struct famfs_log_cursor *cur);
+
+#define FAMFS_SCAN_SNAP_SEQNUM ((u64)-1) /* famfs_log_scan() seqnum of snapshot records */
+typedef int (*famfs_log_scan_fn)(const struct famfs_log_entry *le, u64 seqnum, void *arg);
+int famfs_log_scan(const struct famfs_log *logp, u64 start_seqnum, famfs_log_scan_fn fn,
+		   void *arg, u64 *next_seqnum_out);
+int famfs_log_compact(struct famfs_locked_log *lp, int verbose);
+int famfs_log_convert_v2(struct famfs_log *logp, int verbose);
 int famfs_cp(struct famfs_locked_log *lp, const char *srcfile, const char *destfile,
 		mode_t mode, uid_t uid, gid_t gid, int verbose);
 
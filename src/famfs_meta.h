@@ -17,13 +17,15 @@
 #include <linux/uuid.h>
 #include <linux/famfs_ioctl.h>
 #include <assert.h>
+#include <stddef.h>
 
 #include "famfs.h"
 
 #define STATIC_ASSERT(cond, msg) typedef char static_assertion_##msg[(cond) ? 1 : -1]
 
 #define FAMFS_SUPER_MAGIC      0x87b282ff
-#define FAMFS_CURRENT_VERSION  46
+#define FAMFS_CURRENT_VERSION  47 /* Bump on any change to the on-media layout */
+#define FAMFS_VERSION_V46      46 /* Before log snapshots; see famfs_upgrade() */
 #define FAMFS_MAX_DAXDEVS      64
 
 #define FAMFS_LOG_OFFSET    0x200000 /* 2MiB */
@@ -32,14 +34,22 @@
 #define FAMFS_SUPERBLOCK_SIZE FAMFS_LOG_OFFSET
 #define FAMFS_SUPERBLOCK_MAX_DAXDEVS 1
 
-#define FAMFS_ALLOC_UNIT 0x200000 /* 2MiB allocation unit */
+#define FAMFS_ALLOC_UNIT     0x200000   /* 2MiB: default and minimum allocation unit */
+#define FAMFS_ALLOC_UNIT_MAX 0x40000000 /* 1GiB (see FAMFS_SB_ALLOC_UNIT_SHIFT) */
 
 STATIC_ASSERT(!(FAMFS_LOG_LEN & (FAMFS_LOG_LEN - 1)), FAMFS_LOG_LEN_must_be_power_of_2);
 STATIC_ASSERT(!(FAMFS_ALLOC_UNIT & (FAMFS_ALLOC_UNIT - 1)), FAMFS_ALLOC_UNIT_must_be_power_of_2);
 
-static inline size_t round_size_to_alloc_unit(u64 size)
+/* Round @size up to whole @unit sized allocation units (see famfs_sb_alloc_unit()) */
+static inline size_t round_size_to_alloc_unit(u64 size, u64 unit)
 {
-	return ((size + FAMFS_ALLOC_UNIT - 1) / FAMFS_ALLOC_UNIT) * FAMFS_ALLOC_UNIT;
+	return ((size + unit - 1) / unit) * unit;
+}
+
+/* Number of (power of 2) @unit sized allocation units that hold @size bytes */
+static inline u64 famfs_alloc_units(u64 size, u64 unit)
+{
+	return (size + unit - 1) / unit;
 }
 
 #define FAMFS_DEVNAME_LEN 64
@@ -51,8 +61,70 @@ struct famfs_daxdev {
 	char                dd_daxdev[FAMFS_DEVNAME_LEN];
 };
 
+/*
+ * Checksums
+ *
+ * Stored checksums (the superblock, log header, v1 log entry, snapshot and logplay
+ * checkpoint crc fields) are versioned: the algorithm is in the upper 32 bits and the
+ * crc in the lower 32 bits. Everything written before checksums were versioned has
+ * zero in the upper bits, which is FAMFS_CSUM_CRC32 (zlib crc32), so old images keep
+ * validating. v2 log records have 32-bit crcs, computed with the algorithm of the log
+ * header crc.
+ */
+enum famfs_csum_alg {
+	FAMFS_CSUM_CRC32  = 0, /* zlib crc32 */
+	FAMFS_CSUM_CRC32C = 1, /* crc32c (Castagnoli) */
+	FAMFS_CSUM_NALGS,
+};
+
+#define FAMFS_CSUM_DEFAULT FAMFS_CSUM_CRC32C /* For new file systems */
+
+#define FAMFS_CSUM_ALG(v)        ((enum famfs_csum_alg)((u64)(v) >> 32))
+#define FAMFS_CSUM_VAL(alg, crc) (((u64)(alg) << 32) | (u32)(crc))
+
 /* ts_sb_flags */
 #define	FAMFS_PRIMARY_SB  (1 << 0) /* This device is the primary superblock of this famfs instance */
+#define FAMFS_SB_ALLOC_POLICY_SHIFT 8 /* Bits 8-11: default enum famfs_alloc_policy */
+#define FAMFS_SB_ALLOC_POLICY_MASK  (0xf << FAMFS_SB_ALLOC_POLICY_SHIFT)
+#define FAMFS_SB_ALLOC_CONTIG (1 << 12) /* Never split a file into multiple extents */
+#define FAMFS_SB_ALLOC_UNIT_SHIFT 16    /* Bits 16-19: log2(allocation unit / 2MiB) */
+#define FAMFS_SB_ALLOC_UNIT_MASK  (0xf << FAMFS_SB_ALLOC_UNIT_SHIFT)
+
+/*
+ * Allocation policies (see famfs_free_index_alloc()). File systems made before
+ * policies existed have zero in those flag bits, which is first fit.
+ */
+enum famfs_alloc_policy {
+	FAMFS_ALLOC_FIRST_FIT   = 0, /* Lowest offset that fits */
+	FAMFS_ALLOC_NEXT_FIT    = 1, /* Lowest offset that fits after the previous allocation */
+	FAMFS_ALLOC_BEST_FIT    = 2, /* Smallest free extent that fits */
+	FAMFS_ALLOC_ALIGNED_FIT = 3, /* Lowest offset aligned to the size (up to 1GiB) */
+	FAMFS_ALLOC_GROUP_FIT   = 4, /* In a region reserved for the file's top-level directory */
+	FAMFS_ALLOC_NPOLICIES,
+};
+
+static inline enum famfs_alloc_policy
+famfs_sb_alloc_policy(u32 sb_flags)
+{
+	u32 policy = (sb_flags & FAMFS_SB_ALLOC_POLICY_MASK) >> FAMFS_SB_ALLOC_POLICY_SHIFT;
+
+	return (policy < FAMFS_ALLOC_NPOLICIES) ? (enum famfs_alloc_policy)policy
+		: FAMFS_ALLOC_FIRST_FIT;
+}
+
+/*
+ * Allocation unit: 2MiB (the default, and all file systems made before it was
+ * configurable) up to 1GiB. Every extent is a multiple of it, at an offset that is a
+ * multiple of it. Returns 0 if the flags hold an invalid unit (see famfs_check_super())
+ */
+static inline u64
+famfs_sb_alloc_unit(u32 sb_flags)
+{
+	u32 shift = (sb_flags & FAMFS_SB_ALLOC_UNIT_MASK) >> FAMFS_SB_ALLOC_UNIT_SHIFT;
+	u64 unit = (u64)FAMFS_ALLOC_UNIT << shift;
+
+	return (unit <= FAMFS_ALLOC_UNIT_MAX) ? unit : 0;
+}
 
 
 /* Lives at the base of a tagged tax device: */
@@ -108,8 +180,28 @@ enum famfs_log_entry_type {
 	FAMFS_LOG_FILE,    /* This type of log entry creates a file */
 	FAMFS_LOG_MKDIR,
 	FAMFS_LOG_ACCESS,  /* This type of log entry gives a host access to a file */
+	FAMFS_LOG_UNLINK,  /* Removes a file and frees its extents (famfs_fc) */
+	FAMFS_LOG_RMDIR,   /* Removes an empty directory (famfs_md) */
 };
 
+/*
+ * Removal entries carry the same payload as the entries they undo: FAMFS_LOG_UNLINK
+ * has the struct famfs_file_creation of the file (so its extents can be freed without
+ * looking the file up), and FAMFS_LOG_RMDIR the struct famfs_mkdir of the directory.
+ * Snapshots never contain them (compaction drops removed files and directories).
+ */
+static inline int
+famfs_log_type_is_file(u32 type)
+{
+	return (type == FAMFS_LOG_FILE || type == FAMFS_LOG_UNLINK);
+}
+
+static inline int
+famfs_log_type_is_dir(u32 type)
+{
+	return (type == FAMFS_LOG_MKDIR || type == FAMFS_LOG_RMDIR);
+}
+
 #define FAMFS_MAX_PATHLEN 80
 #define FAMFS_MAX_HOSTNAME_LEN 32
 
@@ -167,19 +259,73 @@ struct famfs_log_entry {
 	unsigned long famfs_log_entry_crc;
 };
 
-#define FAMFS_LOG_MAGIC 0xbadcafef00d
+#define FAMFS_LOG_MAGIC    0xbadcafef00d
+#define FAMFS_LOG_MAGIC_V2 0xbadcafef02d /* Variable-length records (log format v2) */
+
+#define FAMFS_LOG_MAX_SEGS    16
+#define FAMFS_LOG_SEG_MIN_LEN 0x2000000  /* 32MiB; each segment is twice the previous one */
+#define FAMFS_LOG_SEG_MAX_LEN 0x40000000 /* 1GiB */
 
 /**
  * @famfs_log - the structure of the famfs log
  *
- * @famfs_log_magic: magic number
+ * @famfs_log_magic: magic number; FAMFS_LOG_MAGIC or FAMFS_LOG_MAGIC_V2
  * @famfs_log_len: total size of the log, including header and all valid entries
  * @famfs_log_last_index:  The last valid index (i.e. inclusive)
- * @famfs_log_crc: crc which covers the preceeding fields, which don't change
+ * @famfs_log_crc: crc which covers the fields that don't change (magic, len,
+ *                 last_index and the snapshot region)
  * @famfs_log_next_seqnum: sequence number for the next log entry
  * @famfs_log_next_index: Index of the next (not yet inserted) log entry
+ * @famfs_log_snap_seqnum: seqnum of entries[0]. Everything logged before it has been
+ *                         compacted into the snapshot (0: there is no snapshot)
+ * @famfs_log_snap_slot: which of the two snapshot slots holds the current snapshot
+ * @famfs_log_snap_offset: offset of the snapshot region within the log file
+ * @famfs_log_snap_len: size of each of the two snapshot slots
+ * @famfs_log_seg_num: 0 in the log file; n in the nth log segment (see below)
+ * @famfs_log_next_seg_offset: device offset of the next log segment (0: none)
+ * @famfs_log_next_seg_len: size of the next log segment
+ * @famfs_log_bmap_offset: device offset of the allocation bitmap checkpoint (0: none;
+ *                         only in the log file, see struct famfs_bmap_ckpt)
+ * @famfs_log_bmap_len: size of the bitmap checkpoint extent
+ * @famfs_log_gen: generation counter; odd while the master is updating the published
+ *                 fields (see famfs_log_read_header())
+ * @famfs_log_cnt_seqnum: the capacity counters below reflect the entries before this
+ *                        seqnum (only in the log file, like the counters)
+ * @famfs_log_cnt_unit: the allocation unit the counters were computed with
+ * @famfs_log_alloc_bytes: allocated space, including the superblock, the log, log
+ *                         segments and the bitmap checkpoint (0: the counters are
+ *                         not maintained yet)
+ * @famfs_log_nfiles: number of files
+ * @famfs_log_ndirs: number of directories
  * @entries: Array of log entries. sizeof famfs_log, including all entries, must be
- *           <= @famfs_log_len
+ *           <= @famfs_log_snap_offset
+ *
+ * @famfs_log_next_seqnum, @famfs_log_next_index, @famfs_log_snap_seqnum and
+ * @famfs_log_snap_slot must be in the same cache line, because publishing new entries
+ * (or a new snapshot) only flushes that line (see the log commit protocol in
+ * famfs_lib.c). @famfs_log_gen is in a cache line of its own with the capacity
+ * counters, so it can be flushed and invalidated independently of them, and a reader
+ * gets the counters and the generation that vouches for them from one line (see
+ * famfs_log_read_counters()).
+ *
+ * The seqnum of the entry at index i is @famfs_log_snap_seqnum + i.
+ *
+ * Log segments: when the log is full, the master allocates a log segment from the
+ * data space and links it from the log header (@famfs_log_next_seg_offset/len); when
+ * that fills up it links another one from the segment header, and so on, up to
+ * FAMFS_LOG_MAX_SEGS. A segment is formatted like the log (same magic and header)
+ * but has no snapshot region, and its @famfs_log_snap_seqnum is the seqnum of its
+ * first entry. A segment continues the log (or segment) that links to it only if
+ * its @famfs_log_snap_seqnum equals that log's @famfs_log_next_seqnum; segments stay
+ * linked across compaction and are reused, so a stale segment fails that test.
+ *
+ * Log format v2 (FAMFS_LOG_MAGIC_V2) uses the same header, but @entries holds packed,
+ * variable-length records (struct famfs_log_rec) rather than fixed-size entries.
+ * @famfs_log_next_index and @famfs_log_last_index are then byte offsets into the
+ * record area, and the seqnum of a record is in its header. Names in v2 records take
+ * only the space they need, but they are still limited to FAMFS_MAX_PATHLEN bytes
+ * (including the nul), as in v1: records are expanded into struct famfs_log_entry
+ * when they are read, and are written from one.
  */
 struct famfs_log {
 	u64     famfs_log_magic;
@@ -188,9 +334,209 @@ struct famfs_log {
 	unsigned long famfs_log_crc;
 	u64     famfs_log_next_seqnum;
 	u64     famfs_log_next_index;
+	u64     famfs_log_snap_seqnum;
+	u64     famfs_log_snap_slot;
+	u64     famfs_log_snap_offset;
+	u64     famfs_log_snap_len;
+	u64     famfs_log_seg_num;
+	u64     famfs_log_next_seg_offset;
+	u64     famfs_log_next_seg_len;
+	u64     famfs_log_bmap_offset;
+	u64     famfs_log_bmap_len;
+	u8      famfs_log_pad0[8];
+	u64     famfs_log_gen;         /* In its own cache line, with the counters */
+	u64     famfs_log_cnt_seqnum;
+	u64     famfs_log_cnt_unit;
+	u64     famfs_log_alloc_bytes;
+	u64     famfs_log_nfiles;
+	u64     famfs_log_ndirs;
+	u8      famfs_log_pad1[16];
+	struct famfs_log_entry entries[];
+};
+
+/*
+ * The log of a version 46 (FAMFS_VERSION_V46) file system, which has none of the
+ * fields after @famfs_log_next_index, and no snapshot region. Its checksums are all
+ * FAMFS_CSUM_CRC32, and the seqnum of the entry at index i is i. famfs_upgrade()
+ * converts it to the current layout in place.
+ */
+struct famfs_log_v46 {
+	u64     famfs_log_magic;
+	u64     famfs_log_len;
+	u64     famfs_log_last_index;
+	unsigned long famfs_log_crc;   /* Covers magic, len and last_index */
+	u64     famfs_log_next_seqnum;
+	u64     famfs_log_next_index;
 	struct famfs_log_entry entries[];
 };
 
+STATIC_ASSERT((offsetof(struct famfs_log, famfs_log_next_seqnum) / 64) ==
+	      ((offsetof(struct famfs_log, famfs_log_snap_slot) + sizeof(u64) - 1) / 64),
+	      famfs_log_published_fields_must_share_a_cache_line);
+STATIC_ASSERT(!(offsetof(struct famfs_log, famfs_log_gen) % 64) &&
+	      (offsetof(struct famfs_log, entries) ==
+	       offsetof(struct famfs_log, famfs_log_gen) + 64),
+	      famfs_log_gen_and_counters_must_have_their_own_cache_line);
+
+/*
+ * The layout of the log header is part of FAMFS_CURRENT_VERSION: if the entries move,
+ * bump the version, and teach famfs_upgrade() to convert logs of the old version.
+ * New header fields come out of the padding, which is zero in older logs.
+ */
+#define FAMFS_LOG_ENTRIES_OFFSET 192
+STATIC_ASSERT(offsetof(struct famfs_log, entries) == FAMFS_LOG_ENTRIES_OFFSET,
+	      famfs_log_layout_change_needs_a_version_bump);
+STATIC_ASSERT(offsetof(struct famfs_log_v46, entries) == 48, famfs_log_v46_layout_is_fixed);
+
+/*
+ * Allocation bitmap checkpoint
+ *
+ * Building the allocation bitmap means scanning the snapshot and the whole log. The
+ * master saves the bitmap it ends up with when it releases the log, and the next
+ * master only folds in the entries logged after @bc_seqnum. The checkpoint lives in
+ * an extent of the data space (linked from the log header, and set in every bitmap
+ * built from the log), exposed as the meta file .meta/.bitmap.
+ *
+ * A checkpoint with a bad magic or crc, a different geometry, or a @bc_seqnum that
+ * was compacted away is ignored, and the bitmap is built from the log; so a master
+ * that dies without saving one costs a slower start, not a wrong bitmap.
+ *
+ * @bc_magic      - FAMFS_BMAP_MAGIC
+ * @bc_seqnum     - the bitmap reflects the log entries before this seqnum
+ * @bc_alloc_unit - bytes per bit
+ * @bc_nbits      - bits in @bc_bitmap
+ * @bc_nfree      - clear bits (free allocation units), so free space can be read
+ *                  without a scan
+ * @bc_cur_pos    - next fit cursor
+ * @bc_crc        - covers the fields before it and @bc_bitmap (log checksum algorithm)
+ */
+#define FAMFS_BMAP_MAGIC 0xb17a9f00d
+
+struct famfs_bmap_ckpt {
+	u64 bc_magic;
+	u64 bc_seqnum;
+	u64 bc_alloc_unit;
+	u64 bc_nbits;
+	u64 bc_nfree;
+	u64 bc_cur_pos;
+	u64 bc_crc;
+	u8  bc_bitmap[];
+};
+
+/*
+ * Log snapshots
+ *
+ * A snapshot is a compact image of everything that was logged before
+ * famfs_log_snap_seqnum: a header followed by packed, variable-length records.
+ * The second half of the log file is the snapshot region, which holds two slots;
+ * a new snapshot is always written to the slot that is not current.
+ */
+#define FAMFS_SNAP_MAGIC 0x5a4a5a4af00d
+
+/**
+ * @famfs_snap - header of a snapshot slot
+ *
+ * @fs_magic:    FAMFS_SNAP_MAGIC
+ * @fs_seqnum:   the snapshot covers all log entries with seqnum < @fs_seqnum
+ * @fs_nrecords: number of records
+ * @fs_nfiles:   number of file records
+ * @fs_ndirs:    number of directory records
+ * @fs_len:      bytes of records after the header
+ * @fs_crc:      covers the preceeding fields and the records
+ */
+struct famfs_snap {
+	u64     fs_magic;
+	u64     fs_seqnum;
+	u64     fs_nrecords;
+	u64     fs_nfiles;
+	u64     fs_ndirs;
+	u64     fs_len;
+	unsigned long fs_crc;
+	u8      fs_records[];
+};
+
+/**
+ * @famfs_snap_rec - a snapshot record (one file or directory)
+ *
+ * Followed by @sr_nextents extents and then the nul-terminated relative path
+ * (@sr_namelen bytes, including the nul). Records are padded to 8 bytes.
+ */
+struct famfs_snap_rec {
+	u16     sr_type;      /* FAMFS_LOG_FILE or FAMFS_LOG_MKDIR (or, in v2 log records,
+			       * FAMFS_LOG_UNLINK or FAMFS_LOG_RMDIR) */
+	u16     sr_namelen;
+	u32     sr_nextents;
+	u32     sr_flags;
+	uid_t   sr_uid;
+	gid_t   sr_gid;
+	mode_t  sr_mode;
+	u64     sr_size;
+	struct famfs_simple_extent sr_ext[];
+};
+
+static inline size_t
+famfs_snap_rec_size(u32 nextents, u16 namelen)
+{
+	size_t len = sizeof(struct famfs_snap_rec)
+		+ nextents * sizeof(struct famfs_simple_extent) + namelen;
+
+	return (len + 7) & ~7UL;
+}
+
+/**
+ * @famfs_log_rec - a log format v2 record
+ *
+ * @lr_len:    length of the record in bytes, including this header (a multiple of 8)
+ * @lr_crc:    crc of the rest of the record (from @lr_seqnum through @lr_len), with
+ *             the checksum algorithm of the log
+ * @lr_seqnum: sequence number of the record
+ * @lr_body:   a struct famfs_snap_rec: the record type, inline extents sized to the
+ *             actual extent count, and a variable-length name
+ */
+struct famfs_log_rec {
+	u32     lr_len;
+	u32     lr_crc;
+	u64     lr_seqnum;
+	u8      lr_body[];
+};
+
+static inline size_t
+famfs_log_rec_size(u32 nextents, u16 namelen)
+{
+	return sizeof(struct famfs_log_rec) + famfs_snap_rec_size(nextents, namelen);
+}
+
+static inline int
+famfs_log_is_v2(const struct famfs_log *logp)
+{
+	return (logp->famfs_log_magic == FAMFS_LOG_MAGIC_V2);
+}
+
+/* The checksum algorithm of a log is the algorithm of its header crc */
+static inline enum famfs_csum_alg
+famfs_log_csum_alg(const struct famfs_log *logp)
+{
+	return FAMFS_CSUM_ALG(logp->famfs_log_crc);
+}
+
+/* Address of log position @pos: an entry index (v1) or a byte offset (v2) */
+static inline void *
+famfs_log_pos_addr(const struct famfs_log *logp, u64 pos)
+{
+	if (famfs_log_is_v2(logp))
+		return (u8 *)logp->entries + pos;
+	return (void *)&logp->entries[pos];
+}
+
+/* Size in bytes of the log between positions @from and @to */
+static inline u64
+famfs_log_pos_bytes(const struct famfs_log *logp, u64 from, u64 to)
+{
+	if (famfs_log_is_v2(logp))
+		return to - from;
+	return (to - from) * sizeof(logp->entries[0]);
+}
+
 static inline s64
 log_slots_available(struct famfs_log *logp)
 {
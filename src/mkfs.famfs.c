@@ -22,6 +22,7 @@
 
 #include "famfs.h"
 #include "famfs_lib.h"
+#include "famfs_alloc.h"
 
 void
 print_usage(int   argc,
@@ -42,6 +43,19 @@ print_usage(int   argc,
 	       "    -k|--kill  - Will 'kill' the superblock (also requires -f)\n"
 	       "    -l|--loglen <loglen> - Default loglen: 8 MiB\n"
 	       "                           Valid range: >= 8 MiB\n"
+	       "    -2|--log-v2 - Use log format v2 (packed, variable-length log records)\n"
+	       "    -a|--alloc <first|next|best|aligned|group> - Default allocation policy\n"
+	       "                           first:   lowest free extent that fits (default)\n"
+	       "                           next:    first fit after the previous allocation\n"
+	       "                           best:    smallest free extent that fits\n"
+	       "                           aligned: lowest offset aligned to the allocation size\n"
+	       "                           group:   files of each top-level directory together,\n"
+	       "                                    in regions reserved for that directory\n"
+	       "    -c|--contiguous - Never split a file into multiple extents (by default, a\n"
+	       "                      file that does not fit in any free extent is split)\n"
+	       "    -u|--alloc-unit <size> - Allocation unit: a power of 2 from 2m (the default)\n"
+	       "                           to 1g. With 1g units, files are 1GiB aligned, and can\n"
+	       "                           be mapped with PUD (1GiB) pages\n"
 	       "\n",
 	       progname, progname);
 }
@@ -57,6 +71,10 @@ struct option global_options[] = {
 	 */
 	{"kill",        no_argument,       &kill_super,    'k'},
 	{"loglen",      required_argument, 0,              'l'},
+	{"log-v2",      no_argument,       0,              '2'},
+	{"alloc",       required_argument, 0,              'a'},
+	{"contiguous",  no_argument,       0,              'c'},
+	{"alloc-unit",  required_argument, 0,              'u'},
 	{0, 0, 0, 0}
 };
 
@@ -67,15 +85,19 @@ main(int argc, char *argv[])
 
 	int arg_ct = 0;
 	char *daxdev = NULL;
+	int log_v2 = 0;
 	int force = 0;
 	u64 loglen = 0x800000;
+	int alloc_policy = FAMFS_ALLOC_FIRST_FIT;
+	int contiguous = 0;
+	u64 alloc_unit = 0;
 
 	/* Process global options, if any */
 	/* Note: the "+" at the beginning of the arg string tells getopt_long
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+fkl:h?",
+	while ((c = getopt_long(argc, argv, "+fkl:2a:cu:h?",
 				global_options, &optind)) != EOF) {
 		char *endptr;
 		s64 mult;
@@ -97,6 +119,26 @@ main(int argc, char *argv[])
 				loglen *= mult;
 			printf("loglen: %lld\n", loglen);
 			break;
+		case '2':
+			log_v2++;
+			break;
+		case 'a':
+			alloc_policy = famfs_alloc_policy_parse(optarg);
+			if (alloc_policy < 0) {
+				fprintf(stderr, "mkfs.famfs: invalid allocation policy %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			contiguous++;
+			break;
+		case 'u':
+			alloc_unit = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult > 0)
+				alloc_unit *= mult;
+			break;
 		case 'h':
 		case '?':
 			print_usage(argc, argv);
@@ -109,8 +151,14 @@ main(int argc, char *argv[])
 		return -1;
 	}
 
-	/* TODO: multiple devices? */
 	daxdev = argv[optind++];
+	if (optind < argc) {
+		/* File maps have no device index; see "Single device" in quirks-bugs-features */
+		fprintf(stderr, "mkfs.famfs: only one memory device is supported; to stripe\n"
+			"    across devices, create an interleaved region and use its device\n");
+		return -1;
+	}
 
-	return famfs_mkfs(daxdev, loglen, kill_super, force);
+	return famfs_mkfs(daxdev, loglen, kill_super, force, log_v2, alloc_policy,
+			  contiguous, alloc_unit);
 }
@@ -6,28 +6,135 @@
 #define H_MU_MEM
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/user.h>
 #include <sys/param.h>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#include <cpuid.h>
+#endif
 
 extern int mock_flush;
 
 #define CL_SIZE 64
 #define CL_SHIFT 6
 
+/*
+ * Cache line flush instructions, picked at runtime (see mu_flush_insn()). clflush is
+ * ordered against other clflushes, so a large range is flushed one line at a time;
+ * clflushopt and clwb are only ordered by fences, so the lines of a range are flushed
+ * in parallel and followed by a single sfence. clwb writes a line back but may leave
+ * it in the cache, so it is only used to flush what this host wrote, never to
+ * invalidate.
+ */
+enum mu_flush_insn {
+	MU_FLUSH_CLFLUSH = 0,
+	MU_FLUSH_CLFLUSHOPT,
+	MU_FLUSH_CLWB,
+	MU_FLUSH_NINSNS,
+};
+
+/* Mask of the enum mu_flush_insn this cpu supports (1 << insn) */
+static inline unsigned int
+mu_flush_insns(void)
+{
+	static unsigned int insns; /* Per translation unit; 0 until cpuid has been read */
+	unsigned int m = 1 << MU_FLUSH_CLFLUSH;
+
+	if (insns)
+		return insns;
+#if defined(__x86_64__)
+	{
+		unsigned int a, b, c, d;
+
+		if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+			if (b & bit_CLFLUSHOPT)
+				m |= 1 << MU_FLUSH_CLFLUSHOPT;
+			if (b & bit_CLWB)
+				m |= 1 << MU_FLUSH_CLWB;
+		}
+	}
+#endif
+	insns = m;
+	return m;
+}
+
+/**
+ * mu_flush_insn() - the instruction to flush with
+ *
+ * @evict - the lines must leave the cache (so that they are re-read from memory)
+ */
+static inline enum mu_flush_insn
+mu_flush_insn(int evict)
+{
+	unsigned int insns = mu_flush_insns();
+
+	if (!evict && (insns & (1 << MU_FLUSH_CLWB)))
+		return MU_FLUSH_CLWB;
+	if (insns & (1 << MU_FLUSH_CLFLUSHOPT))
+		return MU_FLUSH_CLFLUSHOPT;
+	return MU_FLUSH_CLFLUSH;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("clflushopt")))
 static inline void
-__flush_processor_cache(const void *addr, size_t len)
+__mu_clflushopt_range(const char *p, const char *end)
 {
-	int64_t i;
-	const char *buffer = (const char *)addr;
+	for (; p < end; p += CL_SIZE)
+		__builtin_ia32_clflushopt((void *)p);
+	_mm_sfence();
+}
+
+__attribute__((target("clwb")))
+static inline void
+__mu_clwb_range(const char *p, const char *end)
+{
+	for (; p < end; p += CL_SIZE)
+		__builtin_ia32_clwb((void *)p);
+	_mm_sfence();
+}
+#endif
 
+/**
+ * __mu_flush_range() - flush a range with a specific instruction
+ *
+ * Includes the partial cache lines at either end if the range is not cache line
+ * aligned. clflushopt and clwb are followed by an sfence, which orders them before
+ * later stores. @insn must be supported (see mu_flush_insns()).
+ */
+static inline void
+__mu_flush_range(const void *addr, size_t len, enum mu_flush_insn insn)
+{
+	const char *end = (const char *)addr + len;
+	const char *p = (const char *)((uintptr_t)addr & ~(uintptr_t)(CL_SIZE - 1));
+
+	switch (insn) {
+#if defined(__x86_64__)
+	case MU_FLUSH_CLWB:
+		__mu_clwb_range(p, end);
+		break;
+	case MU_FLUSH_CLFLUSHOPT:
+		__mu_clflushopt_range(p, end);
+		break;
+#endif
+	default:
+		for (; p < end; p += CL_SIZE)
+			__builtin_ia32_clflush(p);
+		break;
+	}
+}
+
+/* Write back and evict the lines of a range */
+static inline void
+__flush_processor_cache(const void *addr, size_t len)
+{
 	if (mock_flush)
 		return;
 
-	/* Flush the processor cache for the target range */
-	for (i=0; i<len; i+=CL_SIZE)
-		__builtin_ia32_clflush(&buffer[i]);
-
+	__mu_flush_range(addr, len, mu_flush_insn(1));
 }
 
 /**
@@ -56,7 +163,53 @@ flush_processor_cache(const void *addr, size_t len)
 
 	/* Barier before clflush to guaranntee all prior memory mutations are flushed */
 	__sync_synchronize();
-	__flush_processor_cache(addr, len);
+	__mu_flush_range(addr, len, mu_flush_insn(0));
+}
+
+/**
+ * stream_copy_to_memory() - copy data that other hosts will read from memory
+ *
+ * On x86_64 the aligned body is written with non-temporal stores, which go around the
+ * cache (so it needs no flush, and a big copy doesn't evict everything else) and are
+ * fenced at the end. The unaligned head and tail are copied and flushed normally.
+ */
+static inline void
+stream_copy_to_memory(void *dst, const void *src, size_t len)
+{
+#if defined(__x86_64__)
+	const char *s = (const char *)src;
+	char *d = (char *)dst;
+	size_t head = MIN((-(uintptr_t)d) & 15, len);
+
+	if (head) {
+		memcpy(d, s, head);
+		flush_processor_cache(d, head);
+		d += head;
+		s += head;
+		len -= head;
+	}
+	for (; len >= 64; d += 64, s += 64, len -= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	for (; len >= 16; d += 16, s += 16, len -= 16)
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	_mm_sfence();
+	if (len) {
+		memcpy(d, s, len);
+		flush_processor_cache(d, len);
+	}
+#else
+	memcpy(dst, src, len);
+	flush_processor_cache(dst, len);
+#endif
 }
 
 /**
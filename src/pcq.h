@@ -17,6 +17,7 @@
  * @bucket_size         - bucket size, inclusive of crc in the last 32 bits
  * @bucket_array_offset - offset within this file of the first bucket
  * @producer_index      - index of the last valid entry; empty if == consumer_index
+ * @pcq_csum            - PCQ_CSUM_TAG and the bucket checksum algorithm (see pcq_csum_alg())
  * @next_seq            - next seq number (not in same cacche line as producer_index)
  */
 struct pcq {
@@ -25,11 +26,15 @@ struct pcq {
 	u64 bucket_size;
 	u64 bucket_array_offset;
 	u64 producer_index;
-	char pad[1024];
+	u64 pcq_csum;
+	char pad[1024 - sizeof(u64)];
 	u64 next_seq;
 	u64 pcq_size;
 };
 
+/* Queues created before pcq_csum existed have whatever was in the pad there */
+#define PCQ_CSUM_TAG 0xc5c5c5c5ULL
+
 /**
  * struct @pcq_consumer
  *
@@ -66,6 +71,15 @@ pcq_crc_offset(struct pcq *pcq)
 	return pcq->bucket_size - sizeof(unsigned long);
 }
 
+/* Checksum algorithm of the buckets: zlib crc32 unless the queue says otherwise */
+static inline enum famfs_csum_alg
+pcq_csum_alg(const struct pcq *pcq)
+{
+	if ((pcq->pcq_csum >> 32) != PCQ_CSUM_TAG || (u32)pcq->pcq_csum >= FAMFS_CSUM_NALGS)
+		return FAMFS_CSUM_CRC32;
+	return (enum famfs_csum_alg)(u32)pcq->pcq_csum;
+}
+
 enum pcq_role {
 	PRODUCER,
 	CONSUMER,
@@ -25,7 +25,6 @@
 #include <libgen.h>
 #include <assert.h>
 #include <sys/param.h> /* MIN()/MAX() */
-#include <zlib.h>
 #include <sys/file.h>
 #include <dirent.h>
 #include <linux/famfs_ioctl.h>
@@ -37,6 +36,7 @@
 #include "mu_mem.h"
 #include "random_buffer.h"
 #include "famfs.h"
+#include "famfs_csum.h"
 #include "pcq.h"
 
 extern int mock_flush;
@@ -222,12 +222,14 @@ pcq_create(
 	pcq->bucket_size = bucket_size;
 	pcq->bucket_array_offset = two_mb;
 	pcq->producer_index = 0ULL;
+	pcq->pcq_csum = (PCQ_CSUM_TAG << 32) | FAMFS_CSUM_DEFAULT;
 	pcq->next_seq = 0;
 	pcq->pcq_size = psz;
 	flush_processor_cache(pcq, sizeof(*pcq));
 
 	if (verbose) {
-		printf("%s: sizeof(crc)=%ld\n", __func__, sizeof(unsigned long));
+		printf("%s: sizeof(crc)=%ld (%s)\n", __func__, sizeof(unsigned long),
+		       famfs_csum_name(pcq_csum_alg(pcq)));
 		printf("%s: bucket_size=%lld\n", __func__, pcq->bucket_size);
 		printf("%s: payload_size=%ld\n", __func__, pcq_payload_size(pcq));
 	}
@@ -282,7 +284,8 @@ pcq_open(
 	pcqh->pcqc = pcqc;
 
 	if (verbose) {
-		printf("%s: sizeof(crc)=%ld\n", __func__, sizeof(unsigned long));
+		printf("%s: sizeof(crc)=%ld (%s)\n", __func__, sizeof(unsigned long),
+		       famfs_csum_name(pcq_csum_alg(pcq)));
 		printf("%s: bucket_size=%lld\n", __func__, pcq->bucket_size);
 		printf("%s: payload_size=%ld\n", __func__, pcq_payload_size(pcq));
 	}
@@ -320,7 +323,7 @@ pcq_producer_put(
 	void  *entry,
 	struct pcq_thread_arg *a)
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
+	unsigned long crc;
 	struct pcq_consumer *pcqc = pcqh->pcqc;
 	struct pcq *pcq = pcqh->pcq;
 	u64 crc_offset, seq_offset;
@@ -370,7 +373,7 @@ pcq_producer_put(
 
 	/* Set seq and crc in entry before we memcpy it into the bucket */
 	*seqp = pcq->next_seq++;
-	crc = crc32(crc, entry, pcq_payload_size(pcq) + sizeof(*seqp));
+	crc = famfs_csum(pcq_csum_alg(pcq), 0, entry, pcq_payload_size(pcq) + sizeof(*seqp));
 	*crcp = crc;
 
 	if (a->verbose) {
@@ -473,7 +476,6 @@ pcq_consumer_get(
 	 * entry. If the crc is bad, invalidate the cache for the entry and retry
 	 */
 	while (true) {
-		crc = crc32(0L, Z_NULL, 0);
 		invalidate_processor_cache(bucket_addr, pcq->bucket_size);
 		memcpy(entry_out, bucket_addr, pcq->bucket_size);
 
@@ -483,7 +485,8 @@ pcq_consumer_get(
 		crcp = (unsigned long *)((u64)entry_out + crc_offset);
 		seqp = (u64 *)((u64)entry_out + seq_offset);
 
-		crc = crc32(crc, entry_out, pcq_payload_size(pcq) + sizeof(*seqp));
+		crc = famfs_csum(pcq_csum_alg(pcq), 0, entry_out,
+				 pcq_payload_size(pcq) + sizeof(*seqp));
 
 		if (crc == *crcp) /* Good crc, good entry */
 			break;